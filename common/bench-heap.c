@@ -0,0 +1,149 @@
+/* Benchmark comparing the generic heap functions in heap.h with the
+   type-specialized heaps in dheap.h, on a workload resembling the server's
+   event queue: a steady-state queue where each popped event is replaced by
+   one scheduled a random delay later. */
+
+#include "heap.h"
+#include "dheap.h"
+#include "timeval.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define QUEUE_SIZE     100000
+#define OPERATIONS    2000000
+#define MAX_DELAY     3000000   /* microseconds */
+
+/* Roughly the old layout of an Event: a timeval, type and payload. */
+typedef struct Big
+{
+    struct timeval  time;
+    int             type;
+    unsigned short  x, y, z, old_t, new_t;
+} Big;
+
+/* A 64-bit key plus an index into a separate array of payloads. */
+typedef struct Small
+{
+    unsigned long long  usec;
+    int                 index;
+} Small;
+
+static Big      g_big[QUEUE_SIZE];
+static Small    g_small[QUEUE_SIZE];
+
+static int big_cmp(const void *a, const void *b)
+{
+    return -tv_cmp(&((const Big*)a)->time, &((const Big*)b)->time);
+}
+
+#define big_key(b)   ((unsigned long long)(b).time.tv_sec*1000000 + \
+                      (unsigned long long)(b).time.tv_usec)
+#define small_key(s) ((s).usec)
+
+DHEAP_DEFINE(big_heap, Big, big_key)
+DHEAP_DEFINE(small_heap, Small, small_key)
+
+static Big make_big(unsigned long long usec)
+{
+    Big b;
+    b.time.tv_sec  = usec/1000000;
+    b.time.tv_usec = usec%1000000;
+    b.type = 4;
+    b.x = b.y = b.z = b.old_t = b.new_t = 0;
+    return b;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start)/CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, double secs, unsigned long long check)
+{
+    printf( "%-32s %8.3f s  %7.1f ns/op  (checksum %llu)\n",
+            name, secs, 1e9*secs/OPERATIONS, check );
+}
+
+static void bench_generic()
+{
+    unsigned long long check = 0;
+    clock_t start;
+    size_t n;
+    int i;
+
+    srand(1);
+    for (n = 0; n < QUEUE_SIZE; ++n)
+    {
+        Big b = make_big(rand()%MAX_DELAY);
+        heap_push(g_big, n, sizeof(Big), big_cmp, &b);
+    }
+
+    start = clock();
+    for (i = 0; i < OPERATIONS; ++i)
+    {
+        Big b;
+        heap_pop(g_big, n, sizeof(Big), big_cmp, &b);
+        check += big_key(b);
+        b = make_big(big_key(b) + rand()%MAX_DELAY);
+        heap_push(g_big, n - 1, sizeof(Big), big_cmp, &b);
+    }
+    report("heap.c, 32-byte elements", elapsed(start), check);
+}
+
+static void bench_dheap_big()
+{
+    unsigned long long check = 0;
+    clock_t start;
+    size_t n;
+    int i;
+
+    srand(1);
+    for (n = 0; n < QUEUE_SIZE; ++n)
+        big_heap_push(g_big, n, make_big(rand()%MAX_DELAY));
+
+    start = clock();
+    for (i = 0; i < OPERATIONS; ++i)
+    {
+        Big b = big_heap_pop(g_big, n);
+        check += big_key(b);
+        big_heap_push(g_big, n - 1, make_big(big_key(b) + rand()%MAX_DELAY));
+    }
+    report("dheap.h, 32-byte elements", elapsed(start), check);
+}
+
+static void bench_dheap_small()
+{
+    unsigned long long check = 0;
+    clock_t start;
+    size_t n;
+    int i;
+
+    srand(1);
+    for (n = 0; n < QUEUE_SIZE; ++n)
+    {
+        g_small[n].usec  = rand()%MAX_DELAY;
+        g_small[n].index = n;
+    }
+    small_heap_create(g_small, n);
+
+    start = clock();
+    for (i = 0; i < OPERATIONS; ++i)
+    {
+        Small s = small_heap_pop(g_small, n);
+        check += s.usec;
+        s.usec += rand()%MAX_DELAY;
+        small_heap_push(g_small, n - 1, s);
+    }
+    report("dheap.h, 16-byte elements", elapsed(start), check);
+}
+
+int main()
+{
+    printf( "%d operations on a queue of %d elements:\n",
+            OPERATIONS, QUEUE_SIZE );
+    bench_generic();
+    bench_dheap_big();
+    bench_dheap_small();
+    return 0;
+}
@@ -0,0 +1,192 @@
+/* Benchmark comparing the region scanning functions in region.h with plain
+   triple loops over level_get_block() in x/y/z order, as the server used to
+   do, on a level resembling a typical world: solid ground with some pools of
+   water and lava and scattered plants. Results are checked to agree. */
+
+#include "region.h"
+#include "blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define QUERIES     200000
+
+static Level *g_level;
+
+static void generate()
+{
+    int x, y, z, i;
+
+    g_level = level_create(LEVEL_SIZE_X, LEVEL_SIZE_Y, LEVEL_SIZE_Z);
+    if (g_level == NULL) exit(1);
+    srand(1);
+    for (x = 0; x < LEVEL_SIZE_X; ++x)
+    {
+        for (z = 0; z < LEVEL_SIZE_Z; ++z)
+        {
+            int h = LEVEL_SIZE_Y/2 + rand()%3;
+            for (y = 0; y < h - 3; ++y)
+                level_set_block(g_level, x, y, z, BLOCK_STONE_GREY);
+            for ( ; y < h; ++y)
+                level_set_block(g_level, x, y, z, BLOCK_DIRT);
+            level_set_block(g_level, x, y, z, BLOCK_GRASS);
+            if (rand()%50 == 0)
+                level_set_block(g_level, x, y + 1, z, BLOCK_FLOWER_RED);
+        }
+    }
+    for (i = 0; i < 40; ++i)
+    {
+        int px = rand()%LEVEL_SIZE_X, pz = rand()%LEVEL_SIZE_Z, r = 2 + rand()%6;
+        Type t = rand()%4 ? BLOCK_WATER2 : BLOCK_LAVA2;
+        for (x = px - r; x <= px + r; ++x)
+        {
+            for (z = pz - r; z <= pz + r; ++z)
+            {
+                for (y = LEVEL_SIZE_Y/2 - 2; y <= LEVEL_SIZE_Y/2 + 2; ++y)
+                {
+                    if (level_index_valid(g_level, x, y, z))
+                        level_set_block(g_level, x, y, z, t);
+                }
+            }
+        }
+    }
+}
+
+static bool naive_find(const Box *b, const TypeSet *types)
+{
+    int x, y, z;
+
+    for (x = b->x1; x < b->x2; ++x)
+    {
+        for (y = b->y1; y < b->y2; ++y)
+        {
+            for (z = b->z1; z < b->z2; ++z)
+            {
+                if (type_set_has(types, level_get_block(g_level, x, y, z)))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int naive_count(const Box *b, const TypeSet *types)
+{
+    int x, y, z, n = 0;
+
+    for (x = b->x1; x < b->x2; ++x)
+    {
+        for (y = b->y1; y < b->y2; ++y)
+        {
+            for (z = b->z1; z < b->z2; ++z)
+                n += type_set_has(types, level_get_block(g_level, x, y, z));
+        }
+    }
+    return n;
+}
+
+static void count_cb(void *arg, int x, int y, int z, Type t)
+{
+    (void)x; (void)y; (void)z; (void)t;
+    ++*(int*)arg;
+}
+
+static Box random_box(int d)
+{
+    /* Concentrate queries around the surface, where events happen */
+    return box_around( g_level, rand()%LEVEL_SIZE_X,
+                       LEVEL_SIZE_Y/2 - 8 + rand()%16,
+                       rand()%LEVEL_SIZE_Z, d );
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start)/CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, double secs, long check)
+{
+    printf( "%-40s %7.1f ns/query  (result %ld)\n",
+            name, 1e9*secs/QUERIES, check );
+}
+
+static void bench(const char *what, int d, const TypeSet *types)
+{
+    char name[64];
+    clock_t start;
+    long check[4] = { 0, 0, 0, 0 };
+    int i;
+
+    printf("%s in %d^3 boxes:\n", what, 2*d + 1);
+
+    srand(2);
+    start = clock();
+    for (i = 0; i < QUERIES; ++i)
+    {
+        Box b = random_box(d);
+        check[0] += naive_find(&b, types);
+    }
+    report("  find, x/y/z loops", elapsed(start), check[0]);
+
+    srand(2);
+    start = clock();
+    for (i = 0; i < QUERIES; ++i)
+    {
+        Box b = random_box(d);
+        check[1] += region_find(g_level, &b, types, NULL);
+    }
+    report("  find, region_find()", elapsed(start), check[1]);
+
+    srand(2);
+    start = clock();
+    for (i = 0; i < QUERIES; ++i)
+    {
+        Box b = random_box(d);
+        check[2] += naive_count(&b, types);
+    }
+    report("  count, x/y/z loops", elapsed(start), check[2]);
+
+    srand(2);
+    start = clock();
+    for (i = 0; i < QUERIES; ++i)
+    {
+        Box b = random_box(d);
+        check[3] += region_count(g_level, &b, types);
+    }
+    report("  count, region_count()", elapsed(start), check[3]);
+
+    srand(2);
+    start = clock();
+    check[3] = 0;
+    for (i = 0; i < QUERIES; ++i)
+    {
+        Box b = random_box(d);
+        int n = 0;
+        region_for_each(g_level, &b, types, count_cb, &n);
+        check[3] += n;
+    }
+    snprintf(name, sizeof(name), "  count, region_for_each()");
+    report(name, elapsed(start), check[3]);
+
+    if (check[0] != check[1] || check[2] != check[3])
+    {
+        printf("MISMATCH!\n");
+        exit(1);
+    }
+}
+
+int main()
+{
+    TypeSet fluids = type_set_range(BLOCK_WATER1, BLOCK_LAVA2);
+    TypeSet plants = type_set_range(BLOCK_FLOWER_YELLOW, BLOCK_TOADSTOOL);
+    TypeSet sponge = type_set_range(BLOCK_SPONGE, BLOCK_SPONGE);
+
+    type_set_add(&plants, BLOCK_SAPLING);
+    generate();
+    bench("Fluids", SPONGE_RANGE, &fluids);
+    bench("Fluids", 16, &fluids);
+    bench("Plants (non-contiguous set)", 3, &plants);
+    bench("Sponges (absent)", 3, &sponge);
+    level_free(g_level);
+    return 0;
+}
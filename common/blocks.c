@@ -0,0 +1,216 @@
+#include "blocks.h"
+#include "logging.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Shorthands for the built-in definitions below: */
+#define SOLID       (BLOCK_FLAG_OPAQUE | BLOCK_FLAG_SOLID)
+#define BUILD       (SOLID | BLOCK_FLAG_PLACE)
+#define FLUID       (BLOCK_FLAG_OPAQUE | BLOCK_FLAG_REPLACE)
+#define PLANT       (BLOCK_FLAG_PLANT | BLOCK_FLAG_PLACE)
+#define DEF(t, name, flags) [t] = { name, t, flags }
+
+BlockInfo g_blocks[256] = {
+    DEF(BLOCK_EMPTY,         "empty",         0),
+    DEF(BLOCK_STONE_GREY,    "stone_grey",    BUILD),
+    DEF(BLOCK_GRASS,         "grass",         SOLID | BLOCK_FLAG_SOIL |
+                                              BLOCK_FLAG_DELETE),
+    DEF(BLOCK_DIRT,          "dirt",          BUILD | BLOCK_FLAG_SOIL),
+    DEF(BLOCK_ROCK,          "rock",          BUILD),
+    DEF(BLOCK_WOOD,          "wood",          BUILD),
+    DEF(BLOCK_SAPLING,       "sapling",       PLANT),
+    DEF(BLOCK_ADMINIUM,      "adminium",      SOLID | BLOCK_FLAG_PLACE_ADMIN),
+    DEF(BLOCK_WATER1,        "water1",        FLUID | BLOCK_FLAG_WATER),
+    DEF(BLOCK_WATER2,        "water2",        FLUID | BLOCK_FLAG_WATER |
+                                              BLOCK_FLAG_PLACE_ADMIN),
+    DEF(BLOCK_LAVA1,         "lava1",         FLUID | BLOCK_FLAG_LAVA),
+    DEF(BLOCK_LAVA2,         "lava2",         FLUID | BLOCK_FLAG_LAVA |
+                                              BLOCK_FLAG_PLACE_ADMIN),
+    DEF(BLOCK_STONE_YELLOW,  "stone_yellow",  BUILD | BLOCK_FLAG_FALLING),
+    DEF(BLOCK_STONE_MIXED,   "stone_mixed",   BUILD | BLOCK_FLAG_FALLING),
+    DEF(BLOCK_ORE1,          "ore1",          SOLID | BLOCK_FLAG_DELETE),
+    DEF(BLOCK_ORE2,          "ore2",          SOLID | BLOCK_FLAG_DELETE),
+    DEF(BLOCK_ORE3,          "ore3",          SOLID | BLOCK_FLAG_DELETE),
+    DEF(BLOCK_TRUNK,         "trunk",         BUILD),
+    DEF(BLOCK_LEAVES,        "leaves",        BLOCK_FLAG_SOLID |
+                                              BLOCK_FLAG_PLACE),
+    DEF(BLOCK_SPONGE,        "sponge",        BUILD),
+    DEF(BLOCK_GLASS,         "glass",         BLOCK_FLAG_SOLID |
+                                              BLOCK_FLAG_PLACE),
+    DEF(BLOCK_COLORED1,      "colored1",      BUILD),
+    DEF(BLOCK_COLORED2,      "colored2",      BUILD),
+    DEF(BLOCK_COLORED3,      "colored3",      BUILD),
+    DEF(BLOCK_COLORED4,      "colored4",      BUILD),
+    DEF(BLOCK_COLORED5,      "colored5",      BUILD),
+    DEF(BLOCK_COLORED6,      "colored6",      BUILD),
+    DEF(BLOCK_COLORED7,      "colored7",      BUILD),
+    DEF(BLOCK_COLORED8,      "colored8",      BUILD),
+    DEF(BLOCK_COLORED9,      "colored9",      BUILD),
+    DEF(BLOCK_COLORED10,     "colored10",     BUILD),
+    DEF(BLOCK_COLORED11,     "colored11",     BUILD),
+    DEF(BLOCK_COLORED12,     "colored12",     BUILD),
+    DEF(BLOCK_COLORED13,     "colored13",     BUILD),
+    DEF(BLOCK_COLORED14,     "colored14",     BUILD),
+    DEF(BLOCK_COLORED15,     "colored15",     BUILD),
+    DEF(BLOCK_COLORED16,     "colored16",     BUILD),
+    DEF(BLOCK_FLOWER_YELLOW, "flower_yellow", PLANT),
+    DEF(BLOCK_FLOWER_RED,    "flower_red",    PLANT),
+    DEF(BLOCK_MUSHROOM,      "mushroom",      PLANT),
+    DEF(BLOCK_TOADSTOOL,     "toadstool",     PLANT),
+    DEF(BLOCK_GOLD,          "gold",          BUILD),
+    [BLOCK_SUPERSPONGE] = { "supersponge", BLOCK_SPONGE,
+                            SOLID | BLOCK_FLAG_PLACE_ADMIN } };
+
+Type g_tilesets[MAX_TILESETS][256] = {
+    [1] = { [BLOCK_COLORED1]  = BLOCK_LAVA2,          /* red */
+            [BLOCK_COLORED3]  = BLOCK_SUPERSPONGE,    /* yellow */
+            [BLOCK_COLORED8]  = BLOCK_WATER2,         /* blue */
+            [BLOCK_COLORED14] = BLOCK_ADMINIUM } };   /* grey */
+
+int g_num_tilesets = 2;
+
+static const struct { const char *name; unsigned flag; } g_flag_names[] = {
+    { "water",       BLOCK_FLAG_WATER },
+    { "lava",        BLOCK_FLAG_LAVA },
+    { "plant",       BLOCK_FLAG_PLANT },
+    { "soil",        BLOCK_FLAG_SOIL },
+    { "opaque",      BLOCK_FLAG_OPAQUE },
+    { "solid",       BLOCK_FLAG_SOLID },
+    { "falling",     BLOCK_FLAG_FALLING },
+    { "place",       BLOCK_FLAG_PLACE },
+    { "place-admin", BLOCK_FLAG_PLACE_ADMIN },
+    { "delete",      BLOCK_FLAG_DELETE },
+    { "replace",     BLOCK_FLAG_REPLACE } };
+
+#define NUM_FLAG_NAMES (sizeof(g_flag_names)/sizeof(*g_flag_names))
+
+/* Parses an integer in range [0,limit) from `s' into `*value'. */
+static bool parse_int(const char *s, int limit, int *value)
+{
+    char *end;
+    long l;
+
+    if (s == NULL) return false;
+    l = strtol(s, &end, 10);
+    if (*end != '\0' || l < 0 || l >= limit) return false;
+    *value = (int)l;
+    return true;
+}
+
+/* Parses the arguments of a block definition into `blocks'. */
+static bool parse_block(BlockInfo *blocks)
+{
+    char *name, *flag;
+    int t, client_t;
+    size_t i;
+
+    if (!parse_int(strtok(NULL, " \t\n"), 256, &t)) return false;
+    if ((name = strtok(NULL, " \t\n")) == NULL) return false;
+    if (!parse_int(strtok(NULL, " \t\n"), 256, &client_t)) return false;
+    if ((name = strdup(name)) == NULL) return false;
+    blocks[t].name     = name;
+    blocks[t].client_t = client_t;
+    blocks[t].flags    = 0;
+    while ((flag = strtok(NULL, " \t\n")) != NULL)
+    {
+        for (i = 0; i < NUM_FLAG_NAMES; ++i)
+        {
+            if (strcmp(flag, g_flag_names[i].name) == 0) break;
+        }
+        if (i == NUM_FLAG_NAMES) return false;
+        blocks[t].flags |= g_flag_names[i].flag;
+    }
+    return true;
+}
+
+/* Parses the arguments of a tileset mapping into `tilesets'. */
+static bool parse_tileset(Type (*tilesets)[256], int *num_tilesets)
+{
+    int tileset, client_t, t;
+
+    if (!parse_int(strtok(NULL, " \t\n"), MAX_TILESETS, &tileset) ||
+        !parse_int(strtok(NULL, " \t\n"), 256, &client_t) ||
+        !parse_int(strtok(NULL, " \t\n"), 256, &t) ||
+        strtok(NULL, " \t\n") != NULL) return false;
+    tilesets[tileset][client_t] = t;
+    if (tileset >= *num_tilesets) *num_tilesets = tileset + 1;
+    return true;
+}
+
+bool blocks_load(const char *path)
+{
+    static BlockInfo blocks[256];
+    static Type tilesets[MAX_TILESETS][256];
+    int num_tilesets = g_num_tilesets, line_no = 0;
+    char line[256], *keyword;
+    FILE *fp;
+
+    fp = fopen(path, "rt");
+    if (fp == NULL) return false;
+
+    /* Parse into a copy, so the registry is unchanged in case of errors */
+    memcpy(blocks, g_blocks, sizeof(blocks));
+    memcpy(tilesets, g_tilesets, sizeof(tilesets));
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        ++line_no;
+        keyword = strtok(line, " \t\n");
+        if (keyword == NULL || keyword[0] == '#') continue;
+        if (strcmp(keyword, "block") == 0)
+        {
+            if (!parse_block(blocks)) goto invalid;
+        }
+        else
+        if (strcmp(keyword, "tileset") == 0)
+        {
+            if (!parse_tileset(tilesets, &num_tilesets)) goto invalid;
+        }
+        else
+        {
+            goto invalid;
+        }
+    }
+    if (ferror(fp))
+    {
+        error("could not read %s: %s", path, strerror(errno));
+        goto failed;
+    }
+    fclose(fp);
+
+    memcpy(g_blocks, blocks, sizeof(blocks));
+    memcpy(g_tilesets, tilesets, sizeof(tilesets));
+    g_num_tilesets = num_tilesets;
+    return true;
+
+invalid:
+    error("%s:%d: invalid definition", path, line_no);
+failed:
+    fclose(fp);
+    return false;
+}
+
+TypeSet blocks_with(unsigned flags)
+{
+    TypeSet set;
+    int t;
+
+    memset(&set, 0, sizeof(set));
+    for (t = 0; t < 256; ++t)
+    {
+        if (block_has(t, flags)) type_set_add(&set, t);
+    }
+    return set;
+}
+
+int block_by_name(const char *name)
+{
+    int t;
+
+    for (t = 0; t < 256; ++t)
+    {
+        if (g_blocks[t].name && strcmp(g_blocks[t].name, name) == 0) return t;
+    }
+    return -1;
+}
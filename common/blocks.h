@@ -1,6 +1,9 @@
 #ifndef BLOCKS_H_INCLUDED
 #define BLOCKS_H_INCLUDED
 
+#include "level.h"  /* for Type */
+#include <stdbool.h>
+
 #define BLOCK_EMPTY          0
 #define BLOCK_STONE_GREY     1
 #define BLOCK_GRASS          2
@@ -48,4 +51,111 @@
 #define BLOCK_SUPER         64
 #define BLOCK_SUPERSPONGE   (19|BLOCK_SUPER)
 
+#define BLOCKS_FILE         "blocks.txt"
+#define MAX_TILESETS        8
+
+/* Block properties, as stored in the registry: */
+#define BLOCK_FLAG_WATER        0x0001
+#define BLOCK_FLAG_LAVA         0x0002
+#define BLOCK_FLAG_PLANT        0x0004
+#define BLOCK_FLAG_SOIL         0x0008
+#define BLOCK_FLAG_OPAQUE       0x0010  /* casts a shadow below it */
+#define BLOCK_FLAG_SOLID        0x0020  /* blocks can rest on top of it */
+#define BLOCK_FLAG_FALLING      0x0040  /* falls unless supported */
+#define BLOCK_FLAG_PLACE        0x0080  /* players may place/delete it */
+#define BLOCK_FLAG_PLACE_ADMIN  0x0100  /* admins may place/delete it */
+#define BLOCK_FLAG_DELETE       0x0200  /* players may delete it */
+#define BLOCK_FLAG_REPLACE      0x0400  /* players may build over it */
+
+#define BLOCK_FLAG_FLUID        (BLOCK_FLAG_WATER | BLOCK_FLAG_LAVA)
+
+/* The block registry, indexed by type. Types without a name are undefined;
+   they have no properties and are shown to clients as empty space. */
+typedef struct BlockInfo
+{
+    const char      *name;
+    Type            client_t;   /* type sent to clients */
+    unsigned short  flags;      /* BLOCK_FLAG_* bits */
+} BlockInfo;
+
+extern BlockInfo g_blocks[256];
+
+/* Tileset mappings from client types to block types; 0 means unmapped */
+extern Type g_tilesets[MAX_TILESETS][256];
+extern int g_num_tilesets;
+
+/* Loads block definitions from the text file at `path', replacing the
+   built-in definitions of the types it defines. Each line is either:
+
+    block <type> <name> <client type> [flag..]
+    tileset <tileset> <client type> <type>
+
+   where flags are: water lava plant soil opaque solid falling place
+   place-admin delete replace. Empty lines and lines starting with `#' are
+   ignored. Returns false (keeping the built-in registry) if the file could
+   not be read or contains errors. */
+bool blocks_load(const char *path);
+
+/* Returns the set of types which have any of the given flags */
+TypeSet blocks_with(unsigned flags);
+
+/* Returns the type of the block named `name', or -1 if there is none. */
+int block_by_name(const char *name);
+
+/* Returns the type of block placed by a player selecting client type `t'
+   using tileset `tileset'. */
+static inline Type block_from_tileset(int tileset, Type t)
+{
+    Type u = g_tilesets[tileset][t];
+    return u ? u : t;
+}
+
+static inline Type block_client_type(Type t) { return g_blocks[t].client_t; }
+
+static inline bool block_has(Type t, unsigned flags)
+{
+    return (g_blocks[t].flags & flags) != 0;
+}
+
+/* Block type predicates: */
+static inline bool block_is_fluid(Type t)
+{
+    return block_has(t, BLOCK_FLAG_FLUID);
+}
+
+static inline bool block_is_water(Type t)
+{
+    return block_has(t, BLOCK_FLAG_WATER);
+}
+
+static inline bool block_is_lava(Type t)
+{
+    return block_has(t, BLOCK_FLAG_LAVA);
+}
+
+static inline bool block_is_plant(Type t)
+{
+    return block_has(t, BLOCK_FLAG_PLANT);
+}
+
+static inline bool block_is_soil(Type t)
+{
+    return block_has(t, BLOCK_FLAG_SOIL);
+}
+
+static inline bool block_is_light_blocker(Type t)
+{
+    return block_has(t, BLOCK_FLAG_OPAQUE);
+}
+
+static inline bool block_is_supporter(Type t)
+{
+    return block_has(t, BLOCK_FLAG_SOLID);
+}
+
+static inline bool block_is_falling(Type t)
+{
+    return block_has(t, BLOCK_FLAG_FALLING);
+}
+
 #endif /* ndef BLOCKS_H_INCLUDED */
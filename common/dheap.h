@@ -0,0 +1,88 @@
+#ifndef DHEAP_H_INCLUDED
+#define DHEAP_H_INCLUDED
+
+#include <stdlib.h>
+
+/* Type-specialized 4-ary min-heaps.
+
+DHEAP_DEFINE(name, type, key) defines static inline functions operating on an
+array of `type' elements kept in min-heap order of the integer `key(elem)'.
+The element with the smallest key is always stored in front of the array.
+
+Unlike the functions in heap.h, elements are moved by assignment and keys are
+compared inline, so the compiler can generate code specialized for the element
+size and key. A branching factor of 4 halves the depth of the heap compared to
+a binary heap, and the children of a node share a cache line for small
+elements.
+
+The functions defined are:
+
+    void name_push(type *base, size_t nmemb, type elem);
+
+        Adds `elem' to the heap of `nmemb' elements at `base', which must have
+        room for at least one more element.
+
+    type name_pop(type *base, size_t nmemb);
+
+        Removes and returns the minimum element of the heap of `nmemb' > 0
+        elements at `base'.
+
+    void name_create(type *base, size_t nmemb);
+
+        Reorders an array of `nmemb' elements into a heap in O(`nmemb') time.
+*/
+
+#define DHEAP_ARITY 4
+
+#define DHEAP_DEFINE(name, type, key)                                          \
+                                                                               \
+static inline void name##_sift_up(type *base, size_t i, type elem)            \
+{                                                                              \
+    while (i > 0)                                                              \
+    {                                                                          \
+        size_t p = (i - 1)/DHEAP_ARITY;                                        \
+        if (!(key(elem) < key(base[p]))) break;                                \
+        base[i] = base[p];                                                     \
+        i = p;                                                                 \
+    }                                                                          \
+    base[i] = elem;                                                            \
+}                                                                              \
+                                                                               \
+static inline void name##_sift_down( type *base, size_t nmemb, size_t i,      \
+                                     type elem )                               \
+{                                                                              \
+    for (;;)                                                                   \
+    {                                                                          \
+        size_t c = DHEAP_ARITY*i + 1, j, m;                                    \
+        if (c >= nmemb) break;                                                 \
+        m = c;                                                                 \
+        for (j = c + 1; j < c + DHEAP_ARITY && j < nmemb; ++j)                 \
+        {                                                                      \
+            if (key(base[j]) < key(base[m])) m = j;                            \
+        }                                                                      \
+        if (!(key(base[m]) < key(elem))) break;                                \
+        base[i] = base[m];                                                     \
+        i = m;                                                                 \
+    }                                                                          \
+    base[i] = elem;                                                            \
+}                                                                              \
+                                                                               \
+static inline void name##_push(type *base, size_t nmemb, type elem)           \
+{                                                                              \
+    name##_sift_up(base, nmemb, elem);                                         \
+}                                                                              \
+                                                                               \
+static inline type name##_pop(type *base, size_t nmemb)                       \
+{                                                                              \
+    type top = base[0];                                                        \
+    if (nmemb > 1) name##_sift_down(base, nmemb - 1, 0, base[nmemb - 1]);      \
+    return top;                                                                \
+}                                                                              \
+                                                                               \
+static inline void name##_create(type *base, size_t nmemb)                    \
+{                                                                              \
+    size_t i = (nmemb + DHEAP_ARITY - 2)/DHEAP_ARITY;                          \
+    while (i-- > 0) name##_sift_down(base, nmemb, i, base[i]);                 \
+}
+
+#endif /* ndef DHEAP_H_INCLUDED */
@@ -41,3 +41,52 @@ failed:
     free(buf_out);
     return NULL;
 }
+
+void *gzip_decompress(void *buf_in, size_t len_in, size_t *len_out)
+{
+    void *buf_out = NULL, *buf_new;
+    size_t pos = 0, len;
+    int res;
+    z_stream zs;
+
+    /* Estimate required buffer size (N.B. this will be doubled below!) */
+    len = len_in*4;
+    if (len < 256) len = 256;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.next_in  = buf_in;
+    zs.avail_in = len_in;
+    res = inflateInit2(&zs, 0x1f /* gzip */);
+    while (res == Z_OK || res == Z_BUF_ERROR)
+    {
+        if (zs.avail_out == 0 || buf_out == NULL)
+        {
+            len *= 2;
+            buf_new = realloc(buf_out, len);
+            if (!buf_new) goto failed;
+            buf_out = buf_new;
+        }
+        else
+        if (res == Z_BUF_ERROR)
+        {
+            /* No progress possible: input truncated */
+            goto failed;
+        }
+        zs.next_out  = buf_out + pos;
+        zs.avail_out = len - pos;
+        res = inflate(&zs, Z_FINISH);
+        pos = len - zs.avail_out;
+    }
+    if (res != Z_STREAM_END) goto failed;
+    inflateEnd(&zs);
+
+    buf_new = realloc(buf_out, pos);
+    if (buf_new) buf_out = buf_new;
+    *len_out = pos;
+    return buf_out;
+
+failed:
+    inflateEnd(&zs);
+    free(buf_out);
+    return NULL;
+}
@@ -1,6 +1,9 @@
 #ifndef GZIP_H_INCLUDED
 #define GZIP_H_INCLUDED
 
+#include <stdlib.h>
+
 void *gzip_compress(void *buf_in, size_t len_in, size_t *len_out);
+void *gzip_decompress(void *buf_in, size_t len_in, size_t *len_out);
 
 #endif /* ndef GZIP_H_INCLUDED */
\ No newline at end of file
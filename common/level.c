@@ -1,4 +1,5 @@
 #include "level.h"
+#include "blocks.h"
 #include "logging.h"
 #include <time.h>
 #include <stdlib.h>
@@ -22,12 +23,216 @@ static size_t idx(const Level *level, int x, int y, int z)
     return x + (size_t)level->size.x*(z + (size_t)level->size.z*y);
 }
 
+static int min(int i, int j) { return i < j ? i : j; }
+static int max(int i, int j) { return i > j ? i : j; }
+
+/* Adds `delta' to the sponge counts of all blocks in range of x/y/z */
+static void update_sponges(Level *level, int x, int y, int z, int delta)
+{
+    int x1 = max(x - SPONGE_RANGE, 0), x2 = min(x + SPONGE_RANGE + 1, level->size.x);
+    int y1 = max(y - SPONGE_RANGE, 0), y2 = min(y + SPONGE_RANGE + 1, level->size.y);
+    int z1 = max(z - SPONGE_RANGE, 0), z2 = min(z + SPONGE_RANGE + 1, level->size.z);
+
+    for (y = y1; y < y2; ++y)
+    {
+        for (z = z1; z < z2; ++z)
+        {
+            for (x = x1; x < x2; ++x)
+                level->sponges[idx(level, x, y, z)] += delta;
+        }
+    }
+}
+
+static void index_sponges(Level *level)
+{
+    int x, y, z;
+
+    memset(level->sponges, 0, (size_t)level->size.x*level->size.y*level->size.z);
+    for (y = 0; y < level->size.y; ++y)
+    {
+        for (z = 0; z < level->size.z; ++z)
+        {
+            for (x = 0; x < level->size.x; ++x)
+            {
+                if (level->blocks[idx(level, x, y, z)] == BLOCK_SPONGE)
+                    update_sponges(level, x, y, z, +1);
+            }
+        }
+    }
+}
+
+bool level_sponge_nearby(const Level *level, int x, int y, int z)
+{
+    return level->sponges[idx(level, x, y, z)] != 0;
+}
+
+static size_t chunk_idx(const Level *level, int x, int y, int z)
+{
+    x >>= CHUNK_BITS;
+    y >>= CHUNK_BITS;
+    z >>= CHUNK_BITS;
+    return x + (size_t)level->chunks.x*(z + (size_t)level->chunks.z*y);
+}
+
+/* Adds `delta' to the number of blocks of type `t' in chunk `c' */
+static void update_chunk(Level *level, size_t c, Type t, int delta)
+{
+    unsigned short *count = &level->chunk_counts[256*c + t];
+
+    if (*count == 0) type_set_add(&level->chunk_types[c], t);
+    *count += delta;
+    if (*count == 0) type_set_remove(&level->chunk_types[c], t);
+}
+
+static void index_chunks(Level *level)
+{
+    size_t nchunk = (size_t)level->chunks.x*level->chunks.y*level->chunks.z;
+    int x, y, z;
+
+    memset(level->chunk_counts, 0, 256*nchunk*sizeof(*level->chunk_counts));
+    memset(level->chunk_types, 0, nchunk*sizeof(*level->chunk_types));
+    for (y = 0; y < level->size.y; ++y)
+    {
+        for (z = 0; z < level->size.z; ++z)
+        {
+            for (x = 0; x < level->size.x; ++x)
+            {
+                update_chunk( level, chunk_idx(level, x, y, z),
+                              level->blocks[idx(level, x, y, z)], +1 );
+            }
+        }
+    }
+}
+
+/* Recomputes the height of column x/z in `tops' after the block at x/y/z
+   changed, where `pred' selects the blocks counted. */
+static void update_column( Level *level, short *tops, bool (*pred)(Type),
+                           int x, int y, int z )
+{
+    short *top = &tops[x + (size_t)level->size.x*z];
+
+    if (pred(level->blocks[idx(level, x, y, z)]))
+    {
+        if (y > *top) *top = y;
+    }
+    else
+    if (y == *top)
+    {
+        while (--y >= 0 && !pred(level->blocks[idx(level, x, y, z)])) { }
+        *top = y;
+    }
+}
+
+static void index_columns(Level *level)
+{
+    int x, y, z;
+
+    for (z = 0; z < level->size.z; ++z)
+    {
+        for (x = 0; x < level->size.x; ++x)
+        {
+            size_t c = x + (size_t)level->size.x*z;
+            level->top_blocker[c] = level->top_solid[c] = -1;
+            for (y = 0; y < level->size.y; ++y)
+            {
+                Type t = level->blocks[idx(level, x, y, z)];
+                if (block_is_light_blocker(t)) level->top_blocker[c] = y;
+                if (block_is_supporter(t)) level->top_solid[c] = y;
+            }
+        }
+    }
+}
+
+int level_top_blocker(const Level *level, int x, int z)
+{
+    return level->top_blocker[x + (size_t)level->size.x*z];
+}
+
+int level_top_solid(const Level *level, int x, int z)
+{
+    return level->top_solid[x + (size_t)level->size.x*z];
+}
+
+bool level_is_lit(const Level *level, int x, int y, int z)
+{
+    return level_top_blocker(level, x, z) <= y;
+}
+
+int level_support_below(const Level *level, int x, int y, int z)
+{
+    int top = level_top_solid(level, x, z);
+
+    if (top < y) return top;
+    while (--y >= 0 && !block_is_supporter(level->blocks[idx(level, x, y, z)]))
+    {
+    }
+    return y;
+}
+
+const TypeSet *level_chunk_types(const Level *level, int x, int y, int z)
+{
+    return &level->chunk_types[chunk_idx(level, x, y, z)];
+}
+
+Level *level_create(int size_x, int size_y, int size_z)
+{
+    Level *level;
+    size_t size = (size_t)size_x*size_y*size_z, nchunk;
+
+    level = malloc(sizeof(Level));
+    if (level == NULL) return NULL;
+    memset(level, 0, sizeof(Level));
+    level->size.x     = size_x;
+    level->size.y     = size_y;
+    level->size.z     = size_z;
+    level->chunks.x   = (size_x + CHUNK_SIZE - 1)/CHUNK_SIZE;
+    level->chunks.y   = (size_y + CHUNK_SIZE - 1)/CHUNK_SIZE;
+    level->chunks.z   = (size_z + CHUNK_SIZE - 1)/CHUNK_SIZE;
+    nchunk = (size_t)level->chunks.x*level->chunks.y*level->chunks.z;
+    level->blocks       = calloc(size, 1);
+    level->sponges      = calloc(size, 1);
+    level->chunk_counts = calloc(256*nchunk, sizeof(*level->chunk_counts));
+    level->chunk_types  = calloc(nchunk, sizeof(*level->chunk_types));
+    level->top_blocker  = calloc((size_t)size_x*size_z, sizeof(short));
+    level->top_solid    = calloc((size_t)size_x*size_z, sizeof(short));
+    level->name       = strdup(LEVEL_NAME);
+    level->creator    = strdup(LEVEL_CREATOR);
+    level->spawn.x    = size_x/2;
+    level->spawn.y    = size_y - 5;
+    level->spawn.z    = size_z/2;
+    level->save_time  = time(NULL);
+    if ( !level->blocks || !level->sponges ||
+         !level->chunk_counts || !level->chunk_types ||
+         !level->top_blocker || !level->top_solid ||
+         !level->name || !level->creator )
+    {
+        level_free(level);
+        return NULL;
+    }
+    index_chunks(level);
+    index_columns(level);
+    return level;
+}
+
 void level_free(Level *level)
 {
     if (!level) return;
     free(level->blocks);
+    free(level->sponges);
+    free(level->chunk_counts);
+    free(level->chunk_types);
+    free(level->top_blocker);
+    free(level->top_solid);
     free(level->name);
     free(level->creator);
+    free(level);
+}
+
+void level_index(Level *level)
+{
+    index_sponges(level);
+    index_chunks(level);
+    index_columns(level);
 }
 
 Level *level_load(const char *path)
@@ -56,20 +261,8 @@ Level *level_load(const char *path)
     }
 
     /* Allocate and initialize level structure */
-    level = malloc(sizeof(Level));
+    level = level_create(LEVEL_SIZE_X, LEVEL_SIZE_Y, LEVEL_SIZE_Z);
     if (level == NULL) goto failure;
-    memset(level, 0, sizeof(level));
-    level->size.x     = LEVEL_SIZE_X;
-    level->size.y     = LEVEL_SIZE_Y;
-    level->size.z     = LEVEL_SIZE_Z;
-    level->blocks     = malloc(size);
-    level->name       = strdup(LEVEL_NAME);
-    level->creator    = strdup(LEVEL_CREATOR);
-    level->spawn.x    = LEVEL_SIZE_X/2;
-    level->spawn.y    = LEVEL_SIZE_Y - 5;
-    level->spawn.z    = LEVEL_SIZE_Z/2;
-    level->save_time  = time(NULL);
-    if (!level->blocks || !level->name || !level->creator) goto failure;
 
     /* Read in blocks */
     if (gzread(fp, level->blocks, size) != size)
@@ -77,6 +270,7 @@ Level *level_load(const char *path)
         error("failed to read block data");
         goto failure;
     }
+    level_index(level);
 
     gzclose(fp);
     return level;
@@ -147,6 +341,14 @@ Type level_set_block(Level *level, int x, int y, int z, Type new_t /* ,
             /* (*on_update)(x, y, z, old_t, new_t); */
             level->blocks[i] = new_t;
             level->dirty     = true;
+            if (old_t == BLOCK_SPONGE) update_sponges(level, x, y, z, -1);
+            if (new_t == BLOCK_SPONGE) update_sponges(level, x, y, z, +1);
+            update_chunk(level, chunk_idx(level, x, y, z), old_t, -1);
+            update_chunk(level, chunk_idx(level, x, y, z), new_t, +1);
+            update_column(level, level->top_blocker, block_is_light_blocker,
+                          x, y, z);
+            update_column(level, level->top_solid, block_is_supporter,
+                          x, y, z);
         }
         return old_t;
     }
@@ -12,6 +12,13 @@
 #define LEVEL_NAME      "Level Name Goes Here"
 #define LEVEL_CREATOR   "Level Creator Goes Here"
 
+/* The level is divided into cubic chunks of CHUNK_SIZE blocks on each side */
+#define CHUNK_BITS            4
+#define CHUNK_SIZE          (1 << CHUNK_BITS)
+
+/* Sponges keep fluids out of blocks within this distance along each axis */
+#define SPONGE_RANGE          2
+
 /* The six principal directions: */
 extern const int DX[6], DY[6], DZ[6];
 
@@ -27,11 +34,38 @@ typedef struct Vec3i
     int x, y, z;
 } Vec3i;
 
+/* A set of block types, stored as a 256-bit mask */
+typedef struct TypeSet
+{
+    unsigned long long bits[4];
+} TypeSet;
+
+static inline bool type_set_has(const TypeSet *set, Type t)
+{
+    return (set->bits[t >> 6] >> (t & 63)) & 1;
+}
+
+static inline void type_set_add(TypeSet *set, Type t)
+{
+    set->bits[t >> 6] |= 1ull << (t & 63);
+}
+
+static inline void type_set_remove(TypeSet *set, Type t)
+{
+    set->bits[t >> 6] &= ~(1ull << (t & 63));
+}
+
 /* Modeled after official Level.java */
 typedef struct Level
 {
     Vec3i           size;               /* width, height, depth */
     Type            *blocks;            /* blocks */
+    unsigned char   *sponges;           /* number of sponges in range */
+    Vec3i           chunks;             /* number of chunks along each axis */
+    unsigned short  *chunk_counts;      /* number of blocks per chunk/type */
+    TypeSet         *chunk_types;       /* types present in each chunk */
+    short           *top_blocker;       /* highest light blocker per column */
+    short           *top_solid;         /* highest supporter per column */
     char            *name;              /* level name  */
     char            *creator;           /* level creator/description */
     time_t          create_time;        /* creation time */
@@ -58,8 +92,10 @@ typedef void (block_update_cb)(int x, int y, int z, Type old_t, Type new_t);
 */
 
 /* Level functions */
+Level *level_create(int size_x, int size_y, int size_z);
 void level_free(Level *level);
 Level *level_load(const char *path);
+void level_index(Level *level);  /* after writing to level->blocks */
 bool level_index_valid(const Level *level, int x, int y, int z);
 bool level_save(Level *level, const char *path);
 Type level_get_block(const Level *level, int x, int y, int z);
@@ -67,5 +103,27 @@ Type level_set_block(Level *level, int x, int y, int z, Type t /*,
                      block_update_cb *on_update */ );
 void level_tick(Level *level);
 
+/* Returns whether a sponge is within SPONGE_RANGE of x/y/z along each axis.
+   Takes constant time; coordinates must be valid. */
+bool level_sponge_nearby(const Level *level, int x, int y, int z);
+
+/* Column queries, answered from per-column heightmaps that level_set_block()
+   keeps up to date. Heights are -1 for columns without a matching block.
+   Coordinates must be valid. */
+int level_top_blocker(const Level *level, int x, int z);
+int level_top_solid(const Level *level, int x, int z);
+
+/* Returns whether no light-blocking block is above x/y/z. */
+bool level_is_lit(const Level *level, int x, int y, int z);
+
+/* Returns the height of the highest supporting block below x/y/z, or -1 if
+   there is none. Takes constant time if there is no supporter at or above
+   x/y/z, and is linear in the distance to the supporter otherwise. */
+int level_support_below(const Level *level, int x, int y, int z);
+
+/* Returns the set of block types present in the chunk containing x/y/z.
+   Coordinates must be valid. */
+const TypeSet *level_chunk_types(const Level *level, int x, int y, int z);
+
 
 #endif /* def LEVEL_H_INCLUDED */
@@ -9,6 +9,8 @@ typedef unsigned short Short;
 typedef unsigned int   Long;
 
 #define DEFAULT_PORT    25565
+#define RELAY_PORT      25566           /* for spectators (see relay/) */
+#define RELAY_SOCKET    "relay.sock"    /* server socket for relays */
 #define STRING_LEN         64
 #define ARRAY_LEN        1024
 #define MAX_MESSAGE      4096
@@ -0,0 +1,257 @@
+#include "region.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static int min(int i, int j) { return i < j ? i : j; }
+static int max(int i, int j) { return i > j ? i : j; }
+
+Box box_around(const Level *level, int x, int y, int z, int d)
+{
+    Box box;
+
+    box.x1 = max(x - d, 0);
+    box.y1 = max(y - d, 0);
+    box.z1 = max(z - d, 0);
+    box.x2 = min(x + d + 1, level->size.x);
+    box.y2 = min(y + d + 1, level->size.y);
+    box.z2 = min(z + d + 1, level->size.z);
+    return box;
+}
+
+TypeSet type_set_range(Type lo, Type hi)
+{
+    TypeSet set = { { 0, 0, 0, 0 } };
+    int t;
+
+    for (t = lo; t <= hi; ++t) type_set_add(&set, t);
+    return set;
+}
+
+bool type_set_intersects(const TypeSet *a, const TypeSet *b)
+{
+    return ((a->bits[0] & b->bits[0]) | (a->bits[1] & b->bits[1]) |
+            (a->bits[2] & b->bits[2]) | (a->bits[3] & b->bits[3])) != 0;
+}
+
+int region_row_find(const Type *row, int len, Type lo, Type hi)
+{
+    int i = 0;
+
+    /* A type t is in range iff (Type)(t - lo) <= (Type)(hi - lo), which is
+       tested as max(t - lo, hi - lo) == hi - lo on unsigned bytes. */
+#if defined(__AVX2__)
+    {
+        __m256i vlo = _mm256_set1_epi8((char)lo);
+        __m256i vrange = _mm256_set1_epi8((char)(hi - lo));
+        for ( ; i + 32 <= len; i += 32)
+        {
+            __m256i v = _mm256_sub_epi8(
+                _mm256_loadu_si256((const __m256i*)(row + i)), vlo );
+            unsigned mask = _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_max_epu8(v, vrange), vrange) );
+            if (mask != 0) return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i vlo = _mm_set1_epi8((char)lo);
+        __m128i vrange = _mm_set1_epi8((char)(hi - lo));
+        for ( ; i + 16 <= len; i += 16)
+        {
+            __m128i v = _mm_sub_epi8(
+                _mm_loadu_si128((const __m128i*)(row + i)), vlo );
+            unsigned mask = _mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_max_epu8(v, vrange), vrange) );
+            if (mask != 0) return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for ( ; i < len; ++i)
+    {
+        if ((Type)(row[i] - lo) <= (Type)(hi - lo)) return i;
+    }
+    return -1;
+}
+
+int region_row_count(const Type *row, int len, Type lo, Type hi)
+{
+    int i = 0, n = 0;
+
+#if defined(__AVX2__)
+    {
+        __m256i vlo = _mm256_set1_epi8((char)lo);
+        __m256i vrange = _mm256_set1_epi8((char)(hi - lo));
+        for ( ; i + 32 <= len; i += 32)
+        {
+            __m256i v = _mm256_sub_epi8(
+                _mm256_loadu_si256((const __m256i*)(row + i)), vlo );
+            n += __builtin_popcount(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_max_epu8(v, vrange), vrange) ));
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i vlo = _mm_set1_epi8((char)lo);
+        __m128i vrange = _mm_set1_epi8((char)(hi - lo));
+        for ( ; i + 16 <= len; i += 16)
+        {
+            __m128i v = _mm_sub_epi8(
+                _mm_loadu_si128((const __m128i*)(row + i)), vlo );
+            n += __builtin_popcount(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_max_epu8(v, vrange), vrange) ));
+        }
+    }
+#endif
+    for ( ; i < len; ++i)
+    {
+        if ((Type)(row[i] - lo) <= (Type)(hi - lo)) ++n;
+    }
+    return n;
+}
+
+/* Describes the types being scanned for. If they form a single contiguous
+   range [lo:hi], the SIMD row kernels are used; otherwise, rows are scanned
+   by looking up each block in the type set. */
+typedef struct Scan
+{
+    const TypeSet   *types;
+    bool            range;
+    Type            lo, hi;
+} Scan;
+
+static void scan_init(Scan *scan, const TypeSet *types)
+{
+    int w, lo = -1, hi = -1, n = 0;
+
+    for (w = 0; w < 4; ++w)
+    {
+        unsigned long long bits = types->bits[w];
+        if (bits == 0) continue;
+        if (lo < 0) lo = 64*w + __builtin_ctzll(bits);
+        hi = 64*w + 63 - __builtin_clzll(bits);
+        n += __builtin_popcountll(bits);
+    }
+    scan->types = types;
+    scan->range = n > 0 && n == hi - lo + 1;
+    scan->lo    = lo;
+    scan->hi    = hi;
+}
+
+static int scan_row_find(const Scan *scan, const Type *row, int len)
+{
+    int i;
+
+    if (scan->range) return region_row_find(row, len, scan->lo, scan->hi);
+    for (i = 0; i < len; ++i)
+    {
+        if (type_set_has(scan->types, row[i])) return i;
+    }
+    return -1;
+}
+
+static int scan_row_count(const Scan *scan, const Type *row, int len)
+{
+    int i, n = 0;
+
+    if (scan->range) return region_row_count(row, len, scan->lo, scan->hi);
+    for (i = 0; i < len; ++i) n += type_set_has(scan->types, row[i]);
+    return n;
+}
+
+static const Type *row_at(const Level *level, int x, int y, int z)
+{
+    return level->blocks + x + (size_t)level->size.x*
+                               (z + (size_t)level->size.z*y);
+}
+
+/* Scans the box chunk by chunk. If `fn' is given, it is called for each
+   matching block. If `pos' is given, the scan stops at the first match and
+   its position is stored there. Returns the number of matches found. */
+static int scan_box( const Level *level, const Box *box, const TypeSet *types,
+                     region_fn *fn, void *arg, Vec3i *pos )
+{
+    Scan scan;
+    int cx, cy, cz, x, y, z, n = 0;
+
+    if (box->x1 >= box->x2 || box->y1 >= box->y2 || box->z1 >= box->z2)
+        return 0;
+
+    scan_init(&scan, types);
+    for (cy = box->y1 >> CHUNK_BITS; cy <= (box->y2 - 1) >> CHUNK_BITS; ++cy)
+    {
+        int y1 = max(box->y1, cy << CHUNK_BITS);
+        int y2 = min(box->y2, (cy + 1) << CHUNK_BITS);
+
+        for (cz = box->z1 >> CHUNK_BITS; cz <= (box->z2 - 1) >> CHUNK_BITS; ++cz)
+        {
+            int z1 = max(box->z1, cz << CHUNK_BITS);
+            int z2 = min(box->z2, (cz + 1) << CHUNK_BITS);
+
+            for ( cx = box->x1 >> CHUNK_BITS;
+                  cx <= (box->x2 - 1) >> CHUNK_BITS; ++cx )
+            {
+                int x1 = max(box->x1, cx << CHUNK_BITS);
+                int x2 = min(box->x2, (cx + 1) << CHUNK_BITS);
+
+                if (!type_set_intersects(
+                        level_chunk_types(level, x1, y1, z1), types )) continue;
+
+                for (y = y1; y < y2; ++y)
+                {
+                    for (z = z1; z < z2; ++z)
+                    {
+                        const Type *row = row_at(level, 0, y, z);
+
+                        if (fn == NULL && pos == NULL)
+                        {
+                            n += scan_row_count(&scan, row + x1, x2 - x1);
+                            continue;
+                        }
+
+                        for (x = x1; x < x2; ++x)
+                        {
+                            int i = scan_row_find(&scan, row + x, x2 - x);
+                            if (i < 0) break;
+                            x += i;
+                            ++n;
+                            if (pos != NULL)
+                            {
+                                pos->x = x;
+                                pos->y = y;
+                                pos->z = z;
+                                return n;
+                            }
+                            (*fn)(arg, x, y, z, row[x]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return n;
+}
+
+bool region_find( const Level *level, const Box *box, const TypeSet *types,
+                  Vec3i *pos )
+{
+    Vec3i dummy;
+
+    return scan_box(level, box, types, NULL, NULL, pos ? pos : &dummy) > 0;
+}
+
+int region_count(const Level *level, const Box *box, const TypeSet *types)
+{
+    return scan_box(level, box, types, NULL, NULL, NULL);
+}
+
+void region_for_each( const Level *level, const Box *box, const TypeSet *types,
+                      region_fn *fn, void *arg )
+{
+    scan_box(level, box, types, fn, arg, NULL);
+}
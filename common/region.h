@@ -0,0 +1,53 @@
+#ifndef REGION_H_INCLUDED
+#define REGION_H_INCLUDED
+
+#include "level.h"
+
+/* Scanning rectangular regions of a level for blocks of given types.
+
+Rows of blocks along the x-axis are contiguous in memory, so the functions
+below scan the region row by row using SIMD kernels (SSE2, or AVX2 when built
+with -mavx2) when the types searched for form a contiguous range, and skip
+chunks that contain none of the types according to the level's per-chunk
+type summaries. */
+
+/* A box of blocks with x1 <= x < x2, y1 <= y < y2 and z1 <= z < z2 */
+typedef struct Box
+{
+    int x1, y1, z1, x2, y2, z2;
+} Box;
+
+/* Called for each matching block by region_for_each(). May modify the level. */
+typedef void (region_fn)(void *arg, int x, int y, int z, Type t);
+
+/* Returns the box of blocks within distance `d' of x/y/z along each axis,
+   clipped to the level bounds. */
+Box box_around(const Level *level, int x, int y, int z, int d);
+
+/* Returns the set of types in the range [lo:hi] (inclusive). */
+TypeSet type_set_range(Type lo, Type hi);
+
+/* Returns whether two type sets have any type in common. */
+bool type_set_intersects(const TypeSet *a, const TypeSet *b);
+
+/* Returns the index of the first of `len' blocks at `row' with a type in
+   [lo:hi], or -1 if there is none. */
+int region_row_find(const Type *row, int len, Type lo, Type hi);
+
+/* Returns the number of `len' blocks at `row' with a type in [lo:hi]. */
+int region_row_count(const Type *row, int len, Type lo, Type hi);
+
+/* Searches the box for a block with a type in `types'. If one is found, its
+   position is stored in `pos' (if not NULL) and true is returned. */
+bool region_find( const Level *level, const Box *box, const TypeSet *types,
+                  Vec3i *pos );
+
+/* Returns the number of blocks in the box with a type in `types'. */
+int region_count(const Level *level, const Box *box, const TypeSet *types);
+
+/* Calls `fn' for each block in the box with a type in `types', in order of
+   chunks, and in y/z/x order within each chunk. */
+void region_for_each( const Level *level, const Box *box, const TypeSet *types,
+                      region_fn *fn, void *arg );
+
+#endif /* ndef REGION_H_INCLUDED */
@@ -1,6 +1,7 @@
 #include "timeval.h"
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 
 #define USEC_PER_SEC    1000000
 
@@ -49,6 +50,13 @@ void tv_now(struct timeval *tv)
     (void)gettimeofday(tv, NULL);
 }
 
+usec_t usec_now()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (usec_t)ts.tv_sec*USEC_PER_SEC + (usec_t)ts.tv_nsec/1000;
+}
+
 void tv_normalize(struct timeval *tv)
 {
     assert(sizeof(tv->tv_sec) == sizeof(tv_sec_t));
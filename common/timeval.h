@@ -9,9 +9,16 @@
 typedef time_t tv_sec_t;
 typedef int tv_usec_t;
 
+/* Monotonic time in microseconds */
+typedef unsigned long long usec_t;
+
 /* Get current time */
 void tv_now(struct timeval *tv);
 
+/* Get current monotonic time, which is unaffected by changes to the system
+   clock, in microseconds since an arbitrary starting point. */
+usec_t usec_now();
+
 /* Update a timeval so tv_usec is normalized into range [0,1000000) */
 void tv_normalize(struct timeval *tv);
 
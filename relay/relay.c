@@ -0,0 +1,513 @@
+/* Spectator relay.
+
+Connects to a server on the same host through RELAY_SOCKET, as a single
+client that spectates, and serves what it receives to any number of
+spectators connecting on RELAY_PORT. The relay keeps its own copy of the
+world and of the players' positions, so spectators joining later are sent
+the world by the relay, not by the server. Spectators' input is ignored:
+they can look around, but not change the world or chat.
+
+The cost to the server is that of a single client, however many spectators
+are connected to the relay. */
+
+#include "common/gzip.h"
+#include "common/logging.h"
+#include "common/protocol.h"
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_SPECTATORS      1000
+#define MAX_PENDING         (4 << 20)   /* output bytes before dropping */
+#define PROTOCOL_VERSION    7
+
+typedef struct Spectator
+{
+    int     fd;             /* socket; -1 if slot is free */
+    bool    loaded;         /* sent the world? */
+    bool    waiting;        /* said hello during a resend of the world */
+    Byte    in[MAX_MESSAGE];
+    int     in_len;
+    Byte    *out;           /* pending output */
+    size_t  out_pos, out_len, out_cap;
+} Spectator;
+
+/* Connection to the server: */
+static int      g_server_fd;
+static Byte     g_in[1 << 16];
+static int      g_in_len;
+
+/* The world as last received from the server: */
+static bool     g_ready;                    /* world received? */
+static Byte     g_helo[MAX_MESSAGE];        /* server's HELO message */
+static Byte     g_size_msg[MAX_MESSAGE];    /* SIZE message */
+static Byte     g_spawn[MAX_MESSAGE];       /* PLYC message for ourselves */
+static Byte     g_players[256][MAX_MESSAGE];    /* PLYC for each player */
+static bool     g_player_valid[256];
+static Byte     *g_data;                    /* compressed world data */
+static size_t   g_data_len, g_data_cap;
+static bool     g_data_stale;               /* world changed since? */
+static Byte     *g_recv;                    /* world data being received */
+static size_t   g_recv_len, g_recv_cap;
+static bool     g_receiving;                /* between STRT and SIZE? */
+static Byte     *g_world;                   /* block count and blocks */
+static size_t   g_world_len;
+static int      g_size_x, g_size_y, g_size_z;
+
+static int          g_listen_fd;
+static Spectator    g_spectators[MAX_SPECTATORS];
+static int          g_num_spectators;
+
+static int get_short(const Byte *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static void drop_spectator(Spectator *sp, const char *reason)
+{
+    info("dropping spectator %d: %s", (int)(sp - g_spectators), reason);
+    close(sp->fd);
+    free(sp->out);
+    memset(sp, 0, sizeof(*sp));
+    sp->fd = -1;
+    --g_num_spectators;
+}
+
+static void write_spectator(Spectator *sp, const Byte *buf, size_t len)
+{
+    if (sp->fd < 0) return;
+    if (sp->out_len - sp->out_pos + len > MAX_PENDING)
+    {
+        drop_spectator(sp, "too slow");
+        return;
+    }
+    if (sp->out_len + len > sp->out_cap && sp->out_pos > 0)
+    {
+        /* Discard output already written */
+        memmove(sp->out, sp->out + sp->out_pos, sp->out_len - sp->out_pos);
+        sp->out_len -= sp->out_pos;
+        sp->out_pos  = 0;
+    }
+    if (sp->out_len + len > sp->out_cap)
+    {
+        size_t cap = 2*(sp->out_len + len);
+        Byte *out = realloc(sp->out, cap);
+
+        if (out == NULL)
+        {
+            drop_spectator(sp, "out of memory");
+            return;
+        }
+        sp->out     = out;
+        sp->out_cap = cap;
+    }
+    memcpy(sp->out + sp->out_len, buf, len);
+    sp->out_len += len;
+}
+
+static void send_message(Spectator *sp, int type, ...)
+{
+    Byte buf[MAX_MESSAGE];
+    int len;
+    va_list ap;
+
+    va_start(ap, type);
+    len = proto_msg_vbuild(type, ap, buf);
+    assert(len < sizeof(buf));
+    va_end(ap);
+
+    write_spectator(sp, buf, len);
+}
+
+/* Sends the world and everyone's positions to a spectator, as the server
+   does for a joining player, or when it resends the world. */
+static void send_level(Spectator *sp)
+{
+    int nmsg, i;
+
+    if (g_data_stale)
+    {
+        size_t len;
+        Byte *data = gzip_compress(g_world, g_world_len, &len);
+        if (data == NULL)
+        {
+            drop_spectator(sp, "couldn't compress world");
+            return;
+        }
+        free(g_data);
+        g_data       = data;
+        g_data_len   = g_data_cap = len;
+        g_data_stale = false;
+    }
+
+    send_message(sp, PROTO_STRT);
+    nmsg = (g_data_len + 1023)/1024;
+    for (i = 0; i < nmsg; ++i)
+    {
+        char block_data[1024];
+        int block_len = g_data_len - i*1024;
+        if (block_len >= 1024) block_len = 1024;
+        memcpy(block_data, g_data + 1024*i, block_len);
+        memset(block_data + block_len, 0, 1024 - block_len);
+        send_message(sp, PROTO_DATA, block_len, block_data, 100*(i+1)/nmsg);
+    }
+    write_spectator(sp, g_size_msg, proto_msg_len(PROTO_SIZE));
+    for (i = 0; i < 255; ++i)
+    {
+        if (g_player_valid[i])
+            write_spectator(sp, g_players[i], proto_msg_len(PROTO_PLYC));
+    }
+    write_spectator(sp, g_spawn, proto_msg_len(PROTO_PLYC));
+    sp->loaded = true;
+}
+
+/* Sends the server's greeting and the world to a spectator who has just
+   said hello. While the server is resending the world, the world is only
+   sent once it has all been received. */
+static void send_world(Spectator *sp)
+{
+    write_spectator(sp, g_helo, proto_msg_len(PROTO_HELO));
+    if (sp->fd < 0) return;
+    if (g_receiving)
+        sp->waiting = true;
+    else
+        send_level(sp);
+}
+
+static void broadcast(const Byte *msg, int len)
+{
+    int i;
+
+    for (i = 0; i < MAX_SPECTATORS; ++i)
+    {
+        if (g_spectators[i].loaded)
+            write_spectator(&g_spectators[i], msg, len);
+    }
+}
+
+/* Decompresses the world data received, once the server has sent it all,
+   and makes it the data sent to spectators. */
+static void load_world()
+{
+    Byte *data = g_data;
+    size_t cap = g_data_cap;
+
+    g_data       = g_recv;
+    g_data_len   = g_recv_len;
+    g_data_cap   = g_recv_cap;
+    g_data_stale = false;
+    g_recv       = data;
+    g_recv_len   = 0;
+    g_recv_cap   = cap;
+    g_receiving  = false;
+
+    free(g_world);
+    g_world = gzip_decompress(g_data, g_data_len, &g_world_len);
+    if ( g_world == NULL || g_world_len < 4 || g_world_len - 4 !=
+         (size_t)g_size_x*g_size_y*g_size_z )
+        fatal("received invalid world data");
+    g_ready = true;
+    info("received world of %dx%dx%d blocks", g_size_x, g_size_y, g_size_z);
+}
+
+/* Updates our copy of the world with a message from the server, and passes
+   it on to spectators. */
+static void handle_server_message(const Byte *msg, int len)
+{
+    switch (msg[0])
+    {
+    case PROTO_HELO:
+        memcpy(g_helo, msg, len);
+        return;
+
+    case PROTO_STRT:
+        /* The server resends the world after large bulk edits. Keep the
+           old data for spectators joining meanwhile. */
+        g_recv_len  = 0;
+        g_receiving = true;
+        return;
+
+    case PROTO_DATA:
+        {
+            int n = get_short(msg + 1);
+            if (n < 0 || n > 1024) fatal("received invalid world data");
+            if (g_recv_len + n > g_recv_cap)
+            {
+                g_recv_cap = 2*(g_recv_len + n);
+                g_recv = realloc(g_recv, g_recv_cap);
+                if (g_recv == NULL) fatal("out of memory");
+            }
+            memcpy(g_recv + g_recv_len, msg + 3, n);
+            g_recv_len += n;
+        } return;
+
+    case PROTO_SIZE:
+        memcpy(g_size_msg, msg, len);
+        g_size_x = get_short(msg + 1);
+        g_size_y = get_short(msg + 3);
+        g_size_z = get_short(msg + 5);
+        if (g_ready)
+        {
+            int i;
+
+            load_world();
+            for (i = 0; i < MAX_SPECTATORS; ++i)
+            {
+                Spectator *sp = &g_spectators[i];
+
+                if (sp->loaded || sp->waiting)
+                {
+                    sp->waiting = false;
+                    send_level(sp);
+                }
+            }
+            return;
+        }
+        load_world();
+        return;
+
+    case PROTO_MODN:
+        {
+            int x = get_short(msg + 1), y = get_short(msg + 3),
+                z = get_short(msg + 5);
+            if ( g_ready && x < g_size_x && y < g_size_y && z < g_size_z )
+            {
+                g_world[4 + x + (size_t)g_size_x*(z + (size_t)g_size_z*y)] =
+                    msg[7];
+                g_data_stale = true;
+            }
+        } break;
+
+    case PROTO_PLYC:
+        if (msg[1] == 255)
+        {
+            /* Where spectators appear */
+            memcpy(g_spawn, msg, len);
+            return;
+        }
+        memcpy(g_players[msg[1]], msg, len);
+        g_player_valid[msg[1]] = true;
+        break;
+
+    case PROTO_PLYU:
+        /* Keep the position in the PLYC message for later spectators */
+        if (g_player_valid[msg[1]]) memcpy(g_players[msg[1]] + 66, msg + 2, 8);
+        break;
+
+    case PROTO_DISC:
+        g_player_valid[msg[1]] = false;
+        break;
+    }
+    if (g_ready) broadcast(msg, len);
+}
+
+static void read_server()
+{
+    int pos = 0, n;
+
+    n = read(g_server_fd, g_in + g_in_len, sizeof(g_in) - g_in_len);
+    if (n < 0 && errno == EINTR) return;
+    if (n <= 0) fatal("lost connection to server");
+    g_in_len += n;
+
+    while (pos < g_in_len)
+    {
+        int type = g_in[pos], len;
+
+        if (type >= PROTO_NMSG) fatal("invalid message type: %d", type);
+        len = proto_msg_len(type);
+        if (g_in_len - pos < len) break;
+        handle_server_message(g_in + pos, len);
+        pos += len;
+    }
+    memmove(g_in, g_in + pos, g_in_len - pos);
+    g_in_len -= pos;
+}
+
+static void read_spectator(Spectator *sp)
+{
+    int pos = 0, n;
+
+    n = read(sp->fd, sp->in + sp->in_len, sizeof(sp->in) - sp->in_len);
+    if (n < 0 && errno == EINTR) return;
+    if (n <= 0)
+    {
+        drop_spectator(sp, "disconnected");
+        return;
+    }
+    sp->in_len += n;
+
+    /* Look for the initial HELO, and ignore everything else */
+    while (pos < sp->in_len)
+    {
+        int type = sp->in[pos], len;
+
+        if (type >= PROTO_NMSG)
+        {
+            drop_spectator(sp, "invalid message");
+            return;
+        }
+        len = proto_msg_len(type);
+        if (sp->in_len - pos < len) break;
+        if (type == PROTO_HELO && !sp->loaded && !sp->waiting)
+            send_world(sp);
+        if (sp->fd < 0) return;
+        pos += len;
+    }
+    memmove(sp->in, sp->in + pos, sp->in_len - pos);
+    sp->in_len -= pos;
+}
+
+static void write_pending(Spectator *sp)
+{
+    ssize_t n = write( sp->fd, sp->out + sp->out_pos,
+                       sp->out_len - sp->out_pos );
+
+    if (n < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN) drop_spectator(sp, "error");
+        return;
+    }
+    sp->out_pos += n;
+    if (sp->out_pos == sp->out_len) sp->out_pos = sp->out_len = 0;
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void accept_spectator()
+{
+    int fd, i;
+
+    fd = accept(g_listen_fd, NULL, NULL);
+    if (fd < 0) return;
+
+    /* A slow spectator must not hold up the others */
+    if (!set_nonblocking(fd))
+    {
+        warn("couldn't make spectator socket non-blocking");
+        close(fd);
+        return;
+    }
+    for (i = 0; i < MAX_SPECTATORS; ++i) if (g_spectators[i].fd < 0) break;
+    if (i == MAX_SPECTATORS)
+    {
+        warn("closing connection because relay is full");
+        close(fd);
+        return;
+    }
+    g_spectators[i].fd = fd;
+    ++g_num_spectators;
+    info("spectator %d connected (%d total)", i, g_num_spectators);
+}
+
+static void connect_to_server()
+{
+    struct sockaddr_un sa;
+    Byte buf[MAX_MESSAGE];
+
+    g_server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (g_server_fd < 0) fatal("couldn't create socket");
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, RELAY_SOCKET, sizeof(sa.sun_path) - 1);
+    if (connect(g_server_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+        fatal("couldn't connect to %s", RELAY_SOCKET);
+
+    memset(buf, ' ', sizeof(buf));
+    buf[0] = PROTO_HELO;
+    buf[1] = PROTOCOL_VERSION;
+    memcpy(buf + 2, "relay", 5);
+    buf[2 + 2*STRING_LEN] = 0;
+    if (write(g_server_fd, buf, proto_msg_len(PROTO_HELO)) !=
+        proto_msg_len(PROTO_HELO)) fatal("couldn't say hello to server");
+}
+
+static void open_listen_socket(int port)
+{
+    struct sockaddr_in sa;
+    int one = 1;
+
+    g_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (g_listen_fd < 0) fatal("couldn't create listen socket");
+    setsockopt(g_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_port        = htons(port);
+    sa.sin_addr.s_addr = INADDR_ANY;
+    if (bind(g_listen_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+        fatal("couldn't bind listen socket");
+    if (listen(g_listen_fd, 16) != 0)
+        fatal("couldn't listen on listen socket");
+    info("listening for spectators on port %d", port);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct pollfd fds[2 + MAX_SPECTATORS];
+    static int slots[2 + MAX_SPECTATORS];
+    int port = argc > 1 ? atoi(argv[1]) : RELAY_PORT, i, n;
+
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < MAX_SPECTATORS; ++i) g_spectators[i].fd = -1;
+    connect_to_server();
+    open_listen_socket(port);
+
+    for (;;)
+    {
+        n = 0;
+        fds[n].fd     = g_server_fd;
+        fds[n].events = POLLIN;
+        ++n;
+
+        /* Only let spectators in once the world has been received */
+        fds[n].fd     = g_ready ? g_listen_fd : -1;
+        fds[n].events = POLLIN;
+        ++n;
+
+        for (i = 0; i < MAX_SPECTATORS; ++i)
+        {
+            Spectator *sp = &g_spectators[i];
+            if (sp->fd < 0) continue;
+            fds[n].fd     = sp->fd;
+            fds[n].events = POLLIN | (sp->out_len > 0 ? POLLOUT : 0);
+            slots[n++]    = i;
+        }
+
+        if (poll(fds, n, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            fatal("poll() failed");
+        }
+
+        if (fds[0].revents) read_server();
+        if (fds[1].revents) accept_spectator();
+        for (i = 2; i < n; ++i)
+        {
+            Spectator *sp = &g_spectators[slots[i]];
+
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                read_spectator(sp);
+            if (sp->fd >= 0 && (fds[i].revents & POLLOUT))
+                write_pending(sp);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+/* Benchmark of fluid sweeps with different numbers of worker threads, on a
+   level where water pours from a grid of sources onto a stone floor with
+   some obstacles, until it has settled. The update streams produced with
+   each number of threads are checked to be identical. */
+
+#include "fluid.h"
+#include "regions.h"
+#include "workers.h"
+#include "common/blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SOURCE_SPACING  8
+
+static const int THREADS[] = { 1, 2, 4, 8 };
+
+static Level *generate()
+{
+    Level *level = level_create(LEVEL_SIZE_X, LEVEL_SIZE_Y, LEVEL_SIZE_Z);
+    int x, y, z;
+
+    if (level == NULL) exit(1);
+    srand(1);
+    for (x = 0; x < LEVEL_SIZE_X; ++x)
+    {
+        for (z = 0; z < LEVEL_SIZE_Z; ++z)
+        {
+            int h = 1 + rand()%3;
+
+            for (y = 0; y < h; ++y)
+                level_set_block(level, x, y, z, BLOCK_STONE_GREY);
+            if (rand()%16 == 0)
+                level_set_block(level, x, LEVEL_SIZE_Y/2, z, BLOCK_DIRT);
+        }
+    }
+    for (x = SOURCE_SPACING/2; x < LEVEL_SIZE_X; x += SOURCE_SPACING)
+    {
+        for (z = SOURCE_SPACING/2; z < LEVEL_SIZE_Z; z += SOURCE_SPACING)
+        {
+            level_set_block(level, x, LEVEL_SIZE_Y - 2, z, BLOCK_WATER1);
+            fluid_activate(level, x, LEVEL_SIZE_Y - 2, z);
+        }
+    }
+    return level;
+}
+
+/* Adds an update to an FNV-1a style hash */
+static unsigned long long mix(unsigned long long hash, const BlockUpdate *u)
+{
+    unsigned long long v = u->x | u->y << 12 | (unsigned long long)u->z << 24 |
+                           (unsigned long long)u->new_t << 36;
+
+    return (hash ^ v)*1099511628211ull;
+}
+
+/* Runs sweeps until the water has settled. Returns a hash of all updates
+   applied, and stores the number of sweeps and updates. */
+static unsigned long long flood(Level *level, int *sweeps, long *total)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    BlockUpdate *updates;
+    size_t n, i;
+
+    *sweeps = 0;
+    *total  = 0;
+    while (fluid_active_count(FLUID_WATER) > 0)
+    {
+        regions_tick(NULL, 0);
+        n = fluid_sweep(level, FLUID_WATER, &updates);
+        for (i = 0; i < n; ++i)
+        {
+            const BlockUpdate *u = &updates[i];
+
+            /* As server_update_blocks(): skip blocks changed already */
+            if (level_get_block(level, u->x, u->y, u->z) != u->old_t)
+                continue;
+            level_set_block(level, u->x, u->y, u->z, u->new_t);
+            fluid_activate(level, u->x, u->y, u->z);
+            hash = mix(hash, u);
+            ++*total;
+        }
+        ++*sweeps;
+    }
+    return hash;
+}
+
+int main()
+{
+    unsigned long long hash[sizeof(THREADS)/sizeof(*THREADS)];
+    int i;
+
+    for (i = 0; i < (int)(sizeof(THREADS)/sizeof(*THREADS)); ++i)
+    {
+        Level *level = generate();
+        clock_t start;
+        struct timespec t0, t1;
+        int sweeps;
+        long total;
+
+        if (i == 0 && !regions_init(level)) exit(1);
+        workers_start(THREADS[i] - 1);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        start = clock();
+        hash[i] = flood(level, &sweeps, &total);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf( "%d threads: %d sweeps, %ld updates in %.3fs "
+                "(%.3fs CPU), hash %016llx\n", workers_threads(), sweeps,
+                total, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)/1e9,
+                (double)(clock() - start)/CLOCKS_PER_SEC, hash[i] );
+        workers_stop();
+        level_free(level);
+
+        if (hash[i] != hash[0])
+        {
+            printf("MISMATCH!\n");
+            exit(1);
+        }
+    }
+    return 0;
+}
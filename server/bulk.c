@@ -0,0 +1,148 @@
+#include "bulk.h"
+#include "common/logging.h"
+
+static BlockUpdate  *g_updates;
+static size_t       g_updates_cap;
+static Type         *g_clipboard;
+static Vec3i        g_clipboard_size;
+
+static int clamp(int i, int lo, int hi)
+{
+    return i < lo ? lo : i > hi ? hi : i;
+}
+
+/* Orders and clips the corners of a box to the level. Returns the number of
+   blocks in the box. */
+static size_t clip_box( const Level *level, int *x1, int *y1, int *z1,
+                        int *x2, int *y2, int *z2 )
+{
+    int t;
+
+    if (*x1 > *x2) t = *x1, *x1 = *x2, *x2 = t;
+    if (*y1 > *y2) t = *y1, *y1 = *y2, *y2 = t;
+    if (*z1 > *z2) t = *z1, *z1 = *z2, *z2 = t;
+    if ( *x2 < 0 || *x1 >= level->size.x || *y2 < 0 ||
+         *y1 >= level->size.y || *z2 < 0 || *z1 >= level->size.z )
+        return 0;
+    *x1 = clamp(*x1, 0, level->size.x - 1);
+    *y1 = clamp(*y1, 0, level->size.y - 1);
+    *z1 = clamp(*z1, 0, level->size.z - 1);
+    *x2 = clamp(*x2, 0, level->size.x - 1);
+    *y2 = clamp(*y2, 0, level->size.y - 1);
+    *z2 = clamp(*z2, 0, level->size.z - 1);
+    return (size_t)(*x2 - *x1 + 1)*(*y2 - *y1 + 1)*(*z2 - *z1 + 1);
+}
+
+/* Makes room for `n' updates. */
+static bool reserve(size_t n)
+{
+    BlockUpdate *updates;
+
+    if (n <= g_updates_cap) return true;
+    updates = realloc(g_updates, n*sizeof(*updates));
+    if (updates == NULL)
+    {
+        error("could not allocate %d bulk updates", (int)n);
+        return false;
+    }
+    g_updates     = updates;
+    g_updates_cap = n;
+    return true;
+}
+
+static void add_update( size_t *n, int x, int y, int z,
+                        Type old_t, Type new_t )
+{
+    BlockUpdate *u = &g_updates[(*n)++];
+
+    u->x     = x;
+    u->y     = y;
+    u->z     = z;
+    u->old_t = old_t;
+    u->new_t = new_t;
+}
+
+size_t bulk_fill( const Level *level, int x1, int y1, int z1,
+                  int x2, int y2, int z2, int only, Type new_t,
+                  BlockUpdate **updates )
+{
+    size_t size = clip_box(level, &x1, &y1, &z1, &x2, &y2, &z2), n = 0;
+    int x, y, z;
+
+    *updates = NULL;
+    if (size == 0 || !reserve(size)) return 0;
+    for (y = y1; y <= y2; ++y)
+    {
+        for (z = z1; z <= z2; ++z)
+        {
+            for (x = x1; x <= x2; ++x)
+            {
+                Type t = level_get_block(level, x, y, z);
+
+                if (t != new_t && (only < 0 || t == only))
+                    add_update(&n, x, y, z, t, new_t);
+            }
+        }
+    }
+    *updates = g_updates;
+    return n;
+}
+
+size_t bulk_copy( const Level *level, int x1, int y1, int z1,
+                  int x2, int y2, int z2 )
+{
+    size_t size = clip_box(level, &x1, &y1, &z1, &x2, &y2, &z2), i = 0;
+    Type *clipboard;
+    int x, y, z;
+
+    if (size == 0) return 0;
+    clipboard = realloc(g_clipboard, size);
+    if (clipboard == NULL)
+    {
+        error("could not allocate clipboard of %d blocks", (int)size);
+        return 0;
+    }
+    g_clipboard = clipboard;
+    g_clipboard_size.x = x2 - x1 + 1;
+    g_clipboard_size.y = y2 - y1 + 1;
+    g_clipboard_size.z = z2 - z1 + 1;
+    for (y = y1; y <= y2; ++y)
+    {
+        for (z = z1; z <= z2; ++z)
+        {
+            for (x = x1; x <= x2; ++x)
+                g_clipboard[i++] = level_get_block(level, x, y, z);
+        }
+    }
+    return size;
+}
+
+size_t bulk_paste( const Level *level, int x, int y, int z,
+                   BlockUpdate **updates )
+{
+    const Vec3i origin = { x, y, z }, size = g_clipboard_size;
+    int x1 = x, y1 = y, z1 = z;
+    int x2 = x + size.x - 1, y2 = y + size.y - 1, z2 = z + size.z - 1;
+    size_t n = 0, volume;
+
+    *updates = NULL;
+    if (g_clipboard == NULL) return 0;
+    volume = clip_box(level, &x1, &y1, &z1, &x2, &y2, &z2);
+    if (volume == 0 || !reserve(volume)) return 0;
+    for (y = y1; y <= y2; ++y)
+    {
+        for (z = z1; z <= z2; ++z)
+        {
+            for (x = x1; x <= x2; ++x)
+            {
+                Type old_t = level_get_block(level, x, y, z);
+                Type new_t = g_clipboard[ (x - origin.x) + (size_t)size.x*
+                    ((z - origin.z) + (size_t)size.z*(y - origin.y)) ];
+
+                if (old_t != new_t) add_update(&n, x, y, z, old_t, new_t);
+            }
+        }
+    }
+    *updates = g_updates;
+    return n;
+}
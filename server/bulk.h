@@ -0,0 +1,33 @@
+#ifndef BULK_H_INCLUDED
+#define BULK_H_INCLUDED
+
+#include "server.h"
+#include "common/level.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Bulk edits of boxes of blocks: filling, replacing, copying and pasting.
+
+Boxes are given by opposite corners, inclusive, and clipped to the level.
+Operations which change blocks return updates for the blocks that differ,
+to be applied with server_update_blocks_bulk(). The arrays returned are
+valid until the next call. */
+
+/* Returns updates setting the blocks in the box with corners x1/y1/z1 and
+   x2/y2/z2 to `new_t'. If `only' is not negative, only blocks of that type
+   are changed. */
+size_t bulk_fill( const Level *level, int x1, int y1, int z1,
+                  int x2, int y2, int z2, int only, Type new_t,
+                  BlockUpdate **updates );
+
+/* Copies the blocks in the box with corners x1/y1/z1 and x2/y2/z2 to the
+   clipboard, which is shared by all admins. Returns the number of blocks
+   copied, or 0 if the box is empty or memory ran out. */
+size_t bulk_copy( const Level *level, int x1, int y1, int z1,
+                  int x2, int y2, int z2 );
+
+/* Returns updates pasting the clipboard with its lowest corner at x/y/z. */
+size_t bulk_paste( const Level *level, int x, int y, int z,
+                   BlockUpdate **updates );
+
+#endif /* ndef BULK_H_INCLUDED */
@@ -0,0 +1,334 @@
+#include "changes.h"
+#include "common/logging.h"
+#include "common/timeval.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SEND_CHUNK  256     /* records encoded at a time per subscriber */
+
+typedef struct Change
+{
+    unsigned long long  time;
+    unsigned short      x, y, z;
+    unsigned short      x2, y2, z2;     /* for CHANGE_RESYNC */
+    Type                old_t, new_t, cause, player;
+} Change;
+
+typedef struct Subscriber
+{
+    int                 fd;         /* socket; -1 if slot is free */
+    unsigned char       start[8];   /* requested first sequence number */
+    int                 start_len;  /* bytes of `start' received */
+    unsigned long long  next;       /* sequence number of next record */
+    unsigned char       buf[SEND_CHUNK*CHANGE_RECORD_SIZE];
+    size_t              buf_pos, buf_len;   /* encoded records unsent */
+} Subscriber;
+
+static Change       g_ring[CHANGE_RING_SIZE];
+static unsigned long long g_base_seq;   /* sequence number of first change */
+static unsigned long long g_next_seq;   /* sequence number of next change */
+static unsigned long long g_reserved;   /* first number not reserved */
+static bool         g_reserve_failed = false;   /* last reservation failed? */
+static Type         g_cause = CHANGE_SIMULATION;
+static Type         g_player = 255;
+static int          g_listen_fd = -1;
+static Subscriber   g_subscribers[MAX_SUBSCRIBERS];
+
+static unsigned long long wall_usec()
+{
+    struct timeval tv;
+
+    tv_now(&tv);
+    return (unsigned long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void drop(Subscriber *sub, const char *reason)
+{
+    info("dropping change subscriber %d: %s",
+         (int)(sub - g_subscribers), reason);
+    close(sub->fd);
+    memset(sub, 0, sizeof(*sub));
+    sub->fd = -1;
+}
+
+/* Returns the first sequence number not reserved by a previous run, or 0 */
+static unsigned long long load_reserved()
+{
+    unsigned long long seq = 0;
+    FILE *fp = fopen(CHANGE_SEQ_FILE, "rt");
+
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%llu", &seq) != 1)
+    {
+        warn("ignoring invalid %s", CHANGE_SEQ_FILE);
+        seq = 0;
+    }
+    fclose(fp);
+    return seq;
+}
+
+/* Reserves the next CHANGE_SEQ_RESERVE sequence numbers, so that they are
+   not used again after a restart. The file is replaced atomically, and the
+   numbers are only given out once it has been. */
+static bool reserve_seq()
+{
+    unsigned long long reserved = g_next_seq + CHANGE_SEQ_RESERVE;
+    FILE *fp;
+    bool ok;
+
+    fp = fopen(CHANGE_SEQ_FILE ".tmp", "wt");
+    if (fp == NULL) goto failed;
+    ok = fprintf(fp, "%llu\n", reserved) > 0;
+    if (fclose(fp) != 0 || !ok) goto failed;
+    if (rename(CHANGE_SEQ_FILE ".tmp", CHANGE_SEQ_FILE) != 0) goto failed;
+    g_reserved = reserved;
+    g_reserve_failed = false;
+    return true;
+
+failed:
+    if (!g_reserve_failed)
+    {
+        error( "failed to reserve change sequence numbers in %s",
+               CHANGE_SEQ_FILE );
+    }
+    g_reserve_failed = true;
+    return false;
+}
+
+bool changes_start()
+{
+    struct sockaddr_un sa;
+    unsigned long long reserved = load_reserved();
+    int i;
+
+    /* Don't reuse numbers given out before a restart or hot upgrade */
+    g_base_seq = g_next_seq = wall_usec();
+    if (g_next_seq < reserved) g_base_seq = g_next_seq = reserved;
+    if (!reserve_seq()) return false;
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i) g_subscribers[i].fd = -1;
+
+    g_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (g_listen_fd < 0) return false;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, CHANGES_SOCKET, sizeof(sa.sun_path) - 1);
+    unlink(sa.sun_path);
+    if ( bind(g_listen_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+         listen(g_listen_fd, MAX_SUBSCRIBERS) != 0 ||
+         !set_nonblocking(g_listen_fd) )
+    {
+        close(g_listen_fd);
+        g_listen_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void changes_set_cause(ChangeCause cause, int player)
+{
+    g_cause  = cause;
+    g_player = (player >= 0 && player < 255) ? player : 255;
+}
+
+/* Returns the next slot in the ring, or NULL if the feed is disabled or
+   no sequence number could be reserved for the change. In that case, the
+   change is not published, and subscribers are dropped as they miss it;
+   the reservation is tried again for the next change. */
+static Change *next_change()
+{
+    Change *c;
+    int i;
+
+    if (g_listen_fd < 0) return NULL;
+    if (g_next_seq >= g_reserved && !reserve_seq())
+    {
+        for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+        {
+            if (g_subscribers[i].fd >= 0)
+                drop(&g_subscribers[i], "changes could not be numbered");
+        }
+        return NULL;
+    }
+    c = &g_ring[g_next_seq++%CHANGE_RING_SIZE];
+    c->time = wall_usec();
+    return c;
+}
+
+void changes_publish(int x, int y, int z, Type old_t, Type new_t)
+{
+    Change *c = next_change();
+
+    if (c == NULL) return;
+    c->x      = x;
+    c->y      = y;
+    c->z      = z;
+    c->x2     = c->y2 = c->z2 = 0;
+    c->old_t  = old_t;
+    c->new_t  = new_t;
+    c->cause  = g_cause;
+    c->player = g_player;
+}
+
+void changes_publish_box( int x1, int y1, int z1, int x2, int y2, int z2,
+                          Type new_t )
+{
+    Change *c = next_change();
+
+    if (c == NULL) return;
+    c->x      = x1;
+    c->y      = y1;
+    c->z      = z1;
+    c->x2     = x2;
+    c->y2     = y2;
+    c->z2     = z2;
+    c->old_t  = 255;
+    c->new_t  = new_t;
+    c->cause  = CHANGE_RESYNC;
+    c->player = g_player;
+}
+
+/* Returns the sequence number of the oldest change still in the ring */
+static unsigned long long oldest_seq()
+{
+    return g_next_seq - g_base_seq > CHANGE_RING_SIZE ?
+           g_next_seq - CHANGE_RING_SIZE : g_base_seq;
+}
+
+static void put_be(unsigned char *buf, unsigned long long v, int bytes)
+{
+    while (bytes-- > 0)
+    {
+        buf[bytes] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static void encode(unsigned char *buf, unsigned long long seq)
+{
+    const Change *c = &g_ring[seq%CHANGE_RING_SIZE];
+
+    put_be(buf +  0, seq, 8);
+    put_be(buf +  8, c->time, 8);
+    put_be(buf + 16, c->x, 2);
+    put_be(buf + 18, c->y, 2);
+    put_be(buf + 20, c->z, 2);
+    buf[22] = c->old_t;
+    buf[23] = c->new_t;
+    buf[24] = c->cause;
+    buf[25] = c->player;
+    put_be(buf + 26, c->x2, 2);
+    put_be(buf + 28, c->y2, 2);
+    put_be(buf + 30, c->z2, 2);
+}
+
+/* Reads the subscriber's starting sequence number. Returns whether it has
+   been received completely. */
+static bool read_start(Subscriber *sub)
+{
+    unsigned long long start = 0;
+    ssize_t n;
+    int i;
+
+    if (sub->start_len == sizeof(sub->start)) return true;
+    n = read(sub->fd, sub->start + sub->start_len,
+             sizeof(sub->start) - sub->start_len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    {
+        drop(sub, "disconnected");
+        return false;
+    }
+    if (n > 0) sub->start_len += n;
+    if (sub->start_len < sizeof(sub->start)) return false;
+
+    for (i = 0; i < sizeof(sub->start); ++i)
+        start = start << 8 | sub->start[i];
+
+    /* Changes that are no longer remembered can't be sent */
+    if (start == 0) start = oldest_seq();
+    if (start < oldest_seq())
+    {
+        drop(sub, "start is too old");
+        return false;
+    }
+    if (start > g_next_seq) start = g_next_seq;
+    sub->next = start;
+    return true;
+}
+
+/* Sends as many changes as the subscriber's socket accepts */
+static void pump(Subscriber *sub)
+{
+    for (;;)
+    {
+        ssize_t n;
+
+        if (sub->buf_pos == sub->buf_len)
+        {
+            size_t i, count = g_next_seq - sub->next;
+
+            if (count == 0) return;
+            if (sub->next < oldest_seq())
+            {
+                drop(sub, "fell behind");
+                return;
+            }
+            if (count > SEND_CHUNK) count = SEND_CHUNK;
+            for (i = 0; i < count; ++i)
+                encode(sub->buf + i*CHANGE_RECORD_SIZE, sub->next + i);
+            sub->next   += count;
+            sub->buf_pos = 0;
+            sub->buf_len = count*CHANGE_RECORD_SIZE;
+        }
+
+        n = send(sub->fd, sub->buf + sub->buf_pos, sub->buf_len - sub->buf_pos,
+                 MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR) drop(sub, "write failed");
+            return;
+        }
+        sub->buf_pos += n;
+    }
+}
+
+void changes_tick()
+{
+    int fd, i;
+
+    if (g_listen_fd < 0) return;
+
+    while ((fd = accept(g_listen_fd, NULL, NULL)) >= 0)
+    {
+        for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+        {
+            if (g_subscribers[i].fd < 0) break;
+        }
+        if (i == MAX_SUBSCRIBERS || !set_nonblocking(fd))
+        {
+            warn("refusing change subscriber");
+            close(fd);
+            continue;
+        }
+        g_subscribers[i].fd = fd;
+        info("change subscriber %d connected", i);
+    }
+
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+    {
+        Subscriber *sub = &g_subscribers[i];
+
+        if (sub->fd >= 0 && read_start(sub)) pump(sub);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef CHANGES_H_INCLUDED
+#define CHANGES_H_INCLUDED
+
+#include "common/level.h"
+#include <stdbool.h>
+
+/* Change feed: a stream of all block changes, for external consumers such as
+   map renderers and backup tools, served over the Unix domain socket
+   CHANGES_SOCKET.
+
+A subscriber connects and sends the 8-byte sequence number of the first
+change it wants. It is then sent all changes from that one on, followed by
+new changes as they happen. If that change is no longer remembered, the
+subscriber is disconnected instead, without being sent anything. To receive
+all changes still remembered, ask for sequence number 0; to receive new
+changes only, ask for 2^64-1.
+Each change is a record of CHANGE_RECORD_SIZE bytes:
+
+    bytes  0- 7  sequence number
+    bytes  8-15  time, in microseconds since the epoch
+    bytes 16-21  x, y, z
+    byte  22     old type
+    byte  23     new type
+    byte  24     cause (see ChangeCause)
+    byte  25     player slot, for changes made by players; 255 otherwise
+    bytes 26-31  x2, y2, z2 for CHANGE_RESYNC records; zero otherwise
+
+All integers are big-endian. Sequence numbers increase by one per change,
+so a jump means changes were missed. They start at the server's start time
+in microseconds since the epoch, or after the last number reserved in
+CHANGE_SEQ_FILE if that is later, so that they keep increasing over
+restarts and hot upgrades. Numbers are reserved in blocks of
+CHANGE_SEQ_RESERVE, so the file is rarely written. Changes are not published
+while numbers can't be reserved; subscribers are disconnected then.
+
+Bulk edits too large to publish block by block are published as a single
+CHANGE_RESYNC record instead, for the box from x/y/z to x2/y2/z2 (inclusive)
+that contains all blocks changed. Its new type is that of all blocks changed
+if they were changed to the same type, and 255 otherwise; its old type is
+255. Subscribers should read the blocks in the box again, e.g. from the
+level file after the next save.
+
+Changes are sent once per tick. The last CHANGE_RING_SIZE changes are kept;
+a subscriber which falls further behind than that is disconnected, rather
+than slowing down the server. */
+
+#define CHANGES_SOCKET      "changes.sock"
+#define CHANGE_SEQ_FILE     "changes.seq"
+#define CHANGE_SEQ_RESERVE  (1 << 20)   /* sequence numbers reserved */
+#define CHANGE_RECORD_SIZE  32
+#define CHANGE_RING_SIZE    (1 << 18)   /* changes kept */
+#define MAX_SUBSCRIBERS     8
+
+typedef enum ChangeCause {
+    CHANGE_SIMULATION = 0,  /* fluids, growth, sponges, etc. */
+    CHANGE_PLAYER,
+    CHANGE_ROLLBACK,        /* edits undone by an admin */
+    CHANGE_BULK,            /* bulk edits by an admin */
+    CHANGE_RESYNC           /* larger bulk edits, summarised as a box */
+} ChangeCause;
+
+/* Starts listening for subscribers. Returns false on failure. */
+bool changes_start();
+
+/* Sets the cause attributed to following changes, and the player slot for
+   changes made by players (or -1). */
+void changes_set_cause(ChangeCause cause, int player);
+
+/* Records a change of the block at x/y/z from `old_t' to `new_t'. */
+void changes_publish(int x, int y, int z, Type old_t, Type new_t);
+
+/* Records a bulk change of the blocks in the box from x1/y1/z1 to x2/y2/z2,
+   to `new_t' or to various types (255), as a single CHANGE_RESYNC record. */
+void changes_publish_box( int x1, int y1, int z1, int x2, int y2, int z2,
+                          Type new_t );
+
+/* Accepts new subscribers and sends pending changes to subscribers, without
+   blocking. */
+void changes_tick();
+
+#endif /* ndef CHANGES_H_INCLUDED */
@@ -1,22 +1,585 @@
 #include "events.h"
 #include "assert.h"
-#include "common/heap.h"
+#include "common/dheap.h"
 #include "common/logging.h"
 
 #include <zlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
-#define QUEUE_CAP 1000000
+/* Events are kept in a hierarchical timing wheel. Time is divided into ticks
+   of 2^TICK_SHIFT microseconds; each of the WHEEL_LEVELS levels has
+   WHEEL_SLOTS slots, where a slot at level `l' covers 2^(WHEEL_BITS*l) ticks.
 
-static Event  g_queue[QUEUE_CAP];
-static size_t g_queue_size = 0;
-static bool   g_dirty = false;
+   An event is filed at the level of the most significant tick digit in which
+   it differs from the current wheel time `g_now', so insertion is O(1).
+   Events due at (or before) the current tick are moved to a small 4-ary heap
+   of ready events, which keeps them ordered by their exact time. Events too
+   far in the future for the wheel are kept on an unordered overflow list.
 
-/* Returns +1 if a's time is less than b's time */
-int event_cmp(const void *a, const void *b)
+   Events with block coordinates are also entered in a hash index keyed by
+   type and coordinates, so that redundant events can be merged or cancelled
+   when they are pushed (see event_push()). Nodes in the wheel and overflow
+   lists are doubly linked so they can be removed in O(1); cancelled nodes in
+   the ready heap are marked with EVENT_TYPE_NONE and discarded when they
+   reach the top. */
+
+#define TICK_SHIFT           10     /* one tick is 1024 microseconds */
+#define WHEEL_BITS            8
+#define WHEEL_SLOTS         (1 << WHEEL_BITS)
+#define WHEEL_LEVELS          4
+#define WORD_BITS            64
+
+/* Nodes are allocated in segments of SEGMENT_NODES as the queue grows, and
+   compacted into fewer segments when the queue shrinks to a quarter of its
+   capacity. The total size of the queue is bounded by a configurable limit,
+   at which new events are refused (see event_queue_full()). */
+#define SEGMENT_SHIFT        12
+#define SEGMENT_NODES       (1 << SEGMENT_SHIFT)
+#define MIN_READY_CAP      1024
+#define MIN_INDEX_CAP      1024
+#define DEFAULT_LIMIT       (64 << 20)  /* bytes */
+
+/* Tick and save events drive the server, so they must never be refused.
+   Nodes for one of each are kept in reserve when the queue is full. */
+#define ESSENTIAL_EVENTS      2
+
+/* The `prev' field of a node identifies its predecessor in a list or, for
+   the first node in a list, which list it heads (see list_head()). */
+#define OVERFLOW_LIST       (WHEEL_LEVELS*WHEEL_SLOTS)
+#define PREV_READY          (-1)
+#define PREV_HEAD(list)     (-2 - (list))
+
+/* Bits of the event data word that identify the event type and block: */
+#define EVENT_KEY_MASK      ((1ull << 44) - 1)
+
+typedef unsigned long long Tick;
+
+typedef struct Node
+{
+    Event   ev;
+    int     next;   /* next node in the same list, or -1 */
+    int     prev;   /* previous node in the same list, or PREV_xxx */
+} Node;
+
+typedef struct Ready
+{
+    usec_t  usec;   /* event time */
+    int     node;
+} Ready;
+
+#define ready_key(r) ((r).usec)
+DHEAP_DEFINE(ready_heap, Ready, ready_key)
+
+#define NODE(n) (g_segments[(n) >> SEGMENT_SHIFT][(n) & (SEGMENT_NODES - 1)])
+
+static Node     **g_segments = NULL;        /* node storage */
+static int      g_num_segments = 0;
+static int      g_max_segments = 0;         /* capacity of g_segments */
+static int      g_free = -1;                /* free list of recycled nodes */
+static int      g_num_free = 0;             /* length of the free list */
+static int      g_num_essential = 0;        /* pending tick and save events */
+static int      g_nodes_used = 0;           /* nodes ever allocated */
+static int      g_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static Tick     g_occupied[WHEEL_LEVELS][WHEEL_SLOTS/WORD_BITS];
+static int      g_overflow = -1;            /* list of far-future events */
+static Ready    *g_ready = NULL;            /* heap of due events */
+static size_t   g_ready_size = 0;
+static size_t   g_ready_cap = 0;
+static int      *g_index = NULL;            /* hash index of nodes by key */
+static size_t   g_index_size = 0;
+static size_t   g_index_cap = 0;            /* zero or a power of two */
+static Tick     g_now = 0;                  /* current wheel time */
+static bool     g_wheel_init = false;
+static bool     g_bulk = false;             /* defer ready heap ordering */
+static size_t   g_queue_size = 0;
+static size_t   g_limit = DEFAULT_LIMIT;
+static size_t   g_refused = 0;              /* events refused so far */
+static bool     g_refusing = false;         /* last push refused? */
+static bool     g_dirty = false;
+
+static Tick event_tick(const Event *ev)
+{
+    return ev->time >> TICK_SHIFT;
+}
+
+static bool is_indexed(EventType type)
+{
+    return type == EVENT_TYPE_UPDATE || type == EVENT_TYPE_FLOW;
+}
+
+static bool is_essential(EventType type)
+{
+    return type == EVENT_TYPE_TICK || type == EVENT_TYPE_SAVE;
+}
+
+static void wheel_init()
+{
+    int l, s;
+
+    for (l = 0; l < WHEEL_LEVELS; ++l)
+    {
+        for (s = 0; s < WHEEL_SLOTS; ++s) g_wheel[l][s] = -1;
+    }
+    memset(g_occupied, 0, sizeof(g_occupied));
+    g_wheel_init = true;
+}
+
+static size_t segment_bytes()
+{
+    return SEGMENT_NODES*sizeof(Node);
+}
+
+size_t event_queue_memory()
+{
+    return g_num_segments*segment_bytes() + g_ready_cap*sizeof(Ready) +
+           g_max_segments*sizeof(Node*) + g_index_cap*sizeof(int);
+}
+
+/* Adds a segment of nodes. Unless `over_limit' is set, fails if that would
+   exceed the memory limit. */
+static bool add_segment(bool over_limit)
+{
+    Node *segment;
+
+    if (!over_limit && event_queue_memory() + segment_bytes() > g_limit)
+        return false;
+
+    if (g_num_segments == g_max_segments)
+    {
+        int new_max = g_max_segments ? 2*g_max_segments : 16;
+        Node **new_segments = realloc(g_segments, new_max*sizeof(Node*));
+        if (new_segments == NULL) return false;
+        g_segments = new_segments;
+        g_max_segments = new_max;
+    }
+
+    segment = malloc(segment_bytes());
+    if (segment == NULL) return false;
+    g_segments[g_num_segments++] = segment;
+    return true;
+}
+
+/* Returns the number of nodes that can be allocated without adding a
+   segment. */
+static int spare_nodes()
+{
+    return g_num_free + (g_num_segments*SEGMENT_NODES - g_nodes_used);
+}
+
+/* Returns the number of spare nodes kept for tick and save events. */
+static int reserved_nodes()
+{
+    return g_num_essential < ESSENTIAL_EVENTS
+         ? ESSENTIAL_EVENTS - g_num_essential : 0;
+}
+
+/* Allocates a node for an event. Other events may not take the nodes kept
+   in reserve, while essential events may exceed the memory limit if there
+   are none. Returns -1 if no node is available. */
+static int node_alloc(bool essential)
+{
+    int n = g_free;
+
+    if ( !essential && spare_nodes() <= reserved_nodes() &&
+         !add_segment(false) )
+        return -1;
+
+    if (n >= 0)
+    {
+        g_free = NODE(n).next;
+        --g_num_free;
+    }
+    else
+    if ( g_nodes_used < g_num_segments*SEGMENT_NODES ||
+         add_segment(essential) )
+    {
+        n = g_nodes_used++;
+    }
+    return n;
+}
+
+static void node_free(int n)
+{
+    NODE(n).next = g_free;
+    g_free = n;
+    ++g_num_free;
+}
+
+/* Index functions. The index is an open-addressing hash table with linear
+   probing, mapping keys (event data masked with EVENT_KEY_MASK) to nodes. */
+
+static size_t index_slot(EventData key)
+{
+    return (size_t)((key*0x9E3779B97F4A7C15ull) >> 32) & (g_index_cap - 1);
+}
+
+/* Returns the indexed node with the given key, or -1 if there is none. */
+static int index_find(EventData key)
+{
+    size_t i;
+
+    if (g_index_size == 0) return -1;
+    for (i = index_slot(key); g_index[i] >= 0; i = (i + 1) & (g_index_cap - 1))
+    {
+        if ((NODE(g_index[i]).ev.data & EVENT_KEY_MASK) == key) return g_index[i];
+    }
+    return -1;
+}
+
+static void index_insert(int n)
+{
+    size_t i = index_slot(NODE(n).ev.data & EVENT_KEY_MASK);
+
+    while (g_index[i] >= 0) i = (i + 1) & (g_index_cap - 1);
+    g_index[i] = n;
+    ++g_index_size;
+}
+
+/* Resizes the index and re-enters all indexed nodes. Returns false if memory
+   could not be allocated, in which case the index is left unchanged. */
+static bool index_resize(size_t cap)
+{
+    int *new_index = malloc(cap*sizeof(int)), *old_index = g_index;
+    size_t old_cap = g_index_cap, i;
+
+    if (new_index == NULL) return false;
+    for (i = 0; i < cap; ++i) new_index[i] = -1;
+    g_index      = new_index;
+    g_index_cap  = cap;
+    g_index_size = 0;
+    for (i = 0; i < old_cap; ++i)
+    {
+        if (old_index[i] >= 0) index_insert(old_index[i]);
+    }
+    free(old_index);
+    return true;
+}
+
+/* Adds node `n' to the index. If the index cannot grow, the node is simply
+   not indexed, which only means it won't be merged with later events. */
+static void index_add(int n)
+{
+    if (2*(g_index_size + 1) > g_index_cap &&
+        !index_resize(g_index_cap ? 2*g_index_cap : MIN_INDEX_CAP)) return;
+    index_insert(n);
+}
+
+/* Removes node `n' from the index, if it is indexed. */
+static void index_remove(int n)
+{
+    size_t i, j;
+
+    if (g_index_size == 0) return;
+    for (i = index_slot(NODE(n).ev.data & EVENT_KEY_MASK); g_index[i] != n;
+         i = (i + 1) & (g_index_cap - 1))
+    {
+        if (g_index[i] < 0) return;
+    }
+
+    /* Shift back later entries of the probe sequence to fill the gap: */
+    for (j = (i + 1) & (g_index_cap - 1); g_index[j] >= 0;
+         j = (j + 1) & (g_index_cap - 1))
+    {
+        size_t k = index_slot(NODE(g_index[j]).ev.data & EVENT_KEY_MASK);
+        if (((j - k) & (g_index_cap - 1)) >= ((j - i) & (g_index_cap - 1)))
+        {
+            g_index[i] = g_index[j];
+            i = j;
+        }
+    }
+    g_index[i] = -1;
+    --g_index_size;
+}
+
+/* Resizes the ready heap to hold `cap' elements. Since nodes must be moved
+   to the ready heap as time advances, failure to grow it is fatal. */
+static void ready_resize(size_t cap)
+{
+    Ready *new_ready;
+
+    if (cap < MIN_READY_CAP) cap = MIN_READY_CAP;
+    new_ready = realloc(g_ready, cap*sizeof(Ready));
+    if (new_ready == NULL)
+    {
+        if (cap > g_ready_cap) fatal("couldn't grow event queue");
+        return;
+    }
+    g_ready = new_ready;
+    g_ready_cap = cap;
+}
+
+/* Returns a pointer to the head of the given wheel slot or overflow list. */
+static int *list_head(int list)
 {
-    return -tv_cmp(&((EventBase*)a)->time, &((EventBase*)b)->time);
+    return list == OVERFLOW_LIST ? &g_overflow
+                                 : &g_wheel[list/WHEEL_SLOTS][list%WHEEL_SLOTS];
+}
+
+static void list_push(int list, int n)
+{
+    int *head = list_head(list);
+
+    NODE(n).next = *head;
+    NODE(n).prev = PREV_HEAD(list);
+    if (*head >= 0) NODE(*head).prev = n;
+    *head = n;
+    if (list != OVERFLOW_LIST)
+    {
+        int slot = list%WHEEL_SLOTS;
+        g_occupied[list/WHEEL_SLOTS][slot/WORD_BITS] |= 1ull << (slot%WORD_BITS);
+    }
+}
+
+/* Detaches and returns the entire list. */
+static int list_take(int list)
+{
+    int *head = list_head(list), n = *head;
+
+    *head = -1;
+    if (list != OVERFLOW_LIST)
+    {
+        int slot = list%WHEEL_SLOTS;
+        g_occupied[list/WHEEL_SLOTS][slot/WORD_BITS] &= ~(1ull << (slot%WORD_BITS));
+    }
+    return n;
+}
+
+static void list_unlink(int n)
+{
+    int next = NODE(n).next, prev = NODE(n).prev;
+
+    if (next >= 0) NODE(next).prev = prev;
+    if (prev >= 0)
+    {
+        NODE(prev).next = next;
+    }
+    else
+    {
+        int list = PREV_HEAD(prev);  /* N.B. PREV_HEAD is its own inverse */
+        if (next >= 0)
+            *list_head(list) = next;
+        else
+            list_take(list);
+    }
+}
+
+/* Files node `n' into the ready heap, the wheel or the overflow list,
+   relative to the current wheel time. */
+static void wheel_insert(int n)
+{
+    Tick t = event_tick(&NODE(n).ev);
+    int level, slot;
+
+    if (t <= g_now)
+    {
+        Ready r;
+        r.usec = NODE(n).ev.time;
+        r.node = n;
+        NODE(n).next = -1;
+        NODE(n).prev = PREV_READY;
+        if (g_ready_size == g_ready_cap) ready_resize(2*g_ready_cap);
+        if (g_bulk)
+            g_ready[g_ready_size++] = r;
+        else
+            ready_heap_push(g_ready, g_ready_size++, r);
+        return;
+    }
+
+    level = (WORD_BITS - 1 - __builtin_clzll(t ^ g_now))/WHEEL_BITS;
+    if (level >= WHEEL_LEVELS)
+    {
+        list_push(OVERFLOW_LIST, n);
+        return;
+    }
+
+    slot = (t >> (WHEEL_BITS*level)) & (WHEEL_SLOTS - 1);
+    list_push(level*WHEEL_SLOTS + slot, n);
+}
+
+/* Returns the first occupied slot at `level' with index at least `slot',
+   or -1 if there is none. */
+static int next_occupied(int level, int slot)
+{
+    while (slot < WHEEL_SLOTS)
+    {
+        Tick bits = g_occupied[level][slot/WORD_BITS] >> (slot%WORD_BITS);
+        if (bits != 0) return slot + __builtin_ctzll(bits);
+        slot = (slot/WORD_BITS + 1)*WORD_BITS;
+    }
+    return -1;
+}
+
+/* Re-files all nodes in the given list. */
+static void wheel_reinsert(int n)
+{
+    while (n >= 0)
+    {
+        int next = NODE(n).next;
+        wheel_insert(n);
+        n = next;
+    }
+}
+
+/* Advances the wheel time to the next pending event, until at least one
+   live event is ready. Precondition: the queue is not empty. */
+static void wheel_advance()
+{
+    for (;;)
+    {
+        int level, slot = -1, shift, n;
+
+        /* Discard cancelled events: */
+        while ( g_ready_size > 0 &&
+                event_type(&NODE(g_ready[0].node).ev) == EVENT_TYPE_NONE )
+        {
+            node_free(ready_heap_pop(g_ready, g_ready_size--).node);
+        }
+        if (g_ready_size > 0) break;
+
+        for (level = 0; level < WHEEL_LEVELS; ++level)
+        {
+            int digit = (g_now >> (WHEEL_BITS*level)) & (WHEEL_SLOTS - 1);
+            slot = next_occupied(level, digit + 1);
+            if (slot >= 0) break;
+        }
+
+        if (slot < 0)
+        {
+            /* Wheel is empty; restart it at the earliest overflow event. */
+            assert(g_overflow >= 0);
+            g_now = event_tick(&NODE(g_overflow).ev);
+            for (n = NODE(g_overflow).next; n >= 0; n = NODE(n).next)
+            {
+                Tick t = event_tick(&NODE(n).ev);
+                if (t < g_now) g_now = t;
+            }
+            wheel_reinsert(list_take(OVERFLOW_LIST));
+            continue;
+        }
+
+        /* All lower levels are empty here, so we can jump to the start of
+           the slot and cascade its events down. */
+        shift = WHEEL_BITS*level;
+        g_now = (g_now >> shift >> WHEEL_BITS << WHEEL_BITS | slot) << shift;
+        wheel_reinsert(list_take(level*WHEEL_SLOTS + slot));
+    }
+}
+
+/* Removes a pending event from the queue without processing it. */
+static void cancel(int n)
+{
+    index_remove(n);
+    if (NODE(n).prev == PREV_READY)
+    {
+        NODE(n).ev.data = event_data(EVENT_TYPE_NONE, 0, 0, 0, 0, 0);
+    }
+    else
+    {
+        list_unlink(n);
+        node_free(n);
+    }
+    --g_queue_size;
+}
+
+/* Copies the node with index `n' from `old_segments' into the next free node
+   of the current segments, and returns its new index. */
+static int compact_node(Node **old_segments, int n)
+{
+    int m = g_nodes_used++;
+    NODE(m) = old_segments[n >> SEGMENT_SHIFT][n & (SEGMENT_NODES - 1)];
+    return m;
+}
+
+/* Copies the given list from `old_segments' into the current segments. */
+static void compact_list(Node **old_segments, int list)
+{
+    int n = list_take(list), prev = -1;
+
+    while (n >= 0)
+    {
+        int m = compact_node(old_segments, n);
+
+        n = NODE(m).next;
+        if (prev < 0)
+        {
+            list_push(list, m);
+        }
+        else
+        {
+            NODE(prev).next = m;
+            NODE(m).prev = prev;
+        }
+        NODE(m).next = -1;
+        prev = m;
+    }
+}
+
+/* Moves all events into a fresh set of segments with room for twice the
+   current number of events, releasing the old ones. Cancelled events are
+   dropped from the ready heap, and the index is rebuilt. */
+static void compact()
+{
+    Node **old_segments = g_segments;
+    int old_num_segments = g_num_segments, num_segments, i, list;
+    size_t n, m;
+
+    num_segments = (2*g_queue_size + SEGMENT_NODES - 1)/SEGMENT_NODES;
+    if (num_segments < 1) num_segments = 1;
+
+    g_segments = malloc(num_segments*sizeof(Node*));
+    if (g_segments == NULL) goto failed;
+    for (i = 0; i < num_segments; ++i)
+    {
+        g_segments[i] = malloc(segment_bytes());
+        if (g_segments[i] == NULL)
+        {
+            while (i-- > 0) free(g_segments[i]);
+            free(g_segments);
+            goto failed;
+        }
+    }
+    g_num_segments = g_max_segments = num_segments;
+    g_nodes_used = 0;
+    g_free = -1;
+    g_num_free = 0;
+
+    for (n = m = 0; n < g_ready_size; ++n)
+    {
+        int k = g_ready[n].node;
+        Node *node = &old_segments[k >> SEGMENT_SHIFT][k & (SEGMENT_NODES - 1)];
+        if (event_type(&node->ev) != EVENT_TYPE_NONE)
+        {
+            g_ready[m] = g_ready[n];
+            g_ready[m++].node = compact_node(old_segments, k);
+        }
+    }
+    g_ready_size = m;
+    ready_heap_create(g_ready, g_ready_size);
+    for (list = 0; list <= OVERFLOW_LIST; ++list)
+        compact_list(old_segments, list);
+    assert(g_nodes_used == g_queue_size);
+
+    for (i = 0; i < old_num_segments; ++i) free(old_segments[i]);
+    free(old_segments);
+
+    /* Rebuild the index at a size appropriate for the remaining events: */
+    for (n = MIN_INDEX_CAP; n < 2*g_queue_size; n *= 2) { }
+    free(g_index);
+    g_index = NULL;
+    g_index_cap = g_index_size = 0;
+    if (index_resize(n))
+    {
+        for (i = 0; i < g_nodes_used; ++i)
+        {
+            if (is_indexed(event_type(&NODE(i).ev))) index_add(i);
+        }
+    }
+    return;
+
+failed:
+    g_segments = old_segments;  /* keep using the old segments */
 }
 
 size_t event_count()
@@ -24,24 +587,109 @@ size_t event_count()
     return g_queue_size;
 }
 
-void event_push(const Event *event)
+void event_queue_set_limit(size_t bytes)
 {
-    if (g_queue_size == QUEUE_CAP)
+    g_limit = bytes;
+}
+
+size_t event_queue_refused()
+{
+    return g_refused;
+}
+
+bool event_queue_full()
+{
+    return spare_nodes() <= reserved_nodes() &&
+           event_queue_memory() + segment_bytes() > g_limit;
+}
+
+static void set_refusing(bool refusing)
+{
+    if (refusing == g_refusing) return;
+    if (refusing)
     {
-        error( "Can't push an event of type %d; queue full!",
-               (int)event->base.type );
+        error( "event queue full at %d events (%d KiB); refusing events",
+               (int)g_queue_size, (int)(event_queue_memory() >> 10) );
     }
     else
     {
-        heap_push(g_queue, g_queue_size, sizeof(*g_queue), event_cmp, event);
-        ++g_queue_size;
-        g_dirty = true;
+        info( "event queue accepting events again (%d refused so far)",
+              (int)g_refused );
     }
+    g_refusing = refusing;
+}
+
+/* Returns the pending event with the same block and the given type as
+   `event', or -1 if there is none. */
+static int find_pending(const Event *event, EventType type)
+{
+    return index_find( (event->data & EVENT_KEY_MASK & ~(EventData)0xff) |
+                       (EventData)type );
+}
+
+/* Merges `event' with pending events for the same block. Returns true if
+   the event is redundant and need not be queued.
+
+   An update event supersedes pending update and flow events for its block:
+   the handler of a pending update would find the block changed and ignore
+   it, and the new update activates the block again when it is processed.
+   A flow event is merged with a pending flow event, keeping the earliest of
+   the two times. */
+static bool coalesce(const Event *event)
+{
+    int n;
+
+    switch (event_type(event))
+    {
+    case EVENT_TYPE_UPDATE:
+        if ((n = find_pending(event, EVENT_TYPE_UPDATE)) >= 0) cancel(n);
+        if ((n = find_pending(event, EVENT_TYPE_FLOW)) >= 0) cancel(n);
+        return false;
+
+    case EVENT_TYPE_FLOW:
+        n = find_pending(event, EVENT_TYPE_FLOW);
+        if (n < 0) return false;
+        if (NODE(n).ev.time <= event->time) return true;
+        cancel(n);
+        return false;
+
+    default:
+        return false;
+    }
+}
+
+bool event_push(const Event *event)
+{
+    bool essential = is_essential(event_type(event));
+    int n = -1;
+
+    if (!g_wheel_init) wheel_init();
+
+    if (coalesce(event)) return true;
+
+    n = node_alloc(essential);
+    if (!essential) set_refusing(n < 0);
+    if (n < 0)
+    {
+        ++g_refused;
+        return false;
+    }
+    if (essential) ++g_num_essential;
+
+    NODE(n).ev = *event;
+    if (g_queue_size == 0) g_now = event_tick(event);
+    wheel_insert(n);
+    if (is_indexed(event_type(event))) index_add(n);
+    ++g_queue_size;
+    g_dirty = true;
+    return true;
 }
 
 Event *event_peek()
 {
-    return (g_queue_size > 0) ? &g_queue[0] : NULL;
+    if (g_queue_size == 0) return NULL;
+    wheel_advance();
+    return &NODE(g_ready[0].node).ev;
 }
 
 void event_pop(Event *event)
@@ -49,9 +697,22 @@ void event_pop(Event *event)
     assert(g_queue_size > 0);
     if (g_queue_size > 0)
     {
-        heap_pop(g_queue, g_queue_size, sizeof(*g_queue), event_cmp, event);
+        int n;
+
+        wheel_advance();
+        n = ready_heap_pop(g_ready, g_ready_size--).node;
+        if (event != NULL) *event = NODE(n).ev;
+        if (is_essential(event_type(&NODE(n).ev))) --g_num_essential;
+        index_remove(n);
+        node_free(n);
         --g_queue_size;
         g_dirty = true;
+
+        /* Release memory after bursts: */
+        if (g_num_segments > 1 &&
+            g_queue_size < (size_t)g_num_segments*SEGMENT_NODES/4) compact();
+        if (g_ready_cap > MIN_READY_CAP && g_ready_size < g_ready_cap/4)
+            ready_resize(g_ready_cap/2);
     }
 }
 
@@ -60,70 +721,249 @@ bool event_queue_is_dirty()
     return g_dirty;
 }
 
-bool event_queue_write(const char *path)
+/* Binary event files start with a header of EVENT_FILE_MAGIC followed by a
+   32-bit version number, followed by one record per event: a signed 64-bit
+   time relative to the time of writing, in microseconds, and the 64-bit
+   event data word. All integers are stored in big-endian byte order. */
+
+#define EVENT_FILE_MAGIC    "MCEv"
+#define EVENT_FILE_VERSION  1
+#define HEADER_SIZE         8
+#define RECORD_SIZE         16
+#define RECORDS_PER_BLOCK   4096
+
+typedef struct Writer
 {
-    struct timeval now;
-    size_t n;
-    gzFile fp;
+    gzFile          fp;
+    usec_t          now;
+    size_t          len;
+    bool            ok;
+    unsigned char   buf[RECORDS_PER_BLOCK*RECORD_SIZE];
+} Writer;
 
-    tv_now(&now);
+static void put64(unsigned char *buf, unsigned long long v)
+{
+    int i;
+    for (i = 7; i >= 0; --i, v >>= 8) buf[i] = v & 0xff;
+}
 
-    fp = gzopen(path, "wt");
-    if (fp == Z_NULL) return false;
+static unsigned long long get64(const unsigned char *buf)
+{
+    unsigned long long v = 0;
+    int i;
+    for (i = 0; i < 8; ++i) v = v << 8 | buf[i];
+    return v;
+}
+
+static void flush_records(Writer *w)
+{
+    if (w->len > 0 && gzwrite(w->fp, w->buf, w->len) != w->len) w->ok = false;
+    w->len = 0;
+}
 
-    for (n = 0; n < g_queue_size; ++n)
+static void write_record(Writer *w, const Event *ev)
+{
+    switch (event_type(ev))
     {
-        struct timeval tv = g_queue[n].base.time;
-        int sec, usec;
-        tv_sub_tv(&tv, &now);
-        sec  = (int)tv.tv_sec;
-        usec = (int)tv.tv_usec;
+    case EVENT_TYPE_NONE:   /* cancelled event */
+    case EVENT_TYPE_TICK:   /* don't save tick, save, sweep or drain events */
+    case EVENT_TYPE_SAVE:
+    case EVENT_TYPE_SWEEP:
+    case EVENT_TYPE_DRAIN:
+        return;
 
-        switch (g_queue[n].base.type)
-        {
-        case EVENT_TYPE_TICK:   /* don't save tick or save events */
-        case EVENT_TYPE_SAVE:
-            break;
+    default:
+        break;
+    }
 
-        case EVENT_TYPE_UPDATE:
-            {
-                UpdateEvent *ev = &g_queue[n].update_event;
-                gzprintf(fp, "update %d %d %d %d %d %d %d\n", sec, usec,
-                             ev->x, ev->y, ev->z, ev->old_t, ev->new_t);
-            } break;
+    /* The header leaves records unaligned to the buffer size: */
+    if (w->len + RECORD_SIZE > sizeof(w->buf)) flush_records(w);
+    put64(w->buf + w->len, ev->time - w->now);
+    put64(w->buf + w->len + 8, ev->data);
+    w->len += RECORD_SIZE;
+}
 
-        case EVENT_TYPE_FLOW:
-            {
-                FlowEvent *ev = &g_queue[n].flow_event;
-                gzprintf(fp, "flow %d %d %d %d %d\n", sec, usec,
-                             ev->x, ev->y, ev->z);
-            } break;
+static void write_list(Writer *w, int n)
+{
+    for ( ; n >= 0; n = NODE(n).next) write_record(w, &NODE(n).ev);
+}
 
-        case EVENT_TYPE_GROW:
-            {
-                GrowEvent *ev = &g_queue[n].grow_event;
-                gzprintf(fp, "grow %d %d %d %d %d\n", sec, usec,
-                             ev->x, ev->y, ev->z);
-            } break;
+/* Functions supplying events to be saved (see event_queue_add_source()): */
+#define MAX_SOURCES           4
+
+static event_source_fn *g_sources[MAX_SOURCES];
+static int      g_num_sources = 0;
 
-        default:
-            fatal("cannot write event with unrecognized type %d\n",
-                  g_queue[n].base.type);
+static void write_sink(void *arg, const Event *ev)
+{
+    write_record((Writer*)arg, ev);
+}
+
+void event_queue_add_source(event_source_fn *source)
+{
+    assert(g_num_sources < MAX_SOURCES);
+    if (g_num_sources < MAX_SOURCES) g_sources[g_num_sources++] = source;
+}
+
+/* Writes all events to `fp', which is closed afterwards. `name' identifies
+   the destination in error messages. */
+static bool write_events(gzFile fp, const char *name)
+{
+    static Writer w;
+    size_t n;
+    int i, l, s;
+
+    w.fp  = fp;
+    w.now = usec_now();
+    w.len = 0;
+    w.ok  = true;
+
+    memcpy(w.buf, EVENT_FILE_MAGIC, 4);
+    w.buf[4] = w.buf[5] = w.buf[6] = 0;
+    w.buf[7] = EVENT_FILE_VERSION;
+    w.len = HEADER_SIZE;
+
+    for (n = 0; n < g_ready_size; ++n)
+        write_record(&w, &NODE(g_ready[n].node).ev);
+    if (g_wheel_init)
+    {
+        for (l = 0; l < WHEEL_LEVELS; ++l)
+        {
+            for (s = 0; s < WHEEL_SLOTS; ++s) write_list(&w, g_wheel[l][s]);
         }
     }
+    write_list(&w, g_overflow);
+    for (i = 0; i < g_num_sources; ++i) (*g_sources[i])(write_sink, &w);
+    flush_records(&w);
 
-    gzclose(fp);
+    if (gzclose(w.fp) != Z_OK) w.ok = false;
+    if (!w.ok)
+    {
+        error("failed to write events to %s", name);
+        return false;
+    }
+    return true;
+}
+
+bool event_queue_write(const char *path)
+{
+    gzFile fp = gzopen(path, "wb");
+
+    if (fp == Z_NULL || !write_events(fp, path)) return false;
     g_dirty = false;
     return true;
 }
 
+/* Opens a duplicate of `fd' with zlib, so closing the result leaves `fd'
+   open. */
+static gzFile gzdopen_dup(int fd, const char *mode)
+{
+    int dup_fd = dup(fd);
+    gzFile fp;
+
+    if (dup_fd < 0) return Z_NULL;
+    fp = gzdopen(dup_fd, mode);
+    if (fp == Z_NULL) close(dup_fd);
+    return fp;
+}
+
+bool event_queue_write_fd(int fd)
+{
+    /* Favour speed over size, as the data is not stored */
+    gzFile fp = gzdopen_dup(fd, "wb1");
+
+    return fp != Z_NULL && write_events(fp, "socket");
+}
+
+/* Converts a time relative to `now' to an absolute time. */
+static usec_t absolute_time(usec_t now, long long rel)
+{
+    return (rel < 0 && (usec_t)-rel > now) ? 0 : now + rel;
+}
+
+/* Reads events from `fp' into the queue, and closes it. `path' identifies
+   the source in error messages.
+
+   Due events are appended to the ready heap unordered while reading, and
+   the heap is rebuilt once at the end, so loading takes O(n) time. Events
+   read before an error are kept. */
+static bool read_events(gzFile fp, const char *path)
+{
+    static unsigned char buf[RECORDS_PER_BLOCK*RECORD_SIZE];
+    usec_t now = usec_now();
+    int version, len;
+    bool ok = true;
+
+    if ( gzread(fp, buf, HEADER_SIZE) != HEADER_SIZE ||
+         memcmp(buf, EVENT_FILE_MAGIC, 4) != 0 )
+    {
+        error("%s is not an event file", path);
+        gzclose(fp);
+        return false;
+    }
+    version = (int)(get64(buf) & 0xffffffffu);
+    if (version != EVENT_FILE_VERSION)
+    {
+        error("%s has unsupported version %d", path, version);
+        gzclose(fp);
+        return false;
+    }
+
+    g_bulk = true;
+    while ((len = gzread(fp, buf, sizeof(buf))) > 0)
+    {
+        size_t n, i;
+
+        if (len%RECORD_SIZE != 0)
+        {
+            error("%s is truncated", path);
+            ok = false;
+        }
+        n = len/RECORD_SIZE;
+        for (i = 0; i < n; ++i)
+        {
+            const unsigned char *rec = buf + RECORD_SIZE*i;
+            Event ev;
+
+            ev.time = absolute_time(now, (long long)get64(rec));
+            ev.data = get64(rec + 8);
+
+            /* Grass growth is now driven by random ticks instead. */
+            if (event_type(&ev) != EVENT_TYPE_GROW) event_push(&ev);
+        }
+    }
+    g_bulk = false;
+    ready_heap_create(g_ready, g_ready_size);
+    if (len < 0)
+    {
+        error("could not read %s", path);
+        ok = false;
+    }
+
+    gzclose(fp);
+    return ok;
+}
+
 bool event_queue_read(const char *path)
 {
-    struct timeval now;
+    gzFile fp = gzopen(path, "rb");
+
+    return fp != Z_NULL && read_events(fp, path);
+}
+
+bool event_queue_read_fd(int fd)
+{
+    gzFile fp = gzdopen_dup(fd, "rb");
+
+    return fp != Z_NULL && read_events(fp, "socket");
+}
+
+bool event_queue_import(const char *path)
+{
+    usec_t now = usec_now();
     char line[1024];
     gzFile fp;
 
-    tv_now(&now);
     fp = gzopen(path, "rt");
     if (fp == Z_NULL) return false;
 
@@ -135,30 +975,20 @@ bool event_queue_read(const char *path)
         if (sscanf(line, "update %d %d %d %d %d %d %d",
                          &sec, &usec, &x, &y, &z, &t, &u) == 7)
         {
-            ev.base.type = EVENT_TYPE_UPDATE;
-            ev.update_event.x     = x;
-            ev.update_event.y     = y;
-            ev.update_event.z     = z;
-            ev.update_event.old_t = t;
-            ev.update_event.new_t = u;
+            ev.data = event_data(EVENT_TYPE_UPDATE, x, y, z, t, u);
         }
         else
         if (sscanf(line, "flow %d %d %d %d %d",
                          &sec, &usec, &x, &y, &z) == 5)
         {
-            ev.base.type = EVENT_TYPE_FLOW;
-            ev.update_event.x = x;
-            ev.update_event.y = y;
-            ev.update_event.z = z;
+            ev.data = event_data(EVENT_TYPE_FLOW, x, y, z, 0, 0);
         }
         else
         if (sscanf(line, "grow %d %d %d %d %d",
                           &sec, &usec, &x, &y, &z) == 5)
         {
-            ev.base.type = EVENT_TYPE_GROW;
-            ev.update_event.x = x;
-            ev.update_event.y = y;
-            ev.update_event.z = z;
+            /* Grass growth is now driven by random ticks instead. */
+            continue;
         }
         else
         {
@@ -167,8 +997,7 @@ bool event_queue_read(const char *path)
         }
 
         /* Set absolute timestamp: */
-        ev.base.time = now;
-        tv_add(&ev.base.time, sec, usec);
+        ev.time = absolute_time(now, 1000000LL*sec + usec);
 
         /* Push event into queue: */
         event_push(&ev);
@@ -5,7 +5,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
-#define EVENT_FILE      "events.txt.gz"
+#define EVENT_FILE      "events.bin.gz"
+#define EVENT_TEXT_FILE "events.txt.gz"   /* old text format; import only */
 
 typedef enum EventType {
     EVENT_TYPE_NONE = 0,
@@ -13,57 +14,97 @@ typedef enum EventType {
     EVENT_TYPE_SAVE,
     EVENT_TYPE_UPDATE,
     EVENT_TYPE_FLOW,
-    EVENT_TYPE_GROW
+    EVENT_TYPE_GROW,    /* obsolete; replaced by random ticks */
+    EVENT_TYPE_SWEEP,   /* fluid sweep; x is the fluid kind (see fluid.h) */
+    EVENT_TYPE_DRAIN    /* super sponge step (see sponge.h) */
 } EventType;
 
-typedef struct EventBase
+/* Events are encoded in 16 bytes: a 64-bit monotonic timestamp (see
+   usec_now()) and a 64-bit data word which packs the event type, block
+   coordinates and, for update events, the old and new block types:
+
+    bits  0- 7  type
+    bits  8-19  x
+    bits 20-31  y
+    bits 32-43  z
+    bits 44-51  old type
+    bits 52-59  new type
+    bit     63  parked in a frozen region when saved (see regions.h)
+*/
+typedef unsigned long long EventData;
+
+typedef struct Event
 {
-    struct timeval  time;
-    EventType       type;
-} EventBase;
+    usec_t      time;   /* when the event is due */
+    EventData   data;   /* type and payload */
+} Event;
+
+#define EVENT_PARKED        (1ull << 63)
+#define EVENT_COORD_BITS    12
+#define EVENT_COORD_MASK    ((1 << EVENT_COORD_BITS) - 1)
 
-typedef struct TickEvent
+/* Pack an event data word. Coordinates must be in range [0,4096). */
+static inline EventData event_data( EventType type, int x, int y, int z,
+                                    int old_t, int new_t )
 {
-    int dummy;
-} TickEvent;
+    return (EventData)(type  & 0xff)             <<  0 |
+           (EventData)(x     & EVENT_COORD_MASK) <<  8 |
+           (EventData)(y     & EVENT_COORD_MASK) << 20 |
+           (EventData)(z     & EVENT_COORD_MASK) << 32 |
+           (EventData)(old_t & 0xff)             << 44 |
+           (EventData)(new_t & 0xff)             << 52;
+}
+
+static inline EventType event_type(const Event *ev)
+{
+    return (EventType)(ev->data & 0xff);
+}
 
-typedef struct SaveEvent
+static inline int event_x(const Event *ev)
 {
-    int dummy;
-} SaveEvent;
+    return (int)(ev->data >>  8) & EVENT_COORD_MASK;
+}
 
-typedef struct UpdateEvent
+static inline int event_y(const Event *ev)
 {
-    unsigned short x, y, z, old_t, new_t;
-} UpdateEvent;
+    return (int)(ev->data >> 20) & EVENT_COORD_MASK;
+}
 
-typedef struct FlowEvent
+static inline int event_z(const Event *ev)
 {
-    unsigned short x, y, z;
-} FlowEvent;
+    return (int)(ev->data >> 32) & EVENT_COORD_MASK;
+}
 
-typedef struct GrowEvent
+static inline int event_old_t(const Event *ev)
 {
-    unsigned short x, y, z;
-} GrowEvent;
+    return (int)(ev->data >> 44) & 0xff;
+}
 
-typedef struct Event
+static inline int event_new_t(const Event *ev)
 {
-    EventBase base;
-    union {
-        TickEvent   tick_event;
-        SaveEvent   save_event;
-        UpdateEvent update_event;
-        FlowEvent   flow_event;
-        GrowEvent   grow_event;
-    };
-} Event;
+    return (int)(ev->data >> 52) & 0xff;
+}
 
 /* Count number of pending events */
 size_t event_count();
 
-/* Add an event to the global queue */
-void event_push(const Event *event);
+/* Add an event to the global queue. Returns false if the event was refused
+   because the queue's memory limit has been reached. Room is kept for one
+   tick and one save event, which are only refused if memory runs out. */
+bool event_push(const Event *event);
+
+/* Set the maximum amount of memory used by the event queue, in bytes. */
+void event_queue_set_limit(size_t bytes);
+
+/* Return the amount of memory currently allocated by the event queue. */
+size_t event_queue_memory();
+
+/* Return whether the queue is full, i.e. no more events can be pushed until
+   some are popped. */
+bool event_queue_full();
+
+/* Return the total number of events refused by event_push(). */
+size_t event_queue_refused();
 
 /* Return pointer to next event (or NULL if queue is empty) without removing
    it from the queue. */
@@ -76,10 +117,34 @@ void event_pop(Event *event);
 /* Return whether the queue has been saved since the last modification. */
 bool event_queue_is_dirty();
 
-/* Write all events in the queue to `path' */
+/* Receives events from an event source; see event_queue_add_source(). */
+typedef void (event_sink_fn)(void *arg, const Event *event);
+
+/* Supplies events that are not in the queue by passing each to `sink'. */
+typedef void (event_source_fn)(event_sink_fn *sink, void *arg);
+
+/* Registers a function which supplies events to be saved along with the
+   queue. This allows modules that keep their own state instead of queueing
+   events to have that state restored as ordinary events when the queue is
+   read back. */
+void event_queue_add_source(event_source_fn *source);
+
+/* Write all events in the queue, and those supplied by event sources, to
+   `path' in binary format */
 bool event_queue_write(const char *path);
 
-/* Read all events from path into the queue */
+/* Read all events from a binary event file at `path' into the queue */
 bool event_queue_read(const char *path);
 
+/* Write all events, as event_queue_write() does, to the file descriptor `fd'
+   instead, without marking the queue as saved. `fd' is left open. */
+bool event_queue_write_fd(int fd);
+
+/* Read all events written by event_queue_write_fd() from `fd' into the queue,
+   until end of file. `fd' is left open. */
+bool event_queue_read_fd(int fd);
+
+/* Read all events from a text event file at `path' into the queue */
+bool event_queue_import(const char *path);
+
 #endif /* ndef EVENTS_H_INCLUDED */
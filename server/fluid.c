@@ -0,0 +1,313 @@
+#include "fluid.h"
+#include "events.h"
+#include "regions.h"
+#include "workers.h"
+#include "common/blocks.h"
+#include "common/logging.h"
+#include "common/timeval.h"
+#include <string.h>
+
+#define MIN_CAPACITY    1024
+
+/* Sweeps of at least PARALLEL_MIN_CELLS blocks are split into parts which
+   are processed by the worker threads. Each part covers a contiguous range
+   of the sorted active set, i.e. a horizontal slab of the level, and the
+   updates of all parts are concatenated in order, so the result is the same
+   as that of a serial sweep. */
+#define PARALLEL_MIN_CELLS  8192
+#define PARTS_PER_THREAD    4
+#define MAX_PARTS           (PARTS_PER_THREAD*(MAX_WORKERS + 1))
+
+/* Sweep periods per fluid kind, in microseconds: */
+static const int SWEEP_PERIOD[FLUID_KINDS] = {
+    300000,     /* water: 300ms */
+    3000000     /* lava: 3s */
+};
+
+/* Growable array of block indices */
+typedef struct Cells
+{
+    unsigned    *data;
+    size_t      size, cap;
+} Cells;
+
+/* Growable array of block updates */
+typedef struct Updates
+{
+    BlockUpdate *data;
+    size_t      size, cap;
+} Updates;
+
+typedef struct ActiveSet
+{
+    Cells       cells;          /* active blocks, unordered */
+    bool        scheduled;      /* sweep event pending? */
+} ActiveSet;
+
+static ActiveSet        g_active[FLUID_KINDS];
+static Cells            g_sweep;                /* blocks being swept */
+static unsigned char    *g_member = NULL;       /* active set bits by block */
+static Vec3i            g_size;                 /* level size */
+static Updates          g_parts[MAX_PARTS];     /* updates by sweep part */
+static Updates          g_updates;              /* merged updates */
+
+static int fluid_kind(Type t)
+{
+    if (block_is_water(t)) return FLUID_WATER;
+    if (block_is_lava(t)) return FLUID_LAVA;
+    return -1;
+}
+
+static bool cells_push(Cells *cells, unsigned c)
+{
+    if (cells->size == cells->cap)
+    {
+        size_t cap = cells->cap ? 2*cells->cap : MIN_CAPACITY;
+        unsigned *data = realloc(cells->data, cap*sizeof(*data));
+        if (data == NULL) return false;
+        cells->data = data;
+        cells->cap  = cap;
+    }
+    cells->data[cells->size++] = c;
+    return true;
+}
+
+static int cmp_cells(const void *a, const void *b)
+{
+    unsigned c = *(const unsigned*)a, d = *(const unsigned*)b;
+    return (c > d) - (c < d);
+}
+
+/* Writes the active sets as flow events, which re-activate their blocks
+   when the event queue is read back. */
+static void save_active(event_sink_fn *sink, void *arg)
+{
+    usec_t now = usec_now();
+    size_t i;
+    int k;
+
+    for (k = 0; k < FLUID_KINDS; ++k)
+    {
+        for (i = 0; i < g_active[k].cells.size; ++i)
+        {
+            unsigned c = g_active[k].cells.data[i];
+            Event ev;
+            ev.time = now;
+            ev.data = event_data( EVENT_TYPE_FLOW, c%g_size.x,
+                                  c/g_size.x/g_size.z, c/g_size.x%g_size.z,
+                                  0, 0 );
+            (*sink)(arg, &ev);
+        }
+    }
+}
+
+static bool init(const Level *level)
+{
+    g_size   = level->size;
+    g_member = calloc((size_t)g_size.x*g_size.y*g_size.z, 1);
+    if (g_member == NULL)
+    {
+        error("could not allocate fluid active set");
+        return false;
+    }
+    event_queue_add_source(save_active);
+    return true;
+}
+
+static void schedule_sweep(int kind)
+{
+    Event ev;
+
+    ev.time = usec_now() + SWEEP_PERIOD[kind];
+    ev.data = event_data(EVENT_TYPE_SWEEP, kind, 0, 0, 0, 0);
+    g_active[kind].scheduled = event_push(&ev);
+}
+
+void fluid_activate(const Level *level, int x, int y, int z)
+{
+    int kind = fluid_kind(level_get_block(level, x, y, z));
+    unsigned c;
+
+    if (kind < 0) return;
+    if (g_member == NULL && !init(level)) return;
+
+    c = x + g_size.x*(z + g_size.z*y);
+    if (g_member[c] & (1 << kind)) return;
+    if (!cells_push(&g_active[kind].cells, c))
+    {
+        error("could not grow fluid active set");
+        return;
+    }
+    g_member[c] |= 1 << kind;
+    if (!g_active[kind].scheduled) schedule_sweep(kind);
+}
+
+static bool add_update( Updates *updates, int x, int y, int z,
+                        Type old_t, Type new_t )
+{
+    BlockUpdate *u;
+
+    if (updates->size == updates->cap)
+    {
+        size_t cap = updates->cap ? 2*updates->cap : MIN_CAPACITY;
+        BlockUpdate *data = realloc(updates->data, cap*sizeof(*data));
+        if (data == NULL)
+        {
+            error("could not grow fluid update buffer");
+            return false;
+        }
+        updates->data = data;
+        updates->cap  = cap;
+    }
+    u = &updates->data[updates->size++];
+    u->x     = x;
+    u->y     = y;
+    u->z     = z;
+    u->old_t = old_t;
+    u->new_t = new_t;
+    return true;
+}
+
+/* Adds the updates caused by fluid `t' at x/y/z flowing into its
+   neighbours. The level is not modified. */
+static void flow( const Level *level, Updates *updates,
+                  int x, int y, int z, Type t )
+{
+    int d;
+
+    for (d = 0; d < 6; ++d)
+    {
+        int nx = x + DX[d], ny = y + DY[d], nz = z + DZ[d];
+        Type u;
+
+        if (DY[d] > 0) continue;  /* don't flow upward */
+        if (!level_index_valid(level, nx, ny, nz)) continue;
+
+        u = level->blocks[nx + g_size.x*(nz + g_size.z*ny)];
+        if (u == BLOCK_EMPTY && !level_sponge_nearby(level, nx, ny, nz))
+        {
+            /* Propagate fluid */
+            add_update(updates, nx, ny, nz, u, t);
+        }
+        else
+        if ((block_is_water(t) && block_is_lava(u)) ||
+            (block_is_lava(t) && block_is_water(u)))
+        {
+            /* Water and lava make stone */
+            add_update(updates, nx, ny, nz, u, BLOCK_STONE_GREY);
+        }
+    }
+}
+
+typedef struct Sweep
+{
+    const Level *level;
+    int         kind;
+    int         parts;
+} Sweep;
+
+/* Computes the updates for one part of the blocks being swept. */
+static void sweep_part(void *arg, int part)
+{
+    const Sweep *sweep = arg;
+    const Level *level = sweep->level;
+    size_t begin = g_sweep.size*part/sweep->parts;
+    size_t end   = g_sweep.size*(part + 1)/sweep->parts;
+    size_t i;
+
+    g_parts[part].size = 0;
+    for (i = begin; i < end; ++i)
+    {
+        unsigned c = g_sweep.data[i];
+        Type t = level->blocks[c];
+        if (fluid_kind(t) == sweep->kind)
+        {
+            flow( level, &g_parts[part], c%g_size.x, c/g_size.x/g_size.z,
+                  c/g_size.x%g_size.z, t );
+        }
+    }
+}
+
+size_t fluid_sweep(const Level *level, int kind, BlockUpdate **updates)
+{
+    ActiveSet *set = &g_active[kind];
+    Sweep sweep;
+    Cells tmp;
+    size_t i, n;
+    int p;
+
+    set->scheduled = false;
+    *updates = NULL;
+    if (set->cells.size == 0) return 0;
+
+    /* Swap buffers, so blocks activated while the results of this sweep are
+       applied go into a fresh active set. */
+    tmp = g_sweep;
+    g_sweep = set->cells;
+    set->cells = tmp;
+    set->cells.size = 0;
+    for (i = 0; i < g_sweep.size; ++i)
+        g_member[g_sweep.data[i]] &= ~(1 << kind);
+
+    /* Visit blocks in memory order */
+    qsort(g_sweep.data, g_sweep.size, sizeof(*g_sweep.data), cmp_cells);
+
+    /* Defer blocks in sleeping regions to a later sweep, and park those in
+       frozen regions until they thaw */
+    for (i = n = 0; i < g_sweep.size; ++i)
+    {
+        unsigned c = g_sweep.data[i];
+        int x = c%g_size.x, z = c/g_size.x%g_size.z;
+
+        if (region_frozen(x, z))
+        {
+            Event ev;
+            ev.time = usec_now();
+            ev.data = event_data( EVENT_TYPE_FLOW,
+                                  x, c/g_size.x/g_size.z, z, 0, 0 );
+            if (region_park(&ev)) continue;
+        }
+        if (region_awake(x, z))
+        {
+            region_charge(x, z, 1);
+            g_sweep.data[n++] = c;
+        }
+        else
+        if (cells_push(&set->cells, c))
+        {
+            g_member[c] |= 1 << kind;
+        }
+    }
+    g_sweep.size = n;
+    if (set->cells.size > 0) schedule_sweep(kind);
+
+    sweep.level = level;
+    sweep.kind  = kind;
+    sweep.parts = 1;
+    if (g_sweep.size >= PARALLEL_MIN_CELLS)
+        sweep.parts = PARTS_PER_THREAD*workers_threads();
+    workers_run(sweep_part, &sweep, sweep.parts);
+    if (sweep.parts == 1)
+    {
+        *updates = g_parts[0].data;
+        return g_parts[0].size;
+    }
+
+    /* Merge updates in order of parts */
+    g_updates.size = 0;
+    for (p = 0; p < sweep.parts; ++p)
+    {
+        for (i = 0; i < g_parts[p].size; ++i)
+        {
+            const BlockUpdate *u = &g_parts[p].data[i];
+            add_update(&g_updates, u->x, u->y, u->z, u->old_t, u->new_t);
+        }
+    }
+    *updates = g_updates.data;
+    return g_updates.size;
+}
+
+size_t fluid_active_count(int kind)
+{
+    return g_active[kind].cells.size;
+}
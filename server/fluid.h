@@ -0,0 +1,36 @@
+#ifndef FLUID_H_INCLUDED
+#define FLUID_H_INCLUDED
+
+#include "server.h"
+#include "common/level.h"
+#include <stdlib.h>
+
+/* Fluid simulation.
+
+Fluid blocks that may be able to spread are kept in an active set per kind
+of fluid. Each kind is advanced in sweeps at its own rate, driven by a single
+EVENT_TYPE_SWEEP event per kind: a sweep computes the next state of all
+active blocks from the state of the level before the sweep, and returns the
+changes as one batch. Fluids flow down and sideways into empty blocks that
+are not near a sponge, and water and lava that meet turn into stone.
+
+When the event queue is saved, the active set is saved as flow events, which
+re-activate their blocks when they are read back and processed. */
+
+#define FLUID_WATER     0
+#define FLUID_LAVA      1
+#define FLUID_KINDS     2
+
+/* Adds the block at x/y/z to the active set of its fluid kind, and schedules
+   a sweep if none is pending. Does nothing if the block is not a fluid. */
+void fluid_activate(const Level *level, int x, int y, int z);
+
+/* Advances the active blocks of fluid kind `kind' and empties its active
+   set. Stores a pointer to the resulting updates in `*updates' (valid until
+   the next sweep) and returns their number. */
+size_t fluid_sweep(const Level *level, int kind, BlockUpdate **updates);
+
+/* Returns the number of active blocks of fluid kind `kind'. */
+size_t fluid_active_count(int kind);
+
+#endif /* ndef FLUID_H_INCLUDED */
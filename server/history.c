@@ -0,0 +1,667 @@
+#include "history.h"
+#include "common/logging.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define HISTORY_MAGIC       "MCHi"
+#define HISTORY_VERSION     1
+#define HEADER_SIZE         16
+#define SEGMENT_BITS        16
+#define SEGMENT_SIZE        (1 << SEGMENT_BITS)    /* edits per segment */
+#define MAX_PLAYERS         65535
+#define CHUNK_BITS          4       /* chunks are 16x16x16 blocks */
+#define CHUNK_MASK          ((1 << CHUNK_BITS) - 1)
+#define CHUNK_BLOCKS        (1 << 3*CHUNK_BITS)
+#define BUF_SIZE            65536
+
+/* Edits are stored column-wise in fixed-size segments, so appending never
+   moves existing edits. */
+typedef struct Segment
+{
+    unsigned int    time[SEGMENT_SIZE];
+    unsigned short  player[SEGMENT_SIZE];
+    unsigned short  x[SEGMENT_SIZE], y[SEGMENT_SIZE], z[SEGMENT_SIZE];
+    Type            old_t[SEGMENT_SIZE], new_t[SEGMENT_SIZE];
+} Segment;
+
+/* Indices of edits, in the order they were made */
+typedef struct IndexList
+{
+    unsigned int    *data;
+    size_t          size, capacity;
+} IndexList;
+
+/* Open-addressing hash table entry mapping a chunk to its edits */
+typedef struct ChunkEntry
+{
+    unsigned long long  key;    /* chunk key plus one; 0 if unused */
+    IndexList           edits;
+    unsigned            visited;    /* rollback that last scanned it */
+} ChunkEntry;
+
+static Segment      **g_segments;
+static size_t       g_num_segments;
+static size_t       g_size;             /* number of edits */
+static size_t       g_saved;            /* number of edits saved */
+static char         (*g_names)[STRING_LEN + 1];
+static IndexList    *g_player_edits;    /* edits per player */
+static size_t       g_num_names, g_names_capacity, g_names_saved;
+static ChunkEntry   *g_chunks;
+static size_t       g_chunks_used, g_chunks_capacity;
+static BlockUpdate  *g_rollback;
+static unsigned char *g_rollback_skip;  /* per edit of the player */
+static size_t       g_rollback_capacity;
+static unsigned     g_rollbacks;        /* number of rollbacks so far */
+
+#define EDIT(col, i) \
+    (g_segments[(i) >> SEGMENT_BITS]->col[(i) & (SEGMENT_SIZE - 1)])
+
+static bool index_add(IndexList *list, unsigned int i)
+{
+    if (list->size == list->capacity)
+    {
+        size_t new_capacity = list->capacity ? 2*list->capacity : 16;
+        unsigned int *data = realloc(list->data, new_capacity*sizeof(*data));
+
+        if (data == NULL) return false;
+        list->data     = data;
+        list->capacity = new_capacity;
+    }
+    list->data[list->size++] = i;
+    return true;
+}
+
+static unsigned long long chunk_key(int x, int y, int z)
+{
+    return ( (unsigned long long)(x >> CHUNK_BITS) << 32 |
+             (unsigned long long)(y >> CHUNK_BITS) << 16 |
+             (unsigned long long)(z >> CHUNK_BITS) ) + 1;
+}
+
+static size_t chunk_hash(unsigned long long key)
+{
+    return (size_t)((key*0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/* Returns the entry for the chunk with key `key', or an empty entry where it
+   can be inserted. `g_chunks_capacity' must be nonzero. */
+static ChunkEntry *chunk_find(unsigned long long key)
+{
+    size_t mask = g_chunks_capacity - 1, i;
+
+    for (i = chunk_hash(key) & mask; g_chunks[i].key != 0; i = (i + 1) & mask)
+    {
+        if (g_chunks[i].key == key) break;
+    }
+    return &g_chunks[i];
+}
+
+/* Returns the edits of the chunk with key `key', creating an entry if
+   necessary, or NULL if out of memory. */
+static IndexList *chunk_edits(unsigned long long key)
+{
+    ChunkEntry *entry;
+
+    if (2*(g_chunks_used + 1) > g_chunks_capacity)
+    {
+        ChunkEntry *old = g_chunks;
+        size_t old_capacity = g_chunks_capacity, i;
+
+        g_chunks_capacity = old_capacity ? 2*old_capacity : 1024;
+        g_chunks = calloc(g_chunks_capacity, sizeof(*g_chunks));
+        if (g_chunks == NULL)
+        {
+            g_chunks = old;
+            g_chunks_capacity = old_capacity;
+            return NULL;
+        }
+        for (i = 0; i < old_capacity; ++i)
+        {
+            if (old[i].key != 0) *chunk_find(old[i].key) = old[i];
+        }
+        free(old);
+    }
+
+    entry = chunk_find(key);
+    if (entry->key == 0)
+    {
+        entry->key = key;
+        ++g_chunks_used;
+    }
+    return &entry->edits;
+}
+
+/* Returns the id of the player named `name', or -1 if unknown. */
+static int find_player(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < g_num_names; ++i)
+    {
+        if (strcmp(g_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+/* Returns the id of the player named `name', adding it if necessary, or -1 if
+   there is no room. */
+static int player_id(const char *name)
+{
+    int id = find_player(name);
+
+    if (id >= 0) return id;
+    if (g_num_names == MAX_PLAYERS) return -1;
+    if (g_num_names == g_names_capacity)
+    {
+        size_t new_capacity = g_names_capacity ? 2*g_names_capacity : 64;
+        void *names, *edits;
+
+        names = realloc(g_names, new_capacity*sizeof(*g_names));
+        if (names == NULL) return -1;
+        g_names = names;
+        edits = realloc(g_player_edits, new_capacity*sizeof(*g_player_edits));
+        if (edits == NULL) return -1;
+        g_player_edits = edits;
+        g_names_capacity = new_capacity;
+    }
+    snprintf(g_names[g_num_names], sizeof(*g_names), "%s", name);
+    memset(&g_player_edits[g_num_names], 0, sizeof(*g_player_edits));
+    return g_num_names++;
+}
+
+/* Makes room for `n' more edits. */
+static bool reserve(size_t n)
+{
+    while (g_size + n > g_num_segments*SEGMENT_SIZE)
+    {
+        Segment **segments, *segment;
+
+        if (g_num_segments == (1u << (32 - SEGMENT_BITS))) return false;
+        segments = realloc( g_segments,
+                            (g_num_segments + 1)*sizeof(*g_segments) );
+        if (segments == NULL) return false;
+        g_segments = segments;
+        segment = malloc(sizeof(*segment));
+        if (segment == NULL) return false;
+        g_segments[g_num_segments++] = segment;
+    }
+    return true;
+}
+
+/* Adds edit `i' to the chunk and player indices, or to neither. */
+static bool index_edit(size_t i)
+{
+    IndexList *chunk = chunk_edits( chunk_key( EDIT(x, i), EDIT(y, i),
+                                               EDIT(z, i) ) );
+
+    if (chunk == NULL || !index_add(chunk, i)) return false;
+    if (!index_add(&g_player_edits[EDIT(player, i)], i))
+    {
+        --chunk->size;
+        return false;
+    }
+    return true;
+}
+
+void history_add( const char *player, int x, int y, int z,
+                  Type old_t, Type new_t )
+{
+    int id = player_id(player);
+    time_t now = time(NULL);
+
+    if (id < 0 || !reserve(1))
+    {
+        error("no room to record edit by %s", player);
+        return;
+    }
+
+    /* Keep times in order if the clock is set back (see first_since()) */
+    if (g_size > 0 && now < (time_t)EDIT(time, g_size - 1))
+        now = EDIT(time, g_size - 1);
+    EDIT(time,   g_size) = now;
+    EDIT(player, g_size) = id;
+    EDIT(x,      g_size) = x;
+    EDIT(y,      g_size) = y;
+    EDIT(z,      g_size) = z;
+    EDIT(old_t,  g_size) = old_t;
+    EDIT(new_t,  g_size) = new_t;
+    if (!index_edit(g_size))
+    {
+        error("no room to index edit by %s", player);
+        return;
+    }
+    ++g_size;
+}
+
+/* Returns the position in `list' of the first edit made at or after `since',
+   by binary search, as edits are appended in time order. */
+static size_t first_since(const IndexList *list, time_t since)
+{
+    size_t lo = 0, hi = list->size;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo)/2;
+
+        if ((time_t)EDIT(time, list->data[mid]) < since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t history_count_by(const char *player, time_t since)
+{
+    int id = find_player(player);
+    const IndexList *list;
+
+    if (id < 0) return 0;
+    list = &g_player_edits[id];
+    return list->size - first_since(list, since);
+}
+
+size_t history_of_block( int x, int y, int z,
+                         HistoryEdit *edits, size_t max )
+{
+    const ChunkEntry *entry;
+    size_t n = 0, i;
+
+    if (g_chunks_capacity == 0) return 0;
+    entry = chunk_find(chunk_key(x, y, z));
+    if (entry->key == 0) return 0;
+    for (i = entry->edits.size; i > 0 && n < max; --i)
+    {
+        unsigned int e = entry->edits.data[i - 1];
+
+        if (EDIT(x, e) != x || EDIT(y, e) != y || EDIT(z, e) != z) continue;
+        edits[n].time   = EDIT(time, e);
+        edits[n].player = g_names[EDIT(player, e)];
+        edits[n].x      = x;
+        edits[n].y      = y;
+        edits[n].z      = z;
+        edits[n].old_t  = EDIT(old_t, e);
+        edits[n].new_t  = EDIT(new_t, e);
+        ++n;
+    }
+    return n;
+}
+
+/* Returns the position of edit `e' in `list', by binary search. */
+static size_t find_edit(const IndexList *list, unsigned int e)
+{
+    size_t lo = 0, hi = list->size;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo)/2;
+
+        if (list->data[mid] < e)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Marks the edits in `list' from position `first' on that another player
+   has overwritten since, by scanning the edits of each chunk they are in
+   from newest to oldest once. */
+static void mark_overwritten( int id, const IndexList *list, size_t first,
+                              unsigned char *skip )
+{
+    unsigned char later[CHUNK_BLOCKS/8];    /* edited later by others */
+    unsigned int oldest = list->data[first];
+    size_t i, j;
+
+    ++g_rollbacks;
+    for (i = first; i < list->size; ++i)
+    {
+        unsigned int e = list->data[i];
+        ChunkEntry *entry = chunk_find( chunk_key( EDIT(x, e), EDIT(y, e),
+                                                   EDIT(z, e) ) );
+
+        if (entry->visited == g_rollbacks) continue;
+        entry->visited = g_rollbacks;
+        memset(later, 0, sizeof(later));
+        for (j = entry->edits.size; j > 0; --j)
+        {
+            unsigned int f = entry->edits.data[j - 1];
+            int b = (EDIT(x, f) & CHUNK_MASK) |
+                    (EDIT(y, f) & CHUNK_MASK) << CHUNK_BITS |
+                    (EDIT(z, f) & CHUNK_MASK) << 2*CHUNK_BITS;
+
+            if (f < oldest) break;
+            if (EDIT(player, f) != id)
+                later[b >> 3] |= 1 << (b & 7);
+            else
+            if (later[b >> 3] & (1 << (b & 7)))
+                skip[find_edit(list, f) - first] = 1;
+        }
+    }
+}
+
+size_t history_rollback(const char *player, time_t since,
+                        BlockUpdate **updates)
+{
+    int id = find_player(player);
+    const IndexList *list;
+    size_t first, n = 0, i;
+
+    *updates = NULL;
+    if (id < 0) return 0;
+    list  = &g_player_edits[id];
+    first = first_since(list, since);
+    if (first == list->size) return 0;
+    if (list->size - first > g_rollback_capacity)
+    {
+        size_t capacity = list->size - first;
+        BlockUpdate *p = realloc(g_rollback, capacity*sizeof(*p));
+        unsigned char *skip;
+
+        if (p == NULL)
+        {
+            error("could not allocate rollback updates");
+            return 0;
+        }
+        g_rollback = p;
+        skip = realloc(g_rollback_skip, capacity);
+        if (skip == NULL)
+        {
+            error("could not allocate rollback updates");
+            return 0;
+        }
+        g_rollback_skip = skip;
+        g_rollback_capacity = capacity;
+    }
+
+    /* Leave blocks that someone else has changed since alone, even if they
+       changed them back to the type the player left */
+    memset(g_rollback_skip, 0, list->size - first);
+    mark_overwritten(id, list, first, g_rollback_skip);
+
+    /* Undo the most recent edit first, so that each update expects the
+       type set by the edit before it. */
+    for (i = list->size; i > first; --i)
+    {
+        unsigned int e = list->data[i - 1];
+        BlockUpdate *u;
+
+        if (g_rollback_skip[i - 1 - first]) continue;
+        u = &g_rollback[n++];
+        u->x     = EDIT(x, e);
+        u->y     = EDIT(y, e);
+        u->z     = EDIT(z, e);
+        u->old_t = EDIT(new_t, e);
+        u->new_t = EDIT(old_t, e);
+    }
+    *updates = g_rollback;
+    return n;
+}
+
+bool history_is_dirty()
+{
+    return g_saved < g_size;
+}
+
+static void put_be(unsigned char *buf, unsigned long v, int bytes)
+{
+    while (bytes-- > 0)
+    {
+        buf[bytes] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static unsigned long get_be(const unsigned char *buf, int bytes)
+{
+    unsigned long v = 0;
+    int i;
+
+    for (i = 0; i < bytes; ++i) v = v << 8 | buf[i];
+    return v;
+}
+
+/* Column descriptors, in the order columns are stored */
+enum { COL_TIME, COL_PLAYER, COL_X, COL_Y, COL_Z, COL_OLD, COL_NEW, COLS };
+static const int g_col_bytes[COLS] = { 4, 2, 2, 2, 2, 1, 1 };
+
+static unsigned long get_col(int col, size_t i)
+{
+    switch (col)
+    {
+    case COL_TIME:      return EDIT(time, i);
+    case COL_PLAYER:    return EDIT(player, i);
+    case COL_X:         return EDIT(x, i);
+    case COL_Y:         return EDIT(y, i);
+    case COL_Z:         return EDIT(z, i);
+    case COL_OLD:       return EDIT(old_t, i);
+    case COL_NEW:       return EDIT(new_t, i);
+    }
+    assert(0);
+    return 0;
+}
+
+static void set_col(int col, size_t i, unsigned long v)
+{
+    switch (col)
+    {
+    case COL_TIME:      EDIT(time, i)   = v; break;
+    case COL_PLAYER:    EDIT(player, i) = v; break;
+    case COL_X:         EDIT(x, i)      = v; break;
+    case COL_Y:         EDIT(y, i)      = v; break;
+    case COL_Z:         EDIT(z, i)      = v; break;
+    case COL_OLD:       EDIT(old_t, i)  = v; break;
+    case COL_NEW:       EDIT(new_t, i)  = v; break;
+    default:            assert(0);
+    }
+}
+
+/* Writes the player names from `first_name' and the edits from `first_edit'
+   on to `fp' as one segment. Returns whether all data was written. */
+static bool write_segment(gzFile fp, size_t first_name, size_t first_edit)
+{
+    static unsigned char buf[BUF_SIZE];
+    size_t len, i;
+    int col;
+    bool ok = true;
+
+    memcpy(buf, HISTORY_MAGIC, 4);
+    put_be(buf +  4, HISTORY_VERSION, 4);
+    put_be(buf +  8, g_num_names - first_name, 4);
+    put_be(buf + 12, g_size - first_edit, 4);
+    len = HEADER_SIZE;
+    for (i = first_name; i < g_num_names; ++i)
+    {
+        if (len + STRING_LEN > sizeof(buf))
+        {
+            ok = ok && gzwrite(fp, buf, len) == len;
+            len = 0;
+        }
+        memset(buf + len, ' ', STRING_LEN);
+        memcpy(buf + len, g_names[i], strlen(g_names[i]));
+        len += STRING_LEN;
+    }
+    for (col = 0; col < COLS; ++col)
+    {
+        for (i = first_edit; i < g_size; ++i)
+        {
+            if (len + g_col_bytes[col] > sizeof(buf))
+            {
+                ok = ok && gzwrite(fp, buf, len) == len;
+                len = 0;
+            }
+            put_be(buf + len, get_col(col, i), g_col_bytes[col]);
+            len += g_col_bytes[col];
+        }
+    }
+    return ok && gzwrite(fp, buf, len) == len;
+}
+
+bool history_save(const char *path)
+{
+    struct stat st;
+    off_t old_size = 0;
+    gzFile fp;
+    bool ok;
+
+    if (g_saved == g_size) return true;
+
+    /* Append a gzip member; readers see the concatenated segments. If that
+       fails, cut the file back, so that the segments before are kept. */
+    if (stat(path, &st) == 0) old_size = st.st_size;
+    fp = gzopen(path, "ab");
+    if (fp == Z_NULL) goto failed;
+    ok = write_segment(fp, g_names_saved, g_saved);
+    if (gzclose(fp) != Z_OK || !ok)
+    {
+        if (truncate(path, old_size) != 0)
+            error("could not truncate %s: %s", path, strerror(errno));
+        goto failed;
+    }
+
+    g_names_saved = g_num_names;
+    g_saved = g_size;
+    return true;
+
+failed:
+    error("failed to write history to %s", path);
+    return false;
+}
+
+/* Replaces `path' with a single segment holding the whole history. */
+static bool rewrite(const char *path)
+{
+    char tmp_path[256];
+    gzFile fp;
+    bool ok;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = gzopen(tmp_path, "wb");
+    if (fp == Z_NULL) goto failed;
+    ok = write_segment(fp, 0, 0);
+    if (gzclose(fp) != Z_OK || !ok || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        goto failed;
+    }
+    g_names_saved = g_num_names;
+    g_saved = g_size;
+    return true;
+
+failed:
+    error("failed to rewrite history to %s", path);
+    return false;
+}
+
+/* Reads one segment from `fp'. Returns 1 if it was read, 0 at the end of the
+   file, -1 on error, or -2 if the segment is truncated or corrupt, in which
+   case the history is left as it was before the segment. */
+static int read_segment(gzFile fp, const char *path)
+{
+    static unsigned char buf[BUF_SIZE];
+    size_t num_names, num_edits, base = g_size, base_names = g_num_names, i;
+    int len, col;
+
+    len = gzread(fp, buf, HEADER_SIZE);
+    if (len == 0) return 0;
+    if (len != HEADER_SIZE) goto truncated;
+    if (memcmp(buf, HISTORY_MAGIC, 4) != 0)
+    {
+        if (base > 0) goto invalid;
+        error("%s is not a history file", path);
+        return -1;
+    }
+    if (get_be(buf + 4, 4) != HISTORY_VERSION)
+    {
+        error("%s has unsupported version %d", path, (int)get_be(buf + 4, 4));
+        return -1;
+    }
+    num_names = get_be(buf +  8, 4);
+    num_edits = get_be(buf + 12, 4);
+
+    for (i = 0; i < num_names; ++i)
+    {
+        char name[STRING_LEN + 1];
+        int n = STRING_LEN;
+
+        if (gzread(fp, name, STRING_LEN) != STRING_LEN) goto truncated;
+        while (n > 0 && name[n - 1] == ' ') --n;
+        name[n] = '\0';
+        if (player_id(name) != g_num_names - 1) goto invalid;
+    }
+
+    if (!reserve(num_edits))
+    {
+        error("no room to load history from %s", path);
+        return -1;
+    }
+    for (col = 0; col < COLS; ++col)
+    {
+        size_t size = g_col_bytes[col], per_read = sizeof(buf)/size, j;
+
+        for (i = 0; i < num_edits; i += per_read)
+        {
+            size_t n = num_edits - i < per_read ? num_edits - i : per_read;
+
+            if (gzread(fp, buf, n*size) != n*size) goto truncated;
+            for (j = 0; j < n; ++j)
+                set_col(col, base + i + j, get_be(buf + j*size, size));
+        }
+    }
+    for (i = base; i < base + num_edits; ++i)
+    {
+        if (EDIT(player, i) >= g_num_names) goto invalid;
+    }
+    for (i = base; i < base + num_edits; ++i)
+    {
+        if (!index_edit(i))
+        {
+            error("no room to index history from %s", path);
+            return -1;
+        }
+        ++g_size;
+    }
+    return 1;
+
+truncated:
+    warn("%s is truncated", path);
+    g_num_names = base_names;
+    return -2;
+
+invalid:
+    warn("%s contains invalid data", path);
+    g_num_names = base_names;
+    return -2;
+}
+
+bool history_load(const char *path)
+{
+    gzFile fp;
+    int res;
+
+    fp = gzopen(path, "rb");
+    if (fp == Z_NULL)
+    {
+        if (errno == 0) errno = ENOMEM;
+        return false;
+    }
+    while ((res = read_segment(fp, path)) > 0) { }
+    gzclose(fp);
+    g_names_saved = g_num_names;
+    g_saved = g_size;
+    if (res == -2)
+    {
+        /* Most likely a save was interrupted; keep what was complete */
+        warn( "discarding the damaged end of %s; %d edits kept",
+              path, (int)g_size );
+        res = rewrite(path) ? 0 : -1;
+    }
+    if (res < 0) errno = EINVAL;
+    return res == 0;
+}
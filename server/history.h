@@ -0,0 +1,72 @@
+#ifndef HISTORY_H_INCLUDED
+#define HISTORY_H_INCLUDED
+
+#include "server.h"
+#include "common/level.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* History of edits made by players, for finding and undoing griefing.
+
+Edits are appended to columns (time, player, coordinates, old and new type)
+and indexed by chunk and by player, so the history of a block and the
+recent edits of a player are found without scanning all edits.
+
+The history is saved to HISTORY_FILE by appending the edits made since the
+previous save as a separate gzip member, so saving takes time proportional
+to the number of new edits only. Each member holds a segment: the magic
+"MCHi", a 32-bit version, the number of new player names and edits,
+the new player names (STRING_LEN bytes each, space padded), and then each
+column in turn: time in seconds since the epoch (32 bits), player (16
+bits), x, y, z (16 bits each), old type and new type (8 bits each). All
+integers are big-endian.
+
+If appending fails, the file is cut back to its previous size. A segment
+left incomplete by a crash is discarded when the history is loaded, and the
+file is rewritten without it. */
+
+#define HISTORY_FILE    "history.bin.gz"
+
+typedef struct HistoryEdit
+{
+    time_t          time;
+    const char      *player;
+    unsigned short  x, y, z;
+    Type            old_t, new_t;
+} HistoryEdit;
+
+/* Loads the history from `path'. Returns false if it could not be read.
+   A damaged end of the file is discarded with a warning. */
+bool history_load(const char *path);
+
+/* Appends edits made since the last save to `path'. */
+bool history_save(const char *path);
+
+/* Returns whether there are edits that have not been saved. */
+bool history_is_dirty();
+
+/* Records that `player' changed the block at x/y/z from `old_t' to `new_t'.
+   Edits are recorded in order, so an edit is given the time of the previous
+   one if the clock has been set back since. */
+void history_add( const char *player, int x, int y, int z,
+                  Type old_t, Type new_t );
+
+/* Returns the number of edits made by `player' since `since'. */
+size_t history_count_by(const char *player, time_t since);
+
+/* Stores up to `max' of the most recent edits of the block at x/y/z in
+   `edits', most recent first, and returns their number. Player names point
+   into the history and remain valid. */
+size_t history_of_block( int x, int y, int z,
+                         HistoryEdit *edits, size_t max );
+
+/* Returns updates undoing the edits made by `player' since `since', most
+   recent first. Applied in order with server_update_blocks(), they restore
+   each block to its state before the player's first edit, except where
+   someone else has changed it since. The array returned is valid until the
+   next call. */
+size_t history_rollback(const char *player, time_t since,
+                        BlockUpdate **updates);
+
+#endif /* ndef HISTORY_H_INCLUDED */
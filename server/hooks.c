@@ -1,172 +1,43 @@
 #include "hooks.h"
+#include "bulk.h"
+#include "changes.h"
+#include "fluid.h"
+#include "history.h"
+#include "regions.h"
+#include "server.h"
+#include "sponge.h"
+#include "zones.h"
 #include "common/logging.h"
+#include "common/region.h"
 #include "common/timeval.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define GROW_DELAY_MIN_SEC       3
-#define GROW_DELAY_MAX_SEC      60
-
-const struct timeval
-    zero_delay        = { 0,      0 },
-    water_flow_delay  = { 0, 300000 }, /* 300ms */
-    lava_flow_delay   = { 3,      0 }, /* 3s */
-    supersponge_delay = { 0, 200000 }; /* 200ms */
-
-static int min(int i, int j) { return i < j ? i : j; }
-static int max(int i, int j) { return i > j ? i : j; }
-static bool is_fluid(Type t) { return t >= BLOCK_WATER1 && t <= BLOCK_LAVA2; }
-static bool is_water(Type t) { return t >= BLOCK_WATER1 && t <= BLOCK_WATER2; }
-static bool is_lava(Type t) { return t >= BLOCK_LAVA1 && t <= BLOCK_LAVA2; }
-
-static bool is_plant(Type t)
-{
-    switch (t)
-    {
-    case BLOCK_SAPLING:
-    case BLOCK_FLOWER_YELLOW:
-    case BLOCK_FLOWER_RED:
-    case BLOCK_MUSHROOM:
-    case BLOCK_TOADSTOOL:
-        return true;
-
-    default:
-        return false;
-    }
-}
-
-static bool is_light_blocker(Type t)
-{
-    return t != BLOCK_EMPTY  && t != BLOCK_GLASS &&
-           t != BLOCK_LEAVES && !is_plant(t);
-}
-
-static bool is_soil(Type t)
-{
-    return t == BLOCK_DIRT || t == BLOCK_GRASS;
-}
-
-static bool is_supporter(Type t)
-{
-    return t != BLOCK_EMPTY && !is_plant(t) && !is_fluid(t);
-}
+/* Number of random blocks updated per chunk per tick. At 4 ticks per
+   second, each block is updated about once every 32 seconds. */
+#define RANDOM_TICKS_PER_CHUNK  32
 
 static bool is_player_placeable(Type t, bool admin)
 {
-    switch (t)
-    {
-    case BLOCK_STONE_GREY:
-    case BLOCK_DIRT:
-    case BLOCK_ROCK:
-    case BLOCK_WOOD:
-    case BLOCK_SAPLING:
-    case BLOCK_STONE_YELLOW:
-    case BLOCK_STONE_MIXED:
-    case BLOCK_TRUNK:
-    case BLOCK_LEAVES:
-    case BLOCK_SPONGE:
-    case BLOCK_GLASS:
-    case BLOCK_COLORED1:
-    case BLOCK_COLORED2:
-    case BLOCK_COLORED3:
-    case BLOCK_COLORED4:
-    case BLOCK_COLORED5:
-    case BLOCK_COLORED6:
-    case BLOCK_COLORED7:
-    case BLOCK_COLORED8:
-    case BLOCK_COLORED9:
-    case BLOCK_COLORED10:
-    case BLOCK_COLORED11:
-    case BLOCK_COLORED12:
-    case BLOCK_COLORED13:
-    case BLOCK_COLORED14:
-    case BLOCK_COLORED15:
-    case BLOCK_COLORED16:
-    case BLOCK_FLOWER_YELLOW:
-    case BLOCK_FLOWER_RED:
-    case BLOCK_MUSHROOM:
-    case BLOCK_TOADSTOOL:
-    case BLOCK_GOLD:
-        return true;
-
-    case BLOCK_SUPERSPONGE:
-    case BLOCK_LAVA2:
-    case BLOCK_WATER2:
-    case BLOCK_ADMINIUM:
-        return admin;
-
-    default:
-        return false;
-    }
+    return block_has(t, admin ? BLOCK_FLAG_PLACE | BLOCK_FLAG_PLACE_ADMIN
+                              : BLOCK_FLAG_PLACE);
 }
 
 static bool is_player_deletable(Type t, bool admin)
 {
-    switch (t)
-    {
-    case BLOCK_GRASS:
-    case BLOCK_ORE1:
-    case BLOCK_ORE2:
-    case BLOCK_ORE3:
-        return true;
-
-    default:
-        return is_player_placeable(t, admin);
-    }
-}
-
-static bool is_player_replacable(Type t, bool admin)
-{
-    (void)admin; /* unused */
-
-    switch (t)
-    {
-    case BLOCK_WATER1:
-    case BLOCK_WATER2:
-    case BLOCK_LAVA1:
-    case BLOCK_LAVA2:
-        return true;
-
-    default:
-        return false;
-    }
-}
-
-/* Returns whether the cube with sides of length 2*`d' - 1 centered around
-   (x,y,z) contains a block of type `t'. */
-static bool type_nearby(const Level *level, int x, int y, int z, Type t, int d)
-{
-    int x1 = max(x - d + 1, 0), x2 = min(x + d, level->size.x);
-    int y1 = max(y - d + 1, 0), y2 = min(y + d, level->size.y);
-    int z1 = max(z - d + 1, 0), z2 = min(z + d, level->size.z);
-
-    for (x = x1; x < x2; ++x)
-    {
-        for (y = y1; y < y2; ++y)
-        {
-            for (z = z1; z < z2; ++z)
-            {
-                if (level_get_block(level, x, y, z) == t) return true;
-            }
-        }
-    }
-
-    return false;
+    return block_has(t, BLOCK_FLAG_DELETE) || is_player_placeable(t, admin);
 }
 
-static void update_block_delayed( int x, int y, int z, Type new_t,
-                                  const struct timeval *delay )
+static bool is_player_replacable(Type t)
 {
-    void server_update_block( int x, int y, int z, Type new_t,
-                              const struct timeval *delay );
-
-    server_update_block(x, y, z, new_t, delay);
+    return block_has(t, BLOCK_FLAG_REPLACE);
 }
 
-
 static void update_block(int x, int y, int z, Type new_t)
 {
-    update_block_delayed(x, y, z, new_t, &zero_delay);
+    server_update_block(x, y, z, new_t, 0);
 }
 
 int hook_authorize_update( const Level *level, const Player *player,
@@ -177,24 +48,16 @@ int hook_authorize_update( const Level *level, const Player *player,
     /* Reject update if it doesn't change anything: */
     if (old_t == new_t) return -1;
 
+    /* Reject update in a zone protected from this player: */
+    if (!player->admin && !zone_allows(x, y, z, player->name)) return -1;
+
     /* Handle tileset mapping: */
-    switch (player->tileset)
-    {
-    case 1:
-        switch (new_t)
-        {
-        case BLOCK_COLORED1:  new_t = BLOCK_LAVA2;       break; /* red */
-        case BLOCK_COLORED3:  new_t = BLOCK_SUPERSPONGE; break; /* yellow */
-        case BLOCK_COLORED8:  new_t = BLOCK_WATER2;      break; /* blue */
-        case BLOCK_COLORED14: new_t = BLOCK_ADMINIUM;    break; /* grey */
-        }
-        break;
-    }
+    new_t = block_from_tileset(player->tileset, new_t);
 
     if (old_t != BLOCK_EMPTY && new_t != BLOCK_EMPTY)
     {
         /* replacing a block: */
-        if (!is_player_replacable(old_t, player->admin) ||
+        if (!is_player_replacable(old_t) ||
             !is_player_placeable(new_t, player->admin)) return -1;
     }
     else
@@ -211,111 +74,126 @@ int hook_authorize_update( const Level *level, const Player *player,
     }
 
     /* Plants must be placed on soil: */
-    if (is_plant(new_t) && !is_soil(level_get_block(level, x, y - 1, z)))
+    if ( block_is_plant(new_t) &&
+         !block_is_soil(level_get_block(level, x, y - 1, z)) )
         return -1;
 
-    info("User placing block of type %d at (%d,%d,%d)\n", (int)new_t, x, y, z);
-
     return new_t;
 }
 
 Type hook_client_block_type(Type t)
 {
-    return t&0x3f;
-}
-
-static void post_flow_event(int x, int y, int z, const struct timeval *delay)
-{
-    Event new_ev;
-    tv_now(&new_ev.base.time);
-    tv_add_tv(&new_ev.base.time, delay);
-    new_ev.base.type = EVENT_TYPE_FLOW;
-    new_ev.flow_event.x = x;
-    new_ev.flow_event.y = y;
-    new_ev.flow_event.z = z;
-    event_push(&new_ev);
+    return block_client_type(t);
 }
 
-static void post_grow_event(int x, int y, int z)
-{
-    Event new_ev;
-    tv_now(&new_ev.base.time);
-    tv_add_s( &new_ev.base.time, GROW_DELAY_MIN_SEC +
-              rand()%(GROW_DELAY_MAX_SEC - GROW_DELAY_MIN_SEC + 1) );
-    new_ev.base.type = EVENT_TYPE_GROW;
-    new_ev.grow_event.x = x;
-    new_ev.grow_event.y = y;
-    new_ev.grow_event.z = z;
-    event_push(&new_ev);
-}
+static void activate_block(const Level *level, int x, int y, int z);
 
-static void activate_block(const Level *level, int x, int y, int z)
+/* Drops the stack of falling blocks starting at x/y/z onto the highest
+   supporting block below it, removing everything in the way. The column
+   is updated in one batch, without update events, and the blocks around the
+   affected part of the column are activated afterwards. */
+static void collapse_column(const Level *level, int x, int y, int z)
 {
-    Type t = level_get_block(level, x, y, z); 
-    switch (t)
-    {
-    case BLOCK_WATER1:
-    case BLOCK_WATER2:
-        post_flow_event(x, y, z, &water_flow_delay);
-        break;
-
-    case BLOCK_LAVA1:
-    case BLOCK_LAVA2:
-        post_flow_event(x, y, z, &lava_flow_delay);
-        break;
+    BlockUpdate *updates;
+    int top = y, bottom, drop, n = 0, i, d;
 
-    case BLOCK_DIRT:
-        post_grow_event(x, y, z);
-        break;
+    while ( top + 1 < level->size.y &&
+            block_is_falling(level_get_block(level, x, top + 1, z)) ) ++top;
+    bottom = level_support_below(level, x, y, z) + 1;
+    drop   = y - bottom;
 
-    case BLOCK_GRASS:
-        if (is_light_blocker(level_get_block(level, x, y + 1, z)))
-            update_block(x, y, z, BLOCK_DIRT);
-        break;
+    updates = malloc((top - bottom + 1)*sizeof(*updates));
+    if (updates == NULL)
+    {
+        error("could not allocate column updates");
+        return;
+    }
+    for (i = bottom; i <= top; ++i)
+    {
+        Type old_t = level_get_block(level, x, i, z);
+        Type new_t = (i + drop <= top) ? level_get_block(level, x, i + drop, z)
+                                       : BLOCK_EMPTY;
+        if (old_t != new_t)
+        {
+            updates[n].x     = x;
+            updates[n].y     = i;
+            updates[n].z     = z;
+            updates[n].old_t = old_t;
+            updates[n].new_t = new_t;
+            ++n;
+        }
+    }
+    server_update_blocks(updates, n);
+    free(updates);
 
-    case BLOCK_STONE_YELLOW:
-    case BLOCK_STONE_MIXED:
+    for (i = bottom - 1; i <= top + 1; ++i)
+    {
+        for (d = 0; d < 6; ++d)
         {
-            /* see if this block can fall down: */
-            int ny = y;
-            while (ny > 0 &&
-                   !is_supporter(level_get_block(level, x, ny - 1, z))) --ny;
-            if (y > ny)
-            {
-                /* fall down, removing everything in the way: */
-                while (y > ny)
-                    update_block(x, y--, z, BLOCK_EMPTY);
-                update_block(x, y, z, t);
-            }
+            if (DY[d] == 0) activate_block(level, x + DX[d], i, z + DZ[d]);
         }
-        break;
+    }
+    activate_block(level, x, top + 1, z);
+}
+
+static void activate_block(const Level *level, int x, int y, int z)
+{
+    Type t = level_get_block(level, x, y, z);
 
-    default:
-        if (is_plant(t) && !is_soil(level_get_block(level, x, y - 1, z)))
+    if (block_is_fluid(t))
+    {
+        fluid_activate(level, x, y, z);
+    }
+    else
+    if (t == BLOCK_GRASS)
+    {
+        if (!level_is_lit(level, x, y, z))
+            update_block(x, y, z, BLOCK_DIRT);
+    }
+    else
+    if (block_is_falling(t))
+    {
+        if (y > 0 && !block_is_supporter(level_get_block(level, x, y - 1, z)))
+            collapse_column(level, x, y, z);
+    }
+    else
+    if (block_is_plant(t))
+    {
+        if (!block_is_soil(level_get_block(level, x, y - 1, z)))
             update_block(x, y, z, BLOCK_EMPTY);
-        break;
     }
 }
 
+/* Returns the set of types on which activate_block() may act */
+static TypeSet activatable_types()
+{
+    TypeSet types = blocks_with( BLOCK_FLAG_FLUID | BLOCK_FLAG_FALLING |
+                                 BLOCK_FLAG_PLANT );
+
+    type_set_add(&types, BLOCK_GRASS);
+    return types;
+}
+
+static void activate_cb(void *arg, int x, int y, int z, Type t)
+{
+    (void)t;  /* unused */
+    activate_block((const Level*)arg, x, y, z);
+}
+
 /* Activates blocks in the 2d+1 sized cube centered at x/y/z */
 static void activate_blocks_nearby(const Level *level,
                                    int x, int y, int z, int d)
 {
-    int x1 = max(x - d, 0), x2 = min(x + d + 1, level->size.x);
-    int y1 = max(y - d, 0), y2 = min(y + d + 1, level->size.y);
-    int z1 = max(z - d, 0), z2 = min(z + d + 1, level->size.z);
+    static TypeSet types;
+    static bool types_valid = false;
+    Box box = box_around(level, x, y, z, d);
 
-    /* activate nearby blocks */
-    for (x = x1; x < x2; ++x)
+    if (!types_valid)
     {
-        for (y = y1; y < y2; ++y)
-        {
-            for (z = z1; z < z2; ++z)
-            {
-                activate_block(level, x, y, z);
-            }
-        }
+        types = activatable_types();
+        types_valid = true;
     }
+    region_for_each(level, &box, &types, activate_cb, (void*)level);
 }
 
 static void activate_neighbours(const Level *level, int x, int y, int z)
@@ -328,139 +206,287 @@ static void activate_neighbours(const Level *level, int x, int y, int z)
     }
 }
 
-static void on_update(const Level *level, UpdateEvent *ev)
+static void clear_cb(void *arg, int x, int y, int z, Type t)
+{
+    (void)arg;  /* unused */
+    (void)t;    /* unused */
+    update_block(x, y, z, BLOCK_EMPTY);
+}
+
+static void on_update(const Level *level, const Event *ev)
 {
-    if (level_get_block(level, ev->x, ev->y, ev->z) != ev->new_t) return;
+    int x = event_x(ev), y = event_y(ev), z = event_z(ev);
+    Type new_t = event_new_t(ev);
 
-    switch (ev->new_t)
+    if (level_get_block(level, x, y, z) != new_t) return;
+
+    switch (new_t)
     {
     case BLOCK_SPONGE:
         {
-            int x1 = max(ev->x - 3 + 1, 0), x2 = min(ev->x + 3, level->size.x);
-            int y1 = max(ev->y - 3 + 1, 0), y2 = min(ev->y + 3, level->size.y);
-            int z1 = max(ev->z - 3 + 1, 0), z2 = min(ev->z + 3, level->size.z);
-            int x, y, z;
-
-            for (x = x1; x < x2; ++x)
-            {
-                for (y = y1; y < y2; ++y)
-                {
-                    for (z = z1; z < z2; ++z)
-                    {
-                        if (is_fluid(level_get_block(level, x, y, z)))
-                            update_block(x, y, z, BLOCK_EMPTY);
-                    }
-                }
-            }
+            Box box = box_around(level, x, y, z, SPONGE_RANGE);
+            TypeSet fluids = blocks_with(BLOCK_FLAG_FLUID);
+            region_for_each(level, &box, &fluids, clear_cb, NULL);
         }
         break;
 
     case BLOCK_SUPERSPONGE:
-        {
-            /* Flood-filling super sponge */
-            int d;
-            for (d = 0; d < 6; ++d)
-            {
-                int nx = ev->x + DX[d];
-                int ny = ev->y + DY[d];
-                int nz = ev->z + DZ[d];
-                Type t = level_get_block(level, nx, ny,nz);
-                if (is_fluid(t))
-                {
-                    update_block_delayed(nx, ny, nz, BLOCK_SUPERSPONGE,
-                                         &supersponge_delay);
-                }
-            }
-            update_block(ev->x, ev->y, ev->z, BLOCK_EMPTY);
-        }
+        supersponge_add(level, x, y, z);
         break;
     }
 
-    if (ev->old_t == BLOCK_SPONGE)
+    if (event_old_t(ev) == BLOCK_SPONGE)
     {
-        activate_blocks_nearby(level, ev->x, ev->y, ev->z, 3);
+        activate_blocks_nearby(level, x, y, z, 3);
     }
     else
     {
-        activate_block(level, ev->x, ev->y, ev->z);
-        activate_neighbours(level, ev->x, ev->y, ev->z);
+        activate_block(level, x, y, z);
+        activate_neighbours(level, x, y, z);
     }
 }
 
-static void on_flow(const Level *level, FlowEvent *ev)
+/* Applies the changes of a fluid sweep, and activates the blocks changed
+   and their neighbours as on_update() would for each change. */
+static void on_sweep(const Level *level, const Event *ev)
 {
-    int d;
-    Type t = level_get_block(level, ev->x, ev->y, ev->z);
-
-    if (!is_fluid(t)) return;
+    BlockUpdate *updates;
+    size_t n, i;
 
-    for (d = 0; d < 6; ++d)
+    n = fluid_sweep(level, event_x(ev), &updates);
+    n = server_update_blocks(updates, n);
+    for (i = 0; i < n; ++i)
     {
-        int nx, ny, nz;
+        activate_block(level, updates[i].x, updates[i].y, updates[i].z);
+        activate_neighbours(level, updates[i].x, updates[i].y, updates[i].z);
+    }
+}
 
-        if (DY[d] > 0) continue;  /* don't flow upward */
+/* Applies a super sponge step, adding new super sponge blocks to the
+   frontier and activating blocks around the ones emptied. */
+static void on_drain(const Level *level)
+{
+    BlockUpdate *updates;
+    size_t n, i;
 
-        nx = ev->x + DX[d];
-        ny = ev->y + DY[d];
-        nz = ev->z + DZ[d];
-        if (level_index_valid(level, nx, ny, nz))
+    n = supersponge_step(level, &updates);
+    n = server_update_blocks(updates, n);
+    for (i = 0; i < n; ++i)
+    {
+        const BlockUpdate *u = &updates[i];
+        if (u->new_t == BLOCK_SUPERSPONGE)
         {
-            Type u = level_get_block(level, nx, ny, nz);
-            if ( u == BLOCK_EMPTY &&
-                 !type_nearby(level, nx, ny, nz, BLOCK_SPONGE, 3))
-            {
-                /* Propagate fluid */
-                update_block(nx, ny, nz, t);
-            }
-            else
-            if ((is_water(t) && is_lava(u)) || (is_lava(t) && is_water(u)))
-            {
-                /* Water and lava make stone */
-                update_block(nx, ny, nz, BLOCK_STONE_GREY);
-            }
+            supersponge_add(level, u->x, u->y, u->z);
+        }
+        else
+        {
+            activate_block(level, u->x, u->y, u->z);
+            activate_neighbours(level, u->x, u->y, u->z);
         }
     }
 }
 
-static void on_grow(const Level *level, GrowEvent *ev)
+/* Parks an event if its region is frozen, or reschedules it for when its
+   region wakes up if it is asleep. Returns whether the event was deferred;
+   if it can't be parked or queued, it is run now instead. */
+static bool defer_if_asleep(const Event *ev)
 {
-    if (level_get_block(level, ev->x, ev->y, ev->z) == BLOCK_DIRT &&
-        !is_light_blocker(level_get_block(level, ev->x, ev->y + 1, ev->z)))
+    int x = event_x(ev), z = event_z(ev);
+    Event deferred;
+
+    if (region_frozen(x, z))
+    {
+        if (region_park(ev)) return true;
+    }
+    else
+    if (!region_awake(x, z))
     {
-        update_block(ev->x, ev->y, ev->z, BLOCK_GRASS);
+        deferred = *ev;
+        deferred.time = region_wake_time(x, z);
+        if (event_push(&deferred)) return true;
     }
+    region_charge(x, z, 1);
+    return false;
 }
 
 void hook_on_event(const Level *level, Event *ev)
 {
-    switch (ev->base.type)
+    /* Events restored from a frozen region go back there, to be released
+       at the usual rate when it thaws */
+    if (ev->data & EVENT_PARKED)
+    {
+        ev->data &= ~EVENT_PARKED;
+        if (region_park(ev)) return;
+    }
+
+    switch (event_type(ev))
     {
     case EVENT_TYPE_UPDATE:
-        on_update(level, &ev->update_event);
+        if (!defer_if_asleep(ev)) on_update(level, ev);
         break;
 
     case EVENT_TYPE_FLOW:
-        on_flow(level, &ev->flow_event);
+        fluid_activate(level, event_x(ev), event_y(ev), event_z(ev));
+        break;
+
+    case EVENT_TYPE_SWEEP:
+        on_sweep(level, ev);
         break;
 
-    case EVENT_TYPE_GROW:
-        on_grow(level, &ev->grow_event);
+    case EVENT_TYPE_DRAIN:
+        on_drain(level);
         break;
 
     default: break;
     }
 }
 
+/* Returns a pseudo-random 32-bit number (xorshift64*) */
+static unsigned random_next()
+{
+    static unsigned long long state = 0x2545F4914F6CDD1Dull;
+
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (unsigned)((state*0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static void on_random_tick(const Level *level, int x, int y, int z)
+{
+    Type t = level_get_block(level, x, y, z);
+
+    if (t == BLOCK_DIRT && level_is_lit(level, x, y, z))
+        update_block(x, y, z, BLOCK_GRASS);
+    else
+    if (t == BLOCK_GRASS && !level_is_lit(level, x, y, z))
+        update_block(x, y, z, BLOCK_DIRT);
+}
+
+void hook_on_tick(const Level *level)
+{
+    int cx, cy, cz, n;
+
+    for (cz = 0; cz < level->size.z; cz += CHUNK_SIZE)
+    {
+        for (cx = 0; cx < level->size.x; cx += CHUNK_SIZE)
+        {
+            /* Frozen and sleeping regions don't change by themselves */
+            if (region_frozen(cx, cz) || !region_awake(cx, cz)) continue;
+
+            for (cy = 0; cy < level->size.y; cy += CHUNK_SIZE)
+            {
+                if (!region_charge(cx, cz, RANDOM_TICKS_PER_CHUNK)) break;
+                for (n = 0; n < RANDOM_TICKS_PER_CHUNK; ++n)
+                {
+                    unsigned r = random_next();
+                    int x = cx + (r >> 0)%CHUNK_SIZE;
+                    int y = cy + (r >> CHUNK_BITS)%CHUNK_SIZE;
+                    int z = cz + (r >> 2*CHUNK_BITS)%CHUNK_SIZE;
+                    if (level_index_valid(level, x, y, z))
+                        on_random_tick(level, x, y, z);
+                }
+            }
+        }
+    }
+}
+
 /* TODO:
     grow tree trunk/leaves, but only if trunk is planted on dirt :=)
 
     lava/water combine to form rock
 */
 
-int hook_on_chat(Player *pl, const char *in, char *out, size_t out_size)
+/* Formats a duration of `secs' seconds briefly, e.g. "5m". */
+static const char *format_age(char *buf, size_t size, long secs)
+{
+    if (secs < 120)
+        snprintf(buf, size, "%lds", secs);
+    else
+    if (secs < 2*3600)
+        snprintf(buf, size, "%ldm", secs/60);
+    else
+    if (secs < 2*86400)
+        snprintf(buf, size, "%ldh", secs/3600);
+    else
+        snprintf(buf, size, "%ldd", secs/86400);
+    return buf;
+}
+
+/* Undoes the edits made by `name' in the last `minutes' minutes in one batch,
+   and activates the blocks restored and their neighbours. Returns the number
+   of edits undone, and stores the number found in `*found'. */
+static size_t rollback( const Level *level, const char *name, int minutes,
+                        size_t *found )
+{
+    BlockUpdate *updates;
+    size_t n, i;
+
+    *found = history_rollback(name, time(NULL) - 60L*minutes, &updates);
+    changes_set_cause(CHANGE_ROLLBACK, -1);
+    n = server_update_blocks(updates, *found);
+    changes_set_cause(CHANGE_SIMULATION, -1);
+    for (i = 0; i < n; ++i)
+    {
+        activate_block(level, updates[i].x, updates[i].y, updates[i].z);
+        activate_neighbours(level, updates[i].x, updates[i].y, updates[i].z);
+    }
+    info("rolled back %d of %d edits by %s", (int)n, (int)*found, name);
+    return n;
+}
+
+/* Returns the type named or numbered `s', or -1 if there is none. */
+static int parse_type(const char *s)
+{
+    char *end;
+    long t = strtol(s, &end, 10);
+
+    if (end == s || *end != '\0') return block_by_name(s);
+    return (t >= 0 && t < 256 && g_blocks[t].name) ? t : -1;
+}
+
+/* Applies bulk updates, and activates the blocks on the boundaries of the
+   areas changed: each changed block with a neighbour of a different type,
+   and that neighbour. Blocks inside uniform areas are left alone, so that
+   filling a box only activates its surface. Returns the number of updates
+   applied. */
+static size_t apply_bulk(const Level *level, BlockUpdate *updates, size_t n)
+{
+    size_t i;
+    int d;
+
+    changes_set_cause(CHANGE_BULK, -1);
+    n = server_update_blocks_bulk(updates, n);
+    changes_set_cause(CHANGE_SIMULATION, -1);
+    for (i = 0; i < n; ++i)
+    {
+        const BlockUpdate *u = &updates[i];
+        bool boundary = false;
+
+        for (d = 0; d < 6; ++d)
+        {
+            int x = u->x + DX[d], y = u->y + DY[d], z = u->z + DZ[d];
+
+            if ( level_index_valid(level, x, y, z) &&
+                 level_get_block(level, x, y, z) != u->new_t )
+            {
+                activate_block(level, x, y, z);
+                boundary = true;
+            }
+        }
+        if (boundary) activate_block(level, u->x, u->y, u->z);
+    }
+    return n;
+}
+
+int hook_on_chat( const Level *level, Player *pl,
+                  const char *in, char *out, size_t out_size )
 {
-    char arg_s[33];
-    int arg_i;
+    char arg_s[STRING_LEN + 1], arg_owner[STRING_LEN + 1];
+    char arg_t1[32], arg_t2[32];
+    BlockUpdate *updates;
+    size_t n;
+    int arg_i, arg_x, arg_y, arg_z, arg_x2, arg_y2, arg_z2;
 
     if (sscanf(in, "/auth %32s", arg_s) == 1)
     {
@@ -471,7 +497,7 @@ int hook_on_chat(Player *pl, const char *in, char *out, size_t out_size)
 
     if (sscanf(in, "/set tileset %d", &arg_i) == 1)
     {
-        if (arg_i >= 0 && arg_i < 2) pl->tileset = arg_i;
+        if (arg_i >= 0 && arg_i < g_num_tilesets) pl->tileset = arg_i;
         return 0;
     }
 
@@ -481,6 +507,144 @@ int hook_on_chat(Player *pl, const char *in, char *out, size_t out_size)
         return 1;
     }
 
+    if (sscanf(in, "/set simdistance %d", &arg_i) == 1 && pl->admin)
+    {
+        regions_set_distance(arg_i);
+        if (regions_save(REGIONS_FILE)) return 0;
+        snprintf(out, out_size, "couldn't save simulation distance");
+        return 1;
+    }
+
+    if (strcmp(in, "/set simdistance") == 0)
+    {
+        snprintf( out, out_size, "simulation distance: %d%s",
+                  regions_distance(), regions_distance() ? "" : " (off)" );
+        return 1;
+    }
+
+    if (strcmp(in, "/regions") == 0 && pl->admin)
+    {
+        regions_stats(out, out_size);
+        return 1;
+    }
+
+    if ( (arg_i = sscanf( in, "/zone add %32s %d %d %d %d %d %d %64s",
+                          arg_s, &arg_x, &arg_y, &arg_z,
+                          &arg_x2, &arg_y2, &arg_z2, arg_owner )) >= 7 &&
+         pl->admin )
+    {
+        if (zone_add( arg_s, arg_x, arg_y, arg_z, arg_x2, arg_y2, arg_z2,
+                      arg_i == 8 ? arg_owner : NULL ))
+            snprintf(out, out_size, "zone %s added", arg_s);
+        else
+            snprintf(out, out_size, "couldn't add zone %s", arg_s);
+        return 1;
+    }
+
+    if (sscanf(in, "/zone remove %32s", arg_s) == 1 && pl->admin)
+    {
+        snprintf( out, out_size, zone_remove(arg_s) ? "zone %s removed" :
+                                                      "no zone %s", arg_s );
+        return 1;
+    }
+
+    if (sscanf(in, "/zone at %d %d %d", &arg_x, &arg_y, &arg_z) == 3)
+    {
+        const char *name = zone_at(arg_x, arg_y, arg_z);
+
+        snprintf( out, out_size, "%d,%d,%d: %s%s", arg_x, arg_y, arg_z,
+                  name ? "zone " : "not protected", name ? name : "" );
+        return 1;
+    }
+
+    if ( sscanf( in, "/fill %d %d %d %d %d %d %31s", &arg_x, &arg_y, &arg_z,
+                 &arg_x2, &arg_y2, &arg_z2, arg_t1 ) == 7 && pl->admin )
+    {
+        if ((arg_i = parse_type(arg_t1)) < 0)
+        {
+            snprintf(out, out_size, "unknown block type %s", arg_t1);
+            return 1;
+        }
+        n = bulk_fill( level, arg_x, arg_y, arg_z, arg_x2, arg_y2, arg_z2,
+                       -1, arg_i, &updates );
+        snprintf( out, out_size, "filled %d blocks",
+                  (int)apply_bulk(level, updates, n) );
+        return 1;
+    }
+
+    if ( sscanf( in, "/replace %d %d %d %d %d %d %31s %31s",
+                 &arg_x, &arg_y, &arg_z, &arg_x2, &arg_y2, &arg_z2,
+                 arg_t1, arg_t2 ) == 8 && pl->admin )
+    {
+        int from = parse_type(arg_t1), to = parse_type(arg_t2);
+
+        if (from < 0 || to < 0)
+        {
+            snprintf( out, out_size, "unknown block type %s",
+                      from < 0 ? arg_t1 : arg_t2 );
+            return 1;
+        }
+        n = bulk_fill( level, arg_x, arg_y, arg_z, arg_x2, arg_y2, arg_z2,
+                       from, to, &updates );
+        snprintf( out, out_size, "replaced %d blocks",
+                  (int)apply_bulk(level, updates, n) );
+        return 1;
+    }
+
+    if ( sscanf( in, "/copy %d %d %d %d %d %d", &arg_x, &arg_y, &arg_z,
+                 &arg_x2, &arg_y2, &arg_z2 ) == 6 && pl->admin )
+    {
+        snprintf( out, out_size, "copied %d blocks",
+                  (int)bulk_copy( level, arg_x, arg_y, arg_z,
+                                  arg_x2, arg_y2, arg_z2 ) );
+        return 1;
+    }
+
+    if ( sscanf(in, "/paste %d %d %d", &arg_x, &arg_y, &arg_z) == 3 &&
+         pl->admin )
+    {
+        n = bulk_paste(level, arg_x, arg_y, arg_z, &updates);
+        snprintf( out, out_size, "pasted %d blocks",
+                  (int)apply_bulk(level, updates, n) );
+        return 1;
+    }
+
+    if (sscanf(in, "/edits %64s %d", arg_s, &arg_i) == 2 && pl->admin)
+    {
+        snprintf( out, out_size, "%s: %d edits in %d min", arg_s,
+                  (int)history_count_by(arg_s, time(NULL) - 60L*arg_i),
+                  arg_i );
+        return 1;
+    }
+
+    if ( sscanf(in, "/history %d %d %d", &arg_x, &arg_y, &arg_z) == 3 &&
+         pl->admin )
+    {
+        HistoryEdit edits[2];
+        char age[24];
+        size_t n = history_of_block(arg_x, arg_y, arg_z, edits, 2), i;
+        int len = snprintf(out, out_size, "%d,%d,%d:", arg_x, arg_y, arg_z);
+
+        if (n == 0) snprintf(out + len, out_size - len, " never edited");
+        for (i = 0; i < n && (size_t)len < out_size; ++i)
+        {
+            len += snprintf( out + len, out_size - len, " %s %d>%d %s ago",
+                             edits[i].player, edits[i].old_t, edits[i].new_t,
+                             format_age( age, sizeof(age),
+                                         time(NULL) - edits[i].time ) );
+        }
+        return 1;
+    }
+
+    if (sscanf(in, "/rollback %64s %d", arg_s, &arg_i) == 2 && pl->admin)
+    {
+        size_t found, n = rollback(level, arg_s, arg_i, &found);
+
+        snprintf( out, out_size, "rolled back %d of %d edits by %s",
+                  (int)n, (int)found, arg_s );
+        return 1;
+    }
+
     /* Normal chat message: */
     snprintf(out, out_size, "%s: %s", pl->name, in);
     return 2;
@@ -20,10 +20,15 @@ Type hook_client_block_type(Type t);
 /* Callback for each event. Used to propagate changes on updates etc. */
 void hook_on_event(const Level *level, Event *event);
 
+/* Callback for each server tick. Used for random block updates, such as
+   growing grass, which are applied to a few random blocks per chunk. */
+void hook_on_tick(const Level *level);
+
 /* Callback for each chat messages.
 
    Return 0 if no messages are to be sent, 1 to reply to the sender only, or 2
    to broadcast the message to all players. */
-int hook_on_chat(Player *player, const char *in, char *out, size_t out_size);
+int hook_on_chat( const Level *level, Player *player,
+                  const char *in, char *out, size_t out_size );
 
 #endif /* ndef HOOKS_H_INCLUDED */
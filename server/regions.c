@@ -0,0 +1,343 @@
+#include "regions.h"
+#include "common/logging.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct Region
+{
+    unsigned        work;           /* work done in current tick */
+    usec_t          sleep_until;    /* asleep until this time */
+    unsigned        throttled;      /* number of times put to sleep */
+    bool            frozen;         /* no player nearby? */
+    Event           *parked;        /* events parked while frozen */
+    size_t          num_parked, parked_cap;
+} Region;
+
+/* Per chunk column and per region, indexed by z*width + x: */
+static unsigned *g_chunk_work = NULL;           /* in current tick */
+static unsigned long long *g_chunk_total = NULL;
+static Region   *g_regions = NULL;
+static int      g_chunks_x = 0, g_chunks_z = 0;
+static int      g_regions_x = 0, g_regions_z = 0;
+static usec_t   g_now = 0;      /* start of current tick */
+static size_t   g_num_parked = 0;   /* in all regions */
+static bool     g_parked_full = false;
+static int      g_distance = 0; /* freezing distance, or 0 */
+static bool     g_source_added = false;
+
+bool regions_init(const Level *level)
+{
+    int chunks_x = (level->size.x + CHUNK_SIZE - 1)/CHUNK_SIZE;
+    int chunks_z = (level->size.z + CHUNK_SIZE - 1)/CHUNK_SIZE;
+    int regions_x = (chunks_x + REGION_CHUNKS - 1)/REGION_CHUNKS;
+    int regions_z = (chunks_z + REGION_CHUNKS - 1)/REGION_CHUNKS;
+
+    g_chunk_work  = calloc((size_t)chunks_x*chunks_z, sizeof(*g_chunk_work));
+    g_chunk_total = calloc((size_t)chunks_x*chunks_z, sizeof(*g_chunk_total));
+    g_regions     = calloc((size_t)regions_x*regions_z, sizeof(*g_regions));
+    if (g_chunk_work == NULL || g_chunk_total == NULL || g_regions == NULL)
+    {
+        error("could not allocate region state");
+        free(g_chunk_work);
+        free(g_chunk_total);
+        free(g_regions);
+        g_chunk_work  = NULL;
+        g_chunk_total = NULL;
+        g_regions     = NULL;
+        return false;
+    }
+    g_chunks_x  = chunks_x;
+    g_chunks_z  = chunks_z;
+    g_regions_x = regions_x;
+    g_regions_z = regions_z;
+    return true;
+}
+
+static Region *region_at(int x, int z)
+{
+    int rx = x/REGION_SIZE, rz = z/REGION_SIZE;
+
+    if (rx < 0 || rx >= g_regions_x || rz < 0 || rz >= g_regions_z)
+        return NULL;
+    return &g_regions[rz*g_regions_x + rx];
+}
+
+bool region_awake(int x, int z)
+{
+    Region *r = region_at(x, z);
+
+    return r == NULL || r->sleep_until <= g_now;
+}
+
+usec_t region_wake_time(int x, int z)
+{
+    Region *r = region_at(x, z);
+    usec_t now = usec_now();
+
+    return (r == NULL || r->sleep_until < now) ? now : r->sleep_until;
+}
+
+bool region_charge(int x, int z, int cost)
+{
+    Region *r = region_at(x, z);
+    int cx = x/CHUNK_SIZE, cz = z/CHUNK_SIZE;
+
+    if (r == NULL || cx >= g_chunks_x || cz >= g_chunks_z) return true;
+    g_chunk_work[cz*g_chunks_x + cx]  += cost;
+    g_chunk_total[cz*g_chunks_x + cx] += cost;
+    r->work += cost;
+    if (r->work > REGION_BUDGET && region_awake(x, z))
+    {
+        r->sleep_until = g_now + REGION_SLEEP_USEC;
+        ++r->throttled;
+        warn( "region at %d,%d exceeded its budget (%u units); sleeping",
+              x - x%REGION_SIZE, z - z%REGION_SIZE, r->work );
+        return false;
+    }
+    return region_awake(x, z);
+}
+
+bool region_frozen(int x, int z)
+{
+    Region *r = region_at(x, z);
+
+    return r != NULL && r->frozen;
+}
+
+/* Writes all parked events, marked with EVENT_PARKED so they are parked
+   again when the event queue is restored. */
+static void save_parked(event_sink_fn *sink, void *arg)
+{
+    int rx, rz;
+    size_t i;
+
+    for (rz = 0; rz < g_regions_z; ++rz)
+    {
+        for (rx = 0; rx < g_regions_x; ++rx)
+        {
+            const Region *r = &g_regions[rz*g_regions_x + rx];
+
+            for (i = 0; i < r->num_parked; ++i)
+            {
+                Event ev = r->parked[i];
+                ev.data |= EVENT_PARKED;
+                (*sink)(arg, &ev);
+            }
+        }
+    }
+}
+
+bool region_park(const Event *event)
+{
+    Region *r = region_at(event_x(event), event_z(event));
+
+    if (r == NULL) return false;
+    if (g_num_parked >= REGION_MAX_PARKED)
+    {
+        if (!g_parked_full)
+        {
+            warn( "%d events parked; running work in frozen regions",
+                  (int)g_num_parked );
+            g_parked_full = true;
+        }
+        return false;
+    }
+    if (!g_source_added)
+    {
+        event_queue_add_source(save_parked);
+        g_source_added = true;
+    }
+    if (r->num_parked == r->parked_cap)
+    {
+        size_t cap = r->parked_cap ? 2*r->parked_cap : 64;
+        Event *parked = realloc(r->parked, cap*sizeof(*parked));
+        if (parked == NULL)
+        {
+            error("could not park event; running it instead");
+            return false;
+        }
+        r->parked     = parked;
+        r->parked_cap = cap;
+    }
+    r->parked[r->num_parked++] = *event;
+    ++g_num_parked;
+    return true;
+}
+
+void regions_set_distance(int distance)
+{
+    g_distance = distance > 0 ? distance : 0;
+}
+
+int regions_distance()
+{
+    return g_distance;
+}
+
+bool regions_load(const char *path)
+{
+    FILE *fp = fopen(path, "rt");
+    int distance;
+
+    if (fp == NULL) return false;
+    if (fscanf(fp, "simdistance %d", &distance) != 1)
+    {
+        error("invalid simulation distance in %s", path);
+        fclose(fp);
+        errno = EINVAL;
+        return false;
+    }
+    fclose(fp);
+    regions_set_distance(distance);
+    return true;
+}
+
+bool regions_save(const char *path)
+{
+    char tmp_path[256];
+    FILE *fp;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wt");
+    if (fp == NULL) goto failed;
+    if (fprintf(fp, "simdistance %d\n", g_distance) < 0)
+    {
+        fclose(fp);
+        goto failed;
+    }
+    if (fclose(fp) != 0) goto failed;
+    if (rename(tmp_path, path) != 0) goto failed;
+    return true;
+
+failed:
+    error("could not save simulation distance to %s", path);
+    return false;
+}
+
+/* Returns whether any player is within the freezing distance of region
+   rx/rz, measured horizontally to the nearest block of the region. */
+static bool player_near(int rx, int rz, const Vec3f *players, int num_players)
+{
+    float x1 = rx*REGION_SIZE, x2 = x1 + REGION_SIZE;
+    float z1 = rz*REGION_SIZE, z2 = z1 + REGION_SIZE;
+    int i;
+
+    for (i = 0; i < num_players; ++i)
+    {
+        float dx = 0, dz = 0;
+
+        if (players[i].x < x1) dx = x1 - players[i].x;
+        if (players[i].x > x2) dx = players[i].x - x2;
+        if (players[i].z < z1) dz = z1 - players[i].z;
+        if (players[i].z > z2) dz = players[i].z - z2;
+        if (dx*dx + dz*dz <= (float)g_distance*g_distance) return true;
+    }
+    return false;
+}
+
+void regions_tick(const Vec3f *players, int num_players)
+{
+    int rx, rz, released = 0;
+
+    g_now = usec_now();
+    if (g_chunk_work != NULL)
+    {
+        memset( g_chunk_work, 0,
+                (size_t)g_chunks_x*g_chunks_z*sizeof(*g_chunk_work) );
+    }
+    for (rz = 0; rz < g_regions_z; ++rz)
+    {
+        for (rx = 0; rx < g_regions_x; ++rx)
+        {
+            Region *r = &g_regions[rz*g_regions_x + rx];
+
+            r->work   = 0;
+            r->frozen = g_distance > 0 &&
+                        !player_near(rx, rz, players, num_players);
+
+            /* Let thawed regions catch up with parked work */
+            while ( !r->frozen && r->num_parked > 0 &&
+                    released < REGION_CATCHUP )
+            {
+                Event ev = r->parked[--r->num_parked];
+                ev.time = g_now;
+                if (!event_push(&ev))
+                {
+                    ++r->num_parked;
+                    break;
+                }
+                --g_num_parked;
+                ++released;
+            }
+            if (r->num_parked == 0 && r->parked_cap > 0)
+            {
+                free(r->parked);
+                r->parked     = NULL;
+                r->parked_cap = 0;
+            }
+        }
+    }
+    if (g_num_parked < REGION_MAX_PARKED) g_parked_full = false;
+}
+
+/* Returns the busiest chunk column in region rx/rz in `*cx', `*cz'. */
+static void busiest_chunk(int rx, int rz, int *cx, int *cz)
+{
+    int x1 = rx*REGION_CHUNKS, x2 = x1 + REGION_CHUNKS;
+    int z1 = rz*REGION_CHUNKS, z2 = z1 + REGION_CHUNKS;
+    int x, z;
+
+    *cx = x1;
+    *cz = z1;
+    for (z = z1; z < z2 && z < g_chunks_z; ++z)
+    {
+        for (x = x1; x < x2 && x < g_chunks_x; ++x)
+        {
+            if ( g_chunk_total[z*g_chunks_x + x] >
+                 g_chunk_total[*cz*g_chunks_x + *cx] )
+            {
+                *cx = x;
+                *cz = z;
+            }
+        }
+    }
+}
+
+void regions_stats(char *buf, size_t buf_size)
+{
+    usec_t now = usec_now();
+    size_t len, parked = 0;
+    int rx, rz, asleep = 0, frozen = 0;
+
+    for (rz = 0; rz < g_regions_z; ++rz)
+    {
+        for (rx = 0; rx < g_regions_x; ++rx)
+        {
+            const Region *r = &g_regions[rz*g_regions_x + rx];
+
+            asleep += r->sleep_until > now;
+            frozen += r->frozen;
+            parked += r->num_parked;
+        }
+    }
+    snprintf( buf, buf_size, "%d asleep, %d frozen (%d parked);",
+              asleep, frozen, (int)parked );
+
+    /* List regions throttled so far, with their busiest chunk column */
+    for (rz = 0; rz < g_regions_z; ++rz)
+    {
+        for (rx = 0; rx < g_regions_x; ++rx)
+        {
+            const Region *r = &g_regions[rz*g_regions_x + rx];
+            int cx, cz;
+
+            if (r->throttled == 0) continue;
+            busiest_chunk(rx, rz, &cx, &cz);
+            len = strlen(buf);
+            snprintf( buf + len, buf_size - len, " %d,%d%s x%u",
+                      cx*CHUNK_SIZE, cz*CHUNK_SIZE,
+                      r->sleep_until > now ? "*" : "", r->throttled );
+        }
+    }
+}
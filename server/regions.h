@@ -0,0 +1,86 @@
+#ifndef REGIONS_H_INCLUDED
+#define REGIONS_H_INCLUDED
+
+#include "events.h"
+#include "common/level.h"
+#include "common/timeval.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Activity accounting and throttling of level regions.
+
+Simulation work is charged to the chunk column in which it happens, and
+summed per region: a square of REGION_CHUNKS by REGION_CHUNKS chunk columns.
+A region that does more than REGION_BUDGET units of work in a single server
+tick is put to sleep for REGION_SLEEP_USEC microseconds. Work in a sleeping
+region is deferred until it wakes up, so a runaway simulation in one place
+cannot delay ticks for the whole server. Work that cannot be deferred
+because the event queue is full is done at once rather than dropped.
+
+Optionally, regions farther than a given distance from all players are
+frozen: their work is parked outside the event queue until a player comes
+near, and then released at a bounded rate of REGION_CATCHUP events per
+tick. Parked events are saved with the event queue, marked so that they
+are parked again when it is restored, and the distance is saved in
+REGIONS_FILE. At most
+REGION_MAX_PARKED events are parked; beyond that, work in frozen regions is
+done at once. Random ticks are skipped in frozen and sleeping regions. */
+
+#define REGION_CHUNKS          2        /* region size in chunks */
+#define REGION_SIZE            (REGION_CHUNKS*CHUNK_SIZE)
+#define REGION_BUDGET      20000        /* units of work per tick */
+#define REGION_SLEEP_USEC  2000000      /* 2s */
+#define REGION_CATCHUP      4096        /* parked events released per tick */
+#define REGION_MAX_PARKED (1 << 20)     /* parked events in all regions */
+#define REGIONS_FILE    "regions.txt"
+
+/* Allocates the regions covering `level'. Must be called before any work
+   is charged to regions. */
+bool regions_init(const Level *level);
+
+/* Returns whether the region containing x/z is awake, i.e. whether work
+   there should be done now rather than deferred. Regions wake up at the
+   start of a tick. */
+bool region_awake(int x, int z);
+
+/* Returns the time at which the region containing x/z wakes up, or the
+   current time if it is awake. */
+usec_t region_wake_time(int x, int z);
+
+/* Charges `cost' units of work to the chunk column containing x/z. Puts
+   the region to sleep if this exceeds its budget for the current tick.
+   Returns whether the region is still awake. */
+bool region_charge(int x, int z, int cost);
+
+/* Returns whether the region containing x/z is frozen, i.e. whether work
+   there should be parked with region_park(). */
+bool region_frozen(int x, int z);
+
+/* Parks an event in the frozen region containing its block, to be queued
+   again when the region thaws. Returns false if the event could not be
+   parked, in which case the caller should process it at once. */
+bool region_park(const Event *event);
+
+/* Sets the distance in blocks from the nearest player beyond which regions
+   are frozen, or 0 to never freeze regions. */
+void regions_set_distance(int distance);
+
+/* Returns the distance set with regions_set_distance(). */
+int regions_distance();
+
+/* Loads the freezing distance from `path'. Returns false, with errno set to
+   ENOENT if there is no such file, if it could not be loaded. */
+bool regions_load(const char *path);
+
+/* Saves the freezing distance to `path'. */
+bool regions_save(const char *path);
+
+/* Starts a new tick, given the positions of all players: resets the budgets
+   of all regions, freezes and thaws regions, and releases events parked in
+   thawed regions. */
+void regions_tick(const Vec3f *players, int num_players);
+
+/* Writes a one-line summary of throttled regions to `buf'. */
+void regions_stats(char *buf, size_t buf_size);
+
+#endif /* ndef REGIONS_H_INCLUDED */
@@ -1,5 +1,14 @@
+#include "changes.h"
 #include "events.h"
+#include "history.h"
 #include "hooks.h"
+#include "regions.h"
+#include "server.h"
+#include "takeover.h"
+#include "workers.h"
+#include "worldgen.h"
+#include "zones.h"
+#include "common/blocks.h"
 #include "common/gzip.h"
 #include "common/heap.h"
 #include "common/level.h"
@@ -7,6 +16,7 @@
 #include "common/protocol.h"
 #include "common/timeval.h"
 #include <assert.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -22,13 +32,24 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/un.h>
 
 #define MAX_CLIENTS           32
 #define FRAME_USEC        250000    /* microseconds */
 #define SAVE_INTERVAL        120    /* seconds */
+#define EVENT_MEMORY_LIMIT  (256 << 20) /* bytes */
 
 #define MIN_BUFFER_SIZE  4000
 
+/* Client notifications of bulk updates are spread over ticks, sending at
+   most BULK_BYTES_PER_TICK bytes of block updates per tick. Bulk updates of
+   more than BULK_RESEND_LIMIT blocks resend the whole world instead. */
+#define BULK_BYTES_PER_TICK     16384
+#define BULK_RESEND_LIMIT       65536
+
+#define TAKEOVER_MAGIC      0x4d435478  /* "MCTx" */
+#define TAKEOVER_VERSION    3           /* bump when changing structs below */
+
 
 typedef struct Buffer
 {
@@ -41,6 +62,7 @@ typedef struct Client
 {
     int fd;             /* file descriptor for socket; >0 if connected */
     bool loaded;        /* true after the client has been sent the world map */
+    bool relay;         /* spectator relay, connected through RELAY_SOCKET */
 
     Byte buf[4096];     /* incoming data buffer */
     int buf_pos;        /* incoming data buffer position */
@@ -53,12 +75,55 @@ typedef struct Client
 
 
 static Level    *g_level;                   /* loaded level */
+static char     *g_client_view;             /* world data as sent to clients */
 static int      g_listen_fd;                /* TCP listen socket */
 static Client   g_clients[MAX_CLIENTS];     /* client slots */
 static int      g_num_clients;              /* number of connected clients */
 
+static int      g_relay_fd = -1;            /* relay listen socket */
+static int      g_takeover_fd = -1;         /* for hot upgrades */
+static int      g_takeover_conn = -1;       /* new server taking over */
+static bool     g_handed_over;              /* taken over by new server? */
+
+static Vec3i    *g_pending;                 /* bulk updates not yet sent */
+static size_t   g_pending_pos, g_pending_len, g_pending_cap;
+static bool     g_resend_world;             /* resend world after bulk? */
+
 static volatile bool g_quit_requested;
 
+/* Sent to a new server process taking over, together with the listening
+   socket and the client sockets, in slot order. Followed by the level's
+   blocks, a TakeoverClient and the pending output of each client, and the
+   event queue. The sizes of the structures sent follow the version, so
+   that a change without a version bump is still detected. */
+typedef struct TakeoverHeader
+{
+    unsigned    magic, version;
+    unsigned    header_size, client_size, player_size;
+    Vec3i       size, spawn;
+    unsigned    tick_count;
+    bool        dirty;
+    int         sim_distance;
+    int         num_clients;
+} TakeoverHeader;
+
+typedef struct TakeoverClient
+{
+    int         slot;
+    bool        loaded, relay;
+    int         buf_pos;
+    Byte        buf[4096];
+    Player      pl;
+    int         output_len;
+} TakeoverClient;
+
+/* Returns whether `cl' is a player in the game, as opposed to a relay or a
+   client which has not been sent the world map yet. */
+static bool is_player(const Client *cl)
+{
+    return cl->loaded && !cl->relay;
+}
+
 static void write_client(Client *cl, Byte *buf, int len)
 {
     ssize_t written = (cl->output) ? 0 : write(cl->fd, buf, len);
@@ -159,12 +224,24 @@ static void save_if_dirty()
         info("saving level");
         level_save(g_level, LEVEL_FILE);
     }
+
+    if (history_is_dirty())
+    {
+        info("saving edit history");
+        history_save(HISTORY_FILE);
+    }
+
+    if (zones_is_dirty())
+    {
+        info("saving zones");
+        zones_save(ZONES_FILE);
+    }
 }
 
 static void disconnect(Client *cl)
 {
     Buffer *list, *next;
-    bool loaded = cl->loaded;
+    bool player = is_player(cl);
 
     assert(cl->fd);
 
@@ -179,12 +256,12 @@ static void disconnect(Client *cl)
     cl->loaded = false;
 
     /* Send notification while we still know the client's name: */
-    server_message("%s left the game", cl->pl.name);
+    if (!cl->relay) server_message("%s left the game", cl->pl.name);
 
     memset(cl, 0, sizeof(Client));
     --g_num_clients;
 
-    if (loaded) broadcast_message(PROTO_DISC, cl - g_clients);
+    if (player) broadcast_message(PROTO_DISC, cl - g_clients);
 
     info("disconnected client %d\n", cl - g_clients);
 }
@@ -213,56 +290,46 @@ static void read_text(Byte **buf, int *len, char *out)
     out[n] = '\0';
 }
 
-static bool send_world_data(Client *cl)
+static size_t level_size()
 {
-    size_t  input_size;
-    char    *input;
-    size_t  level_size;
-    Type    *client_blocks;
-    int     x, y, z;
-    size_t  data_size;
-    char    *data;
-    int     nmsg, i;
+    return (size_t)g_level->size.x * g_level->size.y * g_level->size.z;
+}
 
-    /* Allocate client data */
-    level_size = g_level->size.x * g_level->size.y * g_level->size.z;
-    input_size = 4 + level_size;
-    input = malloc(input_size);
-    if (input == NULL)
+/* Creates the client view of the level: a copy of the level's blocks with
+   types translated by hook_client_block_type(), preceded by the 4-byte
+   block count, exactly as compressed for the world data sent to clients.
+   Afterwards, server_update_block() keeps it current. */
+static bool create_client_view()
+{
+    size_t size = level_size(), i;
+    Type *client_blocks;
+
+    g_client_view = malloc(4 + size);
+    if (g_client_view == NULL)
     {
-        error("couldn't allocate memory for client data");
+        error("couldn't allocate memory for client view");
         return false;
     }
+    g_client_view[0] = (size >> 24);
+    g_client_view[1] = (size >> 16);
+    g_client_view[2] = (size >>  8);
+    g_client_view[3] = (size >>  0);
+    client_blocks = (Type*)(g_client_view + 4);
+    for (i = 0; i < size; ++i)
+        client_blocks[i] = hook_client_block_type(g_level->blocks[i]);
+    return true;
+}
 
-    /* Create client data */
-    input[0] = (level_size >> 24);
-    input[1] = (level_size >> 16);
-    input[2] = (level_size >>  8);
-    input[3] = (level_size >>  0);
-    client_blocks = (Type*)(input + 4);
-    for (y = 0; y < g_level->size.y; ++y)
-    {
-        for (z = 0; z < g_level->size.z; ++z)
-        {
-            for (x = 0; x < g_level->size.x; ++x)
-            {
-                Type t = level_get_block(g_level, x, y, z);
-                t = hook_client_block_type(t);
-                client_blocks[x + g_level->size.x*(z + g_level->size.z*y)] = t;
-            }
-        }
-    }
+const Type *server_client_blocks()
+{
+    return (const Type*)(g_client_view + 4);
+}
 
-    /* Compress block data */
-    data = gzip_compress(input, input_size, &data_size);
-    free(input);
-    if (data == NULL)
-    {
-        error("couldn't compress client block data");
-        return false;
-    }
+/* Sends compressed world data to a client in a number of separate chunks */
+static void send_world_chunks(Client *cl, const char *data, size_t data_size)
+{
+    int nmsg, i;
 
-    /* Send client block data in a number of separate chunks */
     nmsg = (data_size + 1023)/1024;
     for (i = 0; i < nmsg; ++i)
     {
@@ -273,6 +340,21 @@ static bool send_world_data(Client *cl)
         memset(block_data + block_len, 0, 1024 - block_len);
         send_message(cl, PROTO_DATA, block_len, block_data, 100*(i+1)/nmsg);
     }
+}
+
+static bool send_world_data(Client *cl)
+{
+    size_t  data_size;
+    char    *data;
+
+    /* Compress block data */
+    data = gzip_compress(g_client_view, 4 + level_size(), &data_size);
+    if (data == NULL)
+    {
+        error("couldn't compress client block data");
+        return false;
+    }
+    send_world_chunks(cl, data, data_size);
     free(data);
 
     return true;
@@ -329,58 +411,223 @@ static void handle_player_HELO(Client *cl,
     send_world_data(cl);
     send_message(cl, PROTO_SIZE, g_level->size.x, g_level->size.y, g_level->size.z);
 
-    /* Send other player's positions to player, and vice versa */
-    server_message("%s joined the game", name);
+    /* Send other player's positions to player, and vice versa. Relays only
+       spectate, so other players aren't told about them. */
+    if (!cl->relay) server_message("%s joined the game", name);
     for (subj = &g_clients[0]; subj != &g_clients[MAX_CLIENTS]; ++subj)
     {
-        if (subj->loaded)
-        {
-            send_initial_position(cl, subj);
-            send_initial_position(subj, cl);
-        }
+        if (is_player(subj)) send_initial_position(cl, subj);
+        if (subj->loaded && !cl->relay) send_initial_position(subj, cl);
     }
 
     send_initial_position(cl, cl);
     cl->loaded = true;
 
-    info("client %d hailed with name `%s'", cl - g_clients, name);
+    info( "%s %d hailed with name `%s'",
+          cl->relay ? "relay" : "client", cl - g_clients, name );
+}
+
+/* Sets the block at x/y/z to `new_t' in the level and the client view, and
+   publishes the change. Stores the block's old type in `*old_t'. Returns
+   whether the block looks different to clients now. */
+static bool set_block(int x, int y, int z, Type new_t, Type *old_t)
+{
+    Type cl_old_t, cl_new_t;
+
+    *old_t = level_set_block(g_level, x, y, z, new_t);
+    if (*old_t == new_t) return false;
+
+    changes_publish(x, y, z, *old_t, new_t);
+
+    cl_old_t = hook_client_block_type(*old_t);
+    cl_new_t = hook_client_block_type(new_t);
+    if (cl_old_t == cl_new_t) return false;
+
+    g_client_view[4 + x + (size_t)g_level->size.x*
+                      (z + (size_t)g_level->size.z*y)] = cl_new_t;
+    return true;
+}
+
+static Type client_view_block(int x, int y, int z)
+{
+    return g_client_view[4 + x + (size_t)g_level->size.x*
+                             (z + (size_t)g_level->size.z*y)];
 }
 
 bool server_update_block( int x, int y, int z, Type new_t,
-                          const struct timeval *event_delay )
+                          int event_delay )
 {
     bool res = false;  /* have clients been notified? */
+    Type old_t;
 
-    /* Try to update level: */
-    Type old_t = level_set_block(g_level, x, y, z, new_t);
-    if (old_t != new_t)
+    if (event_delay >= 0 && event_queue_full()) return false;
+
+    /* Try to update level, and notify clients of update: */
+    if (set_block(x, y, z, new_t, &old_t))
     {
-        Type cl_old_t = hook_client_block_type(old_t);
-        Type cl_new_t = hook_client_block_type(new_t);
+        broadcast_message(PROTO_MODN, x, y, z, client_view_block(x, y, z));
+        res = true;
+    }
+
+    if (old_t != new_t && event_delay >= 0)
+    {
+        Event ev;
+        ev.time = usec_now() + event_delay;
+        ev.data = event_data(EVENT_TYPE_UPDATE, x, y, z, old_t, new_t);
+        event_push(&ev);
+    }
+
+    return res;
+}
 
-        /* Notify clients of update: */
-        if (cl_old_t != cl_new_t)
+size_t server_update_blocks(BlockUpdate *updates, size_t n)
+{
+    size_t i, m = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        BlockUpdate u = updates[i];
+        if (level_get_block(g_level, u.x, u.y, u.z) != u.old_t) continue;
+        server_update_block(u.x, u.y, u.z, u.new_t, -1);
+        updates[m++] = u;
+    }
+    return m;
+}
+
+/* Queues a notification of a bulk update of the block at x/y/z */
+static void add_pending(int x, int y, int z)
+{
+    if (g_resend_world) return;
+    if (g_pending_len - g_pending_pos >= BULK_RESEND_LIMIT)
+    {
+        g_resend_world = true;
+        g_pending_pos  = g_pending_len = 0;
+        return;
+    }
+    if (g_pending_len == g_pending_cap)
+    {
+        size_t new_cap = g_pending_cap ? 2*g_pending_cap : 1024;
+        Vec3i *pending = realloc(g_pending, new_cap*sizeof(*pending));
+
+        if (pending == NULL)
         {
-            broadcast_message(PROTO_MODN, x, y, z, cl_new_t);
-            res = true;
+            error("couldn't queue bulk update notifications");
+            g_resend_world = true;
+            return;
         }
+        g_pending     = pending;
+        g_pending_cap = new_cap;
+    }
+    g_pending[g_pending_len].x = x;
+    g_pending[g_pending_len].y = y;
+    g_pending[g_pending_len].z = z;
+    ++g_pending_len;
+}
 
-        if (event_delay != NULL)
+size_t server_update_blocks_bulk(BlockUpdate *updates, size_t n)
+{
+    size_t i, m = 0;
+    Type old_t;
+
+    if (n > BULK_RESEND_LIMIT)
+    {
+        /* Write the level directly and reindex it once, rather than
+           maintaining its indices block by block. Subscribers to the change
+           feed are sent the box changed, as clients are sent the world. */
+        Type *client_blocks = (Type*)(g_client_view + 4);
+        Vec3i lo = g_level->size, hi = { -1, -1, -1 };
+        int new_t = -1;
+
+        for (i = 0; i < n; ++i)
         {
-            Event ev;
-            tv_now(&ev.base.time);
-            ev.base.type = EVENT_TYPE_UPDATE;
-            ev.update_event.x     = x;
-            ev.update_event.y     = y;
-            ev.update_event.z     = z;
-            ev.update_event.old_t = old_t;
-            ev.update_event.new_t = new_t;
-            tv_add_tv(&ev.base.time, event_delay);
-            event_push(&ev);
+            BlockUpdate u = updates[i];
+            size_t b = u.x + (size_t)g_level->size.x*
+                             (u.z + (size_t)g_level->size.z*u.y);
+
+            if (g_level->blocks[b] != u.old_t || u.old_t == u.new_t)
+                continue;
+            g_level->blocks[b] = u.new_t;
+            client_blocks[b]   = hook_client_block_type(u.new_t);
+            if (u.x < lo.x) lo.x = u.x;
+            if (u.y < lo.y) lo.y = u.y;
+            if (u.z < lo.z) lo.z = u.z;
+            if (u.x > hi.x) hi.x = u.x;
+            if (u.y > hi.y) hi.y = u.y;
+            if (u.z > hi.z) hi.z = u.z;
+            new_t = (new_t < 0 || new_t == u.new_t) ? u.new_t : 255;
+            updates[m++] = u;
         }
+        if (m > 0)
+        {
+            level_index(g_level);
+            g_level->dirty = true;
+            g_resend_world = true;
+            changes_publish_box(lo.x, lo.y, lo.z, hi.x, hi.y, hi.z, new_t);
+        }
+        return m;
     }
 
-    return res;
+    for (i = 0; i < n; ++i)
+    {
+        BlockUpdate u = updates[i];
+        if (level_get_block(g_level, u.x, u.y, u.z) != u.old_t) continue;
+        if (set_block(u.x, u.y, u.z, u.new_t, &old_t))
+            add_pending(u.x, u.y, u.z);
+        updates[m++] = u;
+    }
+    return m;
+}
+
+/* Resends the world to all clients, after bulk updates too large to send
+   block by block, followed by everyone's positions as when joining. */
+static void resend_world()
+{
+    size_t  data_size;
+    char    *data;
+    Client  *cl, *subj;
+
+    data = gzip_compress(g_client_view, 4 + level_size(), &data_size);
+    if (data == NULL)
+    {
+        error("couldn't compress client block data");
+        return;
+    }
+    for (cl = &g_clients[0]; cl != &g_clients[MAX_CLIENTS]; ++cl)
+    {
+        if (!cl->loaded) continue;
+        send_message(cl, PROTO_STRT);
+        send_world_chunks(cl, data, data_size);
+        send_message( cl, PROTO_SIZE, g_level->size.x, g_level->size.y,
+                      g_level->size.z );
+        for (subj = &g_clients[0]; subj != &g_clients[MAX_CLIENTS]; ++subj)
+        {
+            if (subj != cl && is_player(subj)) send_initial_position(cl, subj);
+        }
+        send_initial_position(cl, cl);
+    }
+    free(data);
+    info("resent world to %d clients", g_num_clients);
+}
+
+/* Notifies clients of up to `max' pending bulk updates, sending the blocks'
+   current types, or resends the world if that was called for. */
+static void send_bulk_updates(size_t max)
+{
+    if (g_resend_world)
+    {
+        resend_world();
+        g_resend_world = false;
+        g_pending_pos  = g_pending_len = 0;
+        return;
+    }
+    while (g_pending_pos < g_pending_len && max-- > 0)
+    {
+        const Vec3i *p = &g_pending[g_pending_pos++];
+
+        broadcast_message( PROTO_MODN, p->x, p->y, p->z,
+                           client_view_block(p->x, p->y, p->z) );
+    }
+    if (g_pending_pos == g_pending_len) g_pending_pos = g_pending_len = 0;
 }
 
 static void handle_player_MODR(Client *cl,
@@ -388,11 +635,19 @@ static void handle_player_MODR(Client *cl,
 {
     if (level_index_valid(g_level, x, y, z) && (action == 0 || action == 1))
     {
-        struct timeval delay = { 0, 0 };
         Type t = level_get_block(g_level, x, y, z);
         int v = hook_authorize_update(g_level, &cl->pl,
                                       x, y, z, t, action ? type : 0);
-        if (v < 0 || !server_update_block(x, y, z, v, &delay))
+        bool notified;
+
+        changes_set_cause(CHANGE_PLAYER, cl - g_clients);
+        notified = v >= 0 && server_update_block(x, y, z, v, 0);
+        changes_set_cause(CHANGE_SIMULATION, -1);
+
+        /* Record the edit even if clients see no difference */
+        if (v >= 0 && v != t && level_get_block(g_level, x, y, z) == v)
+            history_add(cl->pl.name, x, y, z, t, v);
+        if (!notified)
         {
             /* Client may have updated the block locally, so send a notification
                to put the correct type back: */
@@ -423,7 +678,7 @@ static void handle_player_CHAT(Client *cl, Byte player, char *message)
 
     (void)player;  /* ignored */
 
-    switch (hook_on_chat(&cl->pl, message, buf, sizeof(buf)))
+    switch (hook_on_chat(g_level, &cl->pl, message, buf, sizeof(buf)))
     {
         case 0: break;
         case 1: send_message(cl, PROTO_CHAT, -1, buf); break;
@@ -476,7 +731,7 @@ static int parse_data(Client *cl, Byte *buf, int len)
                 read_short(&buf, &len, &s2);
                 read_byte(&buf, &len, &b0);
                 read_byte(&buf, &len, &b1);
-                handle_player_MODR(cl, s0, s1, s2, b0, b1);
+                if (!cl->relay) handle_player_MODR(cl, s0, s1, s2, b0, b1);
             } break;
 
         case PROTO_PLYU:
@@ -487,14 +742,14 @@ static int parse_data(Client *cl, Byte *buf, int len)
                 read_short(&buf, &len, &s2);
                 read_byte(&buf, &len, &b1);
                 read_byte(&buf, &len, &b2);
-                handle_player_PLYU(cl, b0, s0, s1, s2, b1, b2);
+                if (!cl->relay) handle_player_PLYU(cl, b0, s0, s1, s2, b1, b2);
             } break;
 
         case PROTO_CHAT:
             {
                 read_byte(&buf, &len, &b0);
                 read_text(&buf, &len,  t0);
-                handle_player_CHAT(cl, b0, t0);
+                if (!cl->relay) handle_player_CHAT(cl, b0, t0);
             } break;
 
         default:
@@ -507,12 +762,29 @@ static int parse_data(Client *cl, Byte *buf, int len)
     return len;
 }
 
+/* Starts a new tick in all regions, freezing those away from players if a
+   simulation distance is set. */
+static void tick_regions()
+{
+    Vec3f players[MAX_CLIENTS];
+    int c, num_players = 0;
+
+    for (c = 0; c < MAX_CLIENTS; ++c)
+    {
+        if (is_player(&g_clients[c]))
+            players[num_players++] = g_clients[c].pl.pos;
+    }
+    regions_tick(players, num_players);
+}
+
 static void server_tick()
 {
     int c, d;
 
     /* Simulate a frame */
+    tick_regions();
     level_tick(g_level);
+    hook_on_tick(g_level);
 
     /* Send player position updates */
     for (c = 0; c < MAX_CLIENTS; ++c)
@@ -521,7 +793,7 @@ static void server_tick()
         {
             for (d = 0; d < MAX_CLIENTS; ++d)
             {
-                if (c != d && g_clients[d].loaded)
+                if (c != d && is_player(&g_clients[d]))
                 {
                     send_updated_position(&g_clients[c], &g_clients[d]);
                 }
@@ -529,7 +801,32 @@ static void server_tick()
         }
     }
 
+    send_bulk_updates(BULK_BYTES_PER_TICK/proto_msg_len(PROTO_MODN));
     broadcast_message(PROTO_TICK);
+    changes_tick();
+}
+
+/* Puts a newly accepted connection in a free client slot. Returns the slot,
+   or -1 if the server is full, in which case `fd' is closed. */
+static int add_client(int fd, bool relay)
+{
+    long nbio = 1;
+    int c;
+
+    for (c = 0; c < MAX_CLIENTS; ++c) if (!g_clients[c].fd) break;
+    if (c == MAX_CLIENTS)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (ioctl(fd, FIONBIO, &nbio) != 0)
+        error("failed to select non-blocking I/O");
+
+    g_clients[c].fd    = fd;
+    g_clients[c].relay = relay;
+    ++g_num_clients;
+    return c;
 }
 
 static void transmit_pending_messages(struct timeval *time_left)
@@ -542,6 +839,16 @@ static void transmit_pending_messages(struct timeval *time_left)
 
     FD_SET(g_listen_fd, &readfds);
     nfds = g_listen_fd + 1;
+    if (g_relay_fd >= 0)
+    {
+        FD_SET(g_relay_fd, &readfds);
+        if (g_relay_fd >= nfds) nfds = g_relay_fd + 1;
+    }
+    if (g_takeover_fd >= 0 && g_takeover_conn < 0)
+    {
+        FD_SET(g_takeover_fd, &readfds);
+        if (g_takeover_fd >= nfds) nfds = g_takeover_fd + 1;
+    }
 
     for (c = 0; c < MAX_CLIENTS; ++c)
     {
@@ -561,11 +868,16 @@ static void transmit_pending_messages(struct timeval *time_left)
         return;
     }
 
+    if (g_takeover_fd >= 0 && FD_ISSET(g_takeover_fd, &readfds))
+    {
+        /* Hand over at the next event, while no update is in progress */
+        g_takeover_conn = takeover_accept(g_takeover_fd);
+    }
+
     if (FD_ISSET(g_listen_fd, &readfds))
     {
         struct sockaddr_in sa;
         socklen_t sl = sizeof(sa);
-        long nbio = 1;
         int fd;
 
         fd = accept(g_listen_fd, (struct sockaddr*)&sa, &sl);
@@ -576,28 +888,37 @@ static void transmit_pending_messages(struct timeval *time_left)
         else
         {
             assert(sl == sizeof(sa));
-
-            if (ioctl(fd, FIONBIO, &nbio) != 0)
-                error("failed to select non-blocking I/O");
-
-            for (c = 0; c < MAX_CLIENTS; ++c) if (!g_clients[c].fd) break;
-            if (c == MAX_CLIENTS)
+            c = add_client(fd, false);
+            if (c < 0)
             {
                 warn("closing connection from %s:%d because server is full",
                     inet_ntoa(sa.sin_addr), ntohs(sa.sin_port) );
-
-                close(fd);
             }
             else
             {
-                g_clients[c].fd = fd;
-                ++g_num_clients;
                 info("accepted connection from %s:%d in client slot %d",
                     inet_ntoa(sa.sin_addr), ntohs(sa.sin_port), c );
             }
         }
     }
 
+    if (g_relay_fd >= 0 && FD_ISSET(g_relay_fd, &readfds))
+    {
+        int fd = accept(g_relay_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            error("couldn't accept relay connection");
+        }
+        else
+        {
+            c = add_client(fd, true);
+            if (c < 0)
+                warn("closing relay connection because server is full");
+            else
+                info("accepted relay connection in client slot %d", c);
+        }
+    }
+
     for (c = 0; c < MAX_CLIENTS; ++c)
     {
         Client * const cl = &g_clients[c];
@@ -656,16 +977,14 @@ static void transmit_pending_messages(struct timeval *time_left)
     }
 }
 
-static void wait_for_next_event(const struct timeval *end)
+static void wait_for_next_event(usec_t end)
 {
     for (;;)
     {
-        struct timeval now, left;
-        int usec_left;
+        struct timeval left;
+        usec_t now = usec_now();
+        long long usec_left = (long long)(end - now);
 
-        gettimeofday(&now, NULL);
-        usec_left = 1000000*(end->tv_sec - now.tv_sec) +
-                            ((int)end->tv_usec - (int)now.tv_usec);
         if (usec_left < 0) break;
 
         left.tv_sec  = usec_left/1000000;
@@ -675,54 +994,214 @@ static void wait_for_next_event(const struct timeval *end)
     }
 }
 
+/* Sends all state to a new server process connected to `fd', so it can
+   take over. Returns whether it did; if not, this server carries on. */
+static bool hand_over(int fd)
+{
+    TakeoverHeader hdr;
+    static TakeoverClient tc;
+    int fds[1 + MAX_CLIENTS], nfds = 0, c;
+    const Buffer *out;
+    struct sigaction sa, old_sa;
+    bool ok = false;
+    char ack;
+
+    /* Don't die if the new process does */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, &old_sa);
+
+    info("handing over to new server process");
+
+    /* Pending notifications are not handed over; queue them all now */
+    send_bulk_updates((size_t)-1);
+
+    /* The new process reads the edit history and zones from disk */
+    if (history_is_dirty() && !history_save(HISTORY_FILE)) goto failed;
+    if (zones_is_dirty() && !zones_save(ZONES_FILE)) goto failed;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic        = TAKEOVER_MAGIC;
+    hdr.version      = TAKEOVER_VERSION;
+    hdr.header_size  = sizeof(TakeoverHeader);
+    hdr.client_size  = sizeof(TakeoverClient);
+    hdr.player_size  = sizeof(Player);
+    hdr.size         = g_level->size;
+    hdr.spawn        = g_level->spawn;
+    hdr.tick_count   = g_level->tick_count;
+    hdr.dirty        = g_level->dirty;
+    hdr.sim_distance = regions_distance();
+    fds[nfds++] = g_listen_fd;
+    for (c = 0; c < MAX_CLIENTS; ++c)
+    {
+        if (g_clients[c].fd) fds[nfds++] = g_clients[c].fd;
+    }
+    hdr.num_clients = nfds - 1;
+    if ( !takeover_send(fd, &hdr, sizeof(hdr), fds, nfds) ||
+         !takeover_write(fd, g_level->blocks, level_size()) ) goto failed;
+
+    for (c = 0; c < MAX_CLIENTS; ++c)
+    {
+        const Client *cl = &g_clients[c];
+
+        if (!cl->fd) continue;
+        memset(&tc, 0, sizeof(tc));
+        tc.slot    = c;
+        tc.loaded  = cl->loaded;
+        tc.relay   = cl->relay;
+        tc.buf_pos = cl->buf_pos;
+        memcpy(tc.buf, cl->buf, cl->buf_pos);
+        tc.pl      = cl->pl;
+        for (out = cl->output; out != NULL; out = out->next)
+            tc.output_len += out->len - out->pos;
+        if (!takeover_write(fd, &tc, sizeof(tc))) goto failed;
+        for (out = cl->output; out != NULL; out = out->next)
+        {
+            if (!takeover_write(fd, out->data + out->pos, out->len - out->pos))
+                goto failed;
+        }
+    }
+
+    /* Events come last, so the new server can read them until end of file */
+    if ( !event_queue_write_fd(fd) || shutdown(fd, SHUT_WR) != 0 ||
+         !takeover_read(fd, &ack, 1) ) goto failed;
+    info("handed over %d clients", hdr.num_clients);
+    ok = true;
+
+failed:
+    if (!ok) error("hand-over failed; continuing");
+    sigaction(SIGPIPE, &old_sa, NULL);
+    return ok;
+}
+
+/* Takes over the sockets and state of the server running in the current
+   directory, instead of loading the level and event queue from disk. */
+static void take_over()
+{
+    TakeoverHeader hdr;
+    static TakeoverClient tc;
+    int fds[1 + MAX_CLIENTS], nfds, fd, i;
+    char ack = 1;
+
+    fd = takeover_connect();
+    if (fd < 0) fatal("couldn't connect to running server");
+    if (!takeover_recv(fd, &hdr, sizeof(hdr), fds, 1 + MAX_CLIENTS, &nfds))
+        fatal("couldn't receive state from running server");
+    if (hdr.magic != TAKEOVER_MAGIC || hdr.version != TAKEOVER_VERSION)
+        fatal("running server has incompatible version");
+    if ( hdr.header_size != sizeof(TakeoverHeader) ||
+         hdr.client_size != sizeof(TakeoverClient) ||
+         hdr.player_size != sizeof(Player) )
+        fatal("running server has incompatible state layout");
+    if (nfds != 1 + hdr.num_clients)
+        fatal("received %d sockets; expected %d", nfds, 1 + hdr.num_clients);
+
+    g_level = level_create(hdr.size.x, hdr.size.y, hdr.size.z);
+    if (!g_level) fatal("couldn't create level");
+    if (!takeover_read(fd, g_level->blocks, level_size()))
+        fatal("couldn't receive level");
+    level_index(g_level);
+    g_level->spawn      = hdr.spawn;
+    g_level->tick_count = hdr.tick_count;
+    g_level->dirty      = hdr.dirty;
+    regions_set_distance(hdr.sim_distance);
+    g_listen_fd = fds[0];
+
+    for (i = 0; i < hdr.num_clients; ++i)
+    {
+        Client *cl;
+
+        if ( !takeover_read(fd, &tc, sizeof(tc)) ||
+             tc.slot < 0 || tc.slot >= MAX_CLIENTS ||
+             tc.buf_pos < 0 || tc.buf_pos > sizeof(tc.buf) ||
+             tc.output_len < 0 )
+            fatal("couldn't receive client state");
+        cl = &g_clients[tc.slot];
+        cl->fd      = fds[1 + i];
+        cl->loaded  = tc.loaded;
+        cl->relay   = tc.relay;
+        cl->buf_pos = tc.buf_pos;
+        memcpy(cl->buf, tc.buf, tc.buf_pos);
+        cl->pl      = tc.pl;
+        if (tc.output_len > 0)
+        {
+            Buffer *out = malloc(sizeof(Buffer) + tc.output_len);
+            if (out == NULL) fatal("couldn't allocate client output");
+            out->next = NULL;
+            out->data = (Byte*)(out + 1);
+            out->len  = tc.output_len;
+            out->pos  = 0;
+            if (!takeover_read(fd, out->data, out->len))
+                fatal("couldn't receive client output");
+            cl->output = cl->output_end = out;
+        }
+        ++g_num_clients;
+    }
+
+    if (!event_queue_read_fd(fd)) fatal("couldn't receive event queue");
+    if (!takeover_write(fd, &ack, 1)) fatal("running server did not let go");
+    close(fd);
+    info( "took over %d clients and %d events from running server",
+          g_num_clients, (int)event_count() );
+}
+
 static void run_server()
 {
     Event event;
 
     /* Schedule initial tick event */
-    tv_now(&event.base.time);
-    tv_add_us(&event.base.time, FRAME_USEC);
-    event.base.type = EVENT_TYPE_TICK;
-    event_push(&event);
+    event.time = usec_now() + FRAME_USEC;
+    event.data = event_data(EVENT_TYPE_TICK, 0, 0, 0, 0, 0);
+    if (!event_push(&event)) fatal("couldn't schedule tick");
 
     /* Schedule initial save event */
-    tv_now(&event.base.time);
-    tv_add_s(&event.base.time, SAVE_INTERVAL);
-    event.base.type = EVENT_TYPE_SAVE;
-    event_push(&event);
+    event.time = usec_now() + 1000000ull*SAVE_INTERVAL;
+    event.data = event_data(EVENT_TYPE_SAVE, 0, 0, 0, 0, 0);
+    if (!event_push(&event)) fatal("couldn't schedule save");
+
+    /* Freeze regions before any restored events are processed */
+    tick_regions();
 
     /* Run indefinitely */
     while (!g_quit_requested)
     {
         Event ev;
 
-        wait_for_next_event(&event_peek()->base.time);
+        if (g_takeover_conn >= 0)
+        {
+            g_handed_over = hand_over(g_takeover_conn);
+            close(g_takeover_conn);
+            g_takeover_conn = -1;
+            if (g_handed_over) return;
+        }
+
+        wait_for_next_event(event_peek()->time);
         event_pop(&ev);
 
-        switch (ev.base.type)
+        switch (event_type(&ev))
         {
         case EVENT_TYPE_TICK:
             {
-                struct timeval now;
+                usec_t now;
 
                 /* Execute tick */
                 server_tick();
 
-                printf( "%s (%d clients; %d events)\n",
+                printf( "%s (%d clients; %d events; %d KiB)\n",
                         (g_level->tick_count%2) ? "*tick*    " : "    *tock*",
-                        g_num_clients, (int)event_count() );
+                        g_num_clients, (int)event_count(),
+                        (int)(event_queue_memory() >> 10) );
 
                 /* Schedule next tick event */
-                tv_now(&now);
-                tv_add_us(&ev.base.time, FRAME_USEC);
-                if (tv_cmp(&ev.base.time, &now) < 0)
+                now = usec_now();
+                ev.time += FRAME_USEC;
+                if (ev.time < now)
                 {
-                    struct timeval d = now;
-                    tv_sub_tv(&d, &ev.base.time);
-                    warn("tick delayed by %d.%06ds", d.tv_sec, d.tv_usec);
-                    ev.base.time = now;
+                    usec_t d = now - ev.time;
+                    warn("tick delayed by %d.%06ds", (int)(d/1000000),
+                                                     (int)(d%1000000));
+                    ev.time = now;
                 }
-                event_push(&ev);
+                if (!event_push(&ev)) fatal("couldn't schedule next tick");
             }
             break;
 
@@ -730,9 +1209,8 @@ static void run_server()
             save_if_dirty();
 
             /* Schedule next save event */
-            tv_now(&ev.base.time);
-            tv_add_s(&ev.base.time, SAVE_INTERVAL);
-            event_push(&ev);
+            ev.time = usec_now() + 1000000ull*SAVE_INTERVAL;
+            if (!event_push(&ev)) fatal("couldn't schedule next save");
             break;
 
         default: break;
@@ -763,6 +1241,27 @@ static void open_server_socket()
     info("listening on port %d", ntohs(sa.sin_port));
 }
 
+static int open_relay_socket()
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, RELAY_SOCKET, sizeof(sa.sun_path) - 1);
+    unlink(sa.sun_path);
+    if ( bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+         listen(fd, 1) != 0 )
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 static void sigint_handler()
 {
     g_quit_requested = true;
@@ -778,21 +1277,133 @@ static void register_signal_handlers()
     sigaction(SIGQUIT, &sa, NULL);
 }
 
-int main()
+/* Renames `path' out of the way, if it exists, by appending `suffix'. */
+static void archive_file(const char *path, const char *suffix)
 {
-    g_level = level_load(LEVEL_FILE);
-    if (!g_level) fatal("couldn't load level");
+    char new_path[256];
 
-    if (!event_queue_read(EVENT_FILE))
-        warn("couldn't restore event queue");
+    snprintf(new_path, sizeof(new_path), "%s%s", path, suffix);
+    if (rename(path, new_path) == 0)
+        info("moved %s of previous level to %s", path, new_path);
     else
-        info("%d events restored to event queue", event_count());
+    if (errno != ENOENT)
+        fatal("couldn't move %s out of the way", path);
+}
+
+/* Loads the level from LEVEL_FILE, or generates a new one from `seed' if
+   there is no such file. The event queue, edit history and zones of a
+   previous level are archived then, as they don't apply to the new one. */
+static Level *load_or_generate_level(unsigned seed)
+{
+    Level *level;
+    usec_t start;
+    char suffix[32];
+
+    if (access(LEVEL_FILE, F_OK) == 0 || errno != ENOENT)
+        return level_load(LEVEL_FILE);
+
+    snprintf(suffix, sizeof(suffix), ".%ld", (long)time(NULL));
+    archive_file(EVENT_FILE, suffix);
+    archive_file(EVENT_TEXT_FILE, suffix);
+    archive_file(HISTORY_FILE, suffix);
+    archive_file(ZONES_FILE, suffix);
+
+    info("%s not found; generating new level from seed %u", LEVEL_FILE, seed);
+    start = usec_now();
+    level = worldgen_create(LEVEL_SIZE_X, LEVEL_SIZE_Y, LEVEL_SIZE_Z, seed);
+    if (level != NULL)
+    {
+        info( "generated %dx%dx%d level in %.3fs", level->size.x,
+              level->size.y, level->size.z, (usec_now() - start)/1e6 );
+    }
+    return level;
+}
+
+int main(int argc, char *argv[])
+{
+    bool takeover = false;
+    unsigned seed = time(NULL);
+    int i;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--takeover") == 0)
+            takeover = true;
+        else
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoul(argv[++i], NULL, 0);
+        else
+            fatal("usage: server [--takeover] [--seed <n>]");
+    }
+
+    if (blocks_load(BLOCKS_FILE))
+        info("block definitions loaded from %s", BLOCKS_FILE);
+    else
+    if (errno != ENOENT)
+        fatal("couldn't load block definitions");
+
+    event_queue_set_limit(EVENT_MEMORY_LIMIT);
+
+    /* Use all cores for parallel parts of the simulation, and for
+       generating a new level */
+    workers_start(sysconf(_SC_NPROCESSORS_ONLN) - 1);
+    info("simulating with %d threads", workers_threads());
+
+    if (takeover)
+    {
+        take_over();
+    }
+    else
+    {
+        g_level = load_or_generate_level(seed);
+        if (!g_level) fatal("couldn't load level");
+
+        /* Only fall back to the old format if nothing was read */
+        if ( !event_queue_read(EVENT_FILE) && event_count() == 0 &&
+             !event_queue_import(EVENT_TEXT_FILE) )
+            warn("couldn't restore event queue");
+        else
+            info("%d events restored to event queue", event_count());
+
+        if (regions_load(REGIONS_FILE))
+            info("simulation distance %d loaded", regions_distance());
+        else
+        if (errno != ENOENT)
+            fatal("couldn't load simulation distance");
+
+        open_server_socket();
+    }
+    if (!create_client_view()) fatal("couldn't create client view");
+    if (!regions_init(g_level)) fatal("couldn't create regions");
+
+    if (history_load(HISTORY_FILE))
+        info("edit history loaded from %s", HISTORY_FILE);
+    else
+    if (errno != ENOENT)
+        fatal("couldn't load edit history");
+
+    if (zones_load(ZONES_FILE))
+        info("%d protected zones loaded from %s", zones_count(), ZONES_FILE);
+    else
+    if (errno != ENOENT)
+        fatal("couldn't load zones");
 
     register_signal_handlers();
 
-    open_server_socket();
+    /* Let spectator relays connect locally */
+    g_relay_fd = open_relay_socket();
+    if (g_relay_fd < 0) warn("spectator relays disabled");
+
+    /* Publish changes to local subscribers */
+    if (!changes_start()) warn("change feed disabled");
+
+    /* Let a new server process take over for hot upgrades */
+    g_takeover_fd = takeover_listen();
+    if (g_takeover_fd < 0) warn("hot upgrades disabled");
+
     run_server();
-    save_if_dirty();
+    workers_stop();
+    if (!g_handed_over) save_if_dirty();
     info("exiting");
     return 0;
 }
@@ -0,0 +1,42 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+#include "common/level.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* A change of a single block from `old_t' to `new_t' */
+typedef struct BlockUpdate
+{
+    unsigned short  x, y, z;
+    Type            old_t, new_t;
+} BlockUpdate;
+
+/* Sets the block at x/y/z to `new_t' and notifies clients. Unless
+   `event_delay' is negative, an update event is scheduled `event_delay'
+   microseconds from now. Returns whether clients have been notified.
+
+   If the event queue is full, the block is left unchanged, so the level is
+   never modified without scheduling the corresponding update event. */
+bool server_update_block( int x, int y, int z, Type new_t,
+                          int event_delay );
+
+/* Applies a batch of updates and notifies clients, without scheduling update
+   events. Updates are applied in order; an update is skipped if its block no
+   longer has type `old_t' by the time it is reached, which resolves
+   conflicting updates of the same block in favour of the first. Applied
+   updates are moved to the front of the array, and their number returned. */
+size_t server_update_blocks(BlockUpdate *updates, size_t n);
+
+/* Like server_update_blocks(), but for large edits: clients are notified
+   of the updates applied over the following ticks, within a bandwidth
+   budget, and if there are too many, the whole world is resent to them
+   instead. Very large batches are written to the level directly, which is
+   then reindexed once. */
+size_t server_update_blocks_bulk(BlockUpdate *updates, size_t n);
+
+/* Returns the level's blocks as clients see them, i.e. translated by
+   hook_client_block_type(), in the same order as the level's blocks. */
+const Type *server_client_blocks();
+
+#endif /* ndef SERVER_H_INCLUDED */
@@ -0,0 +1,186 @@
+#include "sponge.h"
+#include "events.h"
+#include "regions.h"
+#include "common/blocks.h"
+#include "common/logging.h"
+#include "common/timeval.h"
+#include <string.h>
+
+#define MIN_CAPACITY    1024
+
+/* Queue of frontier blocks; entries [head:size) are pending */
+static unsigned     *g_queue = NULL;
+static size_t       g_head = 0, g_size = 0, g_cap = 0;
+static Vec3i        g_level_size;
+static bool         g_init = false;
+static bool         g_scheduled = false;    /* drain event pending? */
+static usec_t       g_last_step = 0;        /* time of last step */
+static BlockUpdate  *g_updates = NULL;
+static size_t       g_updates_size = 0, g_updates_cap = 0;
+
+static void decode(unsigned c, int *x, int *y, int *z)
+{
+    *x = c%g_level_size.x;
+    *z = c/g_level_size.x%g_level_size.z;
+    *y = c/g_level_size.x/g_level_size.z;
+}
+
+/* Writes the frontier as update events, which add their blocks back to the
+   frontier when the event queue is read back. */
+static void save_frontier(event_sink_fn *sink, void *arg)
+{
+    usec_t now = usec_now();
+    size_t i;
+
+    for (i = g_head; i < g_size; ++i)
+    {
+        int x, y, z;
+        Event ev;
+
+        decode(g_queue[i], &x, &y, &z);
+        ev.time = now;
+        ev.data = event_data( EVENT_TYPE_UPDATE, x, y, z,
+                              BLOCK_EMPTY, BLOCK_SUPERSPONGE );
+        (*sink)(arg, &ev);
+    }
+}
+
+static bool queue_push(unsigned c)
+{
+    if (g_size == g_cap)
+    {
+        if (g_head > 0)
+        {
+            /* Reclaim space of blocks already taken off the queue */
+            memmove( g_queue, g_queue + g_head,
+                     (g_size - g_head)*sizeof(*g_queue) );
+            g_size -= g_head;
+            g_head = 0;
+        }
+        if (g_size == g_cap)
+        {
+            size_t cap = g_cap ? 2*g_cap : MIN_CAPACITY;
+            unsigned *queue = realloc(g_queue, cap*sizeof(*queue));
+            if (queue == NULL) return false;
+            g_queue = queue;
+            g_cap   = cap;
+        }
+    }
+    g_queue[g_size++] = c;
+    return true;
+}
+
+/* Schedules the next step right away, or SUPERSPONGE_DELAY after the last
+   step if that is later. */
+static void schedule_step()
+{
+    usec_t now = usec_now();
+    Event ev;
+
+    ev.time = g_last_step + SUPERSPONGE_DELAY;
+    if (ev.time < now) ev.time = now;
+    ev.data = event_data(EVENT_TYPE_DRAIN, 0, 0, 0, 0, 0);
+    g_scheduled = event_push(&ev);
+}
+
+void supersponge_add(const Level *level, int x, int y, int z)
+{
+    if (!g_init)
+    {
+        g_level_size = level->size;
+        event_queue_add_source(save_frontier);
+        g_init = true;
+    }
+
+    if (!queue_push(x + g_level_size.x*(z + g_level_size.z*y)))
+    {
+        error("could not grow super sponge frontier");
+        return;
+    }
+
+    if (!g_scheduled) schedule_step();
+}
+
+static void add_update(int x, int y, int z, Type old_t, Type new_t)
+{
+    BlockUpdate *u;
+
+    if (g_updates_size == g_updates_cap)
+    {
+        size_t cap = g_updates_cap ? 2*g_updates_cap : MIN_CAPACITY;
+        BlockUpdate *updates = realloc(g_updates, cap*sizeof(*updates));
+        if (updates == NULL)
+        {
+            error("could not grow super sponge update buffer");
+            return;
+        }
+        g_updates     = updates;
+        g_updates_cap = cap;
+    }
+    u = &g_updates[g_updates_size++];
+    u->x     = x;
+    u->y     = y;
+    u->z     = z;
+    u->old_t = old_t;
+    u->new_t = new_t;
+}
+
+size_t supersponge_step(const Level *level, BlockUpdate **updates)
+{
+    size_t start = g_head, end = g_head + SUPERSPONGE_STEP_BLOCKS, kept;
+
+    g_scheduled = false;
+    g_last_step = usec_now();
+    g_updates_size = 0;
+    if (end > g_size) end = g_size;
+
+    for (kept = start; g_head < end; ++g_head)
+    {
+        int x, y, z, d;
+
+        decode(g_queue[g_head], &x, &y, &z);
+        if (level_get_block(level, x, y, z) != BLOCK_SUPERSPONGE) continue;
+        if (region_frozen(x, z))
+        {
+            /* Park as the update that would have added it */
+            Event ev;
+            ev.time = g_last_step;
+            ev.data = event_data( EVENT_TYPE_UPDATE, x, y, z,
+                                  BLOCK_EMPTY, BLOCK_SUPERSPONGE );
+            if (region_park(&ev)) continue;
+        }
+        if (!region_awake(x, z))
+        {
+            /* Keep for a later step */
+            g_queue[kept++] = g_queue[g_head];
+            continue;
+        }
+        region_charge(x, z, 1);
+
+        for (d = 0; d < 6; ++d)
+        {
+            int nx = x + DX[d], ny = y + DY[d], nz = z + DZ[d];
+            Type t = level_get_block(level, nx, ny, nz);
+            if (block_is_fluid(t))
+                add_update(nx, ny, nz, t, BLOCK_SUPERSPONGE);
+        }
+        add_update(x, y, z, BLOCK_SUPERSPONGE, BLOCK_EMPTY);
+    }
+
+    /* Move blocks kept back into the queue, right before those pending */
+    g_head = end - (kept - start);
+    memmove(g_queue + g_head, g_queue + start, (kept - start)*sizeof(*g_queue));
+
+    if (g_head == g_size)
+        g_head = g_size = 0;
+    else
+        schedule_step();    /* for blocks left over */
+
+    *updates = g_updates;
+    return g_updates_size;
+}
+
+size_t supersponge_pending()
+{
+    return g_size - g_head;
+}
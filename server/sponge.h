@@ -0,0 +1,36 @@
+#ifndef SPONGE_H_INCLUDED
+#define SPONGE_H_INCLUDED
+
+#include "server.h"
+#include "common/level.h"
+#include <stdlib.h>
+
+/* Super sponge draining.
+
+A super sponge absorbs all fluid connected to it: it turns adjacent fluid
+blocks into super sponges and disappears, so the sponge spreads through the
+fluid in a breadth-first flood fill. The frontier of super sponge blocks is
+kept in a queue and advanced in steps, driven by a single EVENT_TYPE_DRAIN
+event, with at most SUPERSPONGE_STEP_BLOCKS blocks per step.
+
+When the event queue is saved, the frontier is saved as update events for
+its super sponge blocks, which add them back when they are processed. */
+
+#define SUPERSPONGE_DELAY       200000  /* microseconds between steps */
+#define SUPERSPONGE_STEP_BLOCKS  16384  /* maximum blocks per step */
+
+/* Adds the super sponge block at x/y/z to the frontier, and schedules a
+   step if none is pending. */
+void supersponge_add(const Level *level, int x, int y, int z);
+
+/* Takes up to SUPERSPONGE_STEP_BLOCKS blocks off the frontier and computes
+   the updates that advance them. Stores a pointer to the updates in
+   `*updates' (valid until the next step) and returns their number. The
+   caller should apply them and add the new super sponge blocks to the
+   frontier. */
+size_t supersponge_step(const Level *level, BlockUpdate **updates);
+
+/* Returns the number of blocks in the frontier. */
+size_t supersponge_pending();
+
+#endif /* ndef SPONGE_H_INCLUDED */
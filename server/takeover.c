@@ -0,0 +1,179 @@
+#include "takeover.h"
+#include "common/logging.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+static void socket_address(struct sockaddr_un *sa)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    strncpy(sa->sun_path, TAKEOVER_SOCKET, sizeof(sa->sun_path) - 1);
+}
+
+int takeover_listen()
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    socket_address(&sa);
+    unlink(sa.sun_path);
+    if ( bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+         listen(fd, 1) != 0 )
+    {
+        error("couldn't listen on %s: %s", sa.sun_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int takeover_accept(int listen_fd)
+{
+    struct timeval tv;
+    int fd;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) return -1;
+    tv.tv_sec  = TAKEOVER_TIMEOUT;
+    tv.tv_usec = 0;
+    if ( setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0 )
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int takeover_connect()
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    socket_address(&sa);
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+    {
+        error("couldn't connect to %s: %s", sa.sun_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool takeover_send(int fd, const void *buf, size_t len,
+                   const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(TAKEOVER_MAX_FDS*sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    if (nfds > TAKEOVER_MAX_FDS || len == 0) return false;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void*)buf;
+    iov.iov_len  = len;
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control    = control;
+        msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(nfds*sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds*sizeof(int));
+    }
+
+    /* File descriptors go with the first byte; write the rest normally */
+    do n = sendmsg(fd, &msg, 0); while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+    return takeover_write(fd, (const char*)buf + n, len - n);
+}
+
+bool takeover_recv(int fd, void *buf, size_t len,
+                   int *fds, int max_fds, int *nfds)
+{
+    char control[CMSG_SPACE(TAKEOVER_MAX_FDS*sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    *nfds = 0;
+    if (max_fds > TAKEOVER_MAX_FDS || len == 0) return false;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len  = len;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    do n = recvmsg(fd, &msg, 0); while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int), i;
+            int *received = (int*)CMSG_DATA(cmsg);
+
+            for (i = 0; i < count; ++i)
+            {
+                if (*nfds < max_fds)
+                    fds[(*nfds)++] = received[i];
+                else
+                    close(received[i]);
+            }
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+    {
+        error("file descriptors lost in takeover");
+        return false;
+    }
+    return takeover_read(fd, (char*)buf + n, len - n);
+}
+
+bool takeover_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p   += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool takeover_read(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p   += n;
+        len -= n;
+    }
+    return true;
+}
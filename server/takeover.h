@@ -0,0 +1,47 @@
+#ifndef TAKEOVER_H_INCLUDED
+#define TAKEOVER_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Hot upgrades: a running server listens on a Unix domain socket, through
+   which a newly started server process can take over its sockets and state
+   without disconnecting clients. These functions implement the transport;
+   the server decides what state to send over it.
+
+   File descriptors are passed as SCM_RIGHTS ancillary data. All other data
+   is sent in the sending process's native byte order, as both processes run
+   on the same host. */
+
+#define TAKEOVER_SOCKET     "takeover.sock"
+#define TAKEOVER_MAX_FDS    64
+#define TAKEOVER_TIMEOUT    10      /* seconds */
+
+/* Creates a listening socket at TAKEOVER_SOCKET, replacing any previous one.
+   Returns its file descriptor, or -1 on failure. */
+int takeover_listen();
+
+/* Accepts a connection on `listen_fd', with reads and writes timing out
+   after TAKEOVER_TIMEOUT seconds. Returns the connection, or -1. */
+int takeover_accept(int listen_fd);
+
+/* Connects to the server listening at TAKEOVER_SOCKET. Returns the connected
+   socket, or -1 on failure. */
+int takeover_connect();
+
+/* Writes `len' bytes from `buf' to `fd', with `nfds' file descriptors from
+   `fds' attached. Returns whether all data was written. */
+bool takeover_send(int fd, const void *buf, size_t len,
+                   const int *fds, int nfds);
+
+/* Reads exactly `len' bytes into `buf' from `fd', as written by a single call
+   to takeover_send(). Up to `max_fds' file descriptors attached are stored in
+   `fds' and their number in `*nfds'. Returns whether all data was read. */
+bool takeover_recv(int fd, void *buf, size_t len,
+                   int *fds, int max_fds, int *nfds);
+
+/* Writes or reads exactly `len' bytes. Returns false on error or EOF. */
+bool takeover_write(int fd, const void *buf, size_t len);
+bool takeover_read(int fd, void *buf, size_t len);
+
+#endif /* ndef TAKEOVER_H_INCLUDED */
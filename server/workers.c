@@ -0,0 +1,108 @@
+#include "workers.h"
+#include "common/logging.h"
+#include <pthread.h>
+
+static pthread_t        g_threads[MAX_WORKERS];
+static int              g_num_threads = 0;
+static pthread_mutex_t  g_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   g_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   g_done  = PTHREAD_COND_INITIALIZER;
+static unsigned         g_generation = 0;   /* incremented for each job */
+static bool             g_stopping = false;
+
+/* Current job: */
+static worker_fn        *g_fn;
+static void             *g_arg;
+static int              g_parts;            /* number of parts */
+static int              g_next_part;        /* next part to hand out */
+static int              g_parts_done;       /* number of parts finished */
+
+/* Processes parts of the current job until none are left. Must be called
+   with g_lock held. */
+static void run_parts()
+{
+    while (g_next_part < g_parts)
+    {
+        int part = g_next_part++;
+
+        pthread_mutex_unlock(&g_lock);
+        (*g_fn)(g_arg, part);
+        pthread_mutex_lock(&g_lock);
+        if (++g_parts_done == g_parts) pthread_cond_broadcast(&g_done);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    unsigned generation = 0;
+
+    (void)arg;  /* unused */
+
+    pthread_mutex_lock(&g_lock);
+    for (;;)
+    {
+        while (!g_stopping && generation == g_generation)
+            pthread_cond_wait(&g_start, &g_lock);
+        if (g_stopping) break;
+        generation = g_generation;
+        run_parts();
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+int workers_start(int count)
+{
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+    while (g_num_threads < count)
+    {
+        if (pthread_create( &g_threads[g_num_threads], NULL,
+                            worker_main, NULL ) != 0)
+        {
+            warn("could not start worker thread");
+            break;
+        }
+        ++g_num_threads;
+    }
+    return g_num_threads;
+}
+
+int workers_threads()
+{
+    return g_num_threads + 1;
+}
+
+void workers_run(worker_fn *fn, void *arg, int parts)
+{
+    if (g_num_threads == 0)
+    {
+        int part;
+        for (part = 0; part < parts; ++part) (*fn)(arg, part);
+        return;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    g_fn         = fn;
+    g_arg        = arg;
+    g_parts      = parts;
+    g_next_part  = 0;
+    g_parts_done = 0;
+    ++g_generation;
+    pthread_cond_broadcast(&g_start);
+    run_parts();
+    while (g_parts_done < g_parts) pthread_cond_wait(&g_done, &g_lock);
+    pthread_mutex_unlock(&g_lock);
+}
+
+void workers_stop()
+{
+    int i;
+
+    pthread_mutex_lock(&g_lock);
+    g_stopping = true;
+    pthread_cond_broadcast(&g_start);
+    pthread_mutex_unlock(&g_lock);
+    for (i = 0; i < g_num_threads; ++i) pthread_join(g_threads[i], NULL);
+    g_num_threads = 0;
+    g_stopping = false;
+}
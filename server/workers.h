@@ -0,0 +1,30 @@
+#ifndef WORKERS_H_INCLUDED
+#define WORKERS_H_INCLUDED
+
+#include <stdbool.h>
+
+/* A pool of worker threads for data-parallel jobs. A job is split into a
+   number of independent parts, which are handed out to the workers and the
+   calling thread in order, so the result does not depend on the number of
+   threads as long as the parts do not depend on each other. */
+
+#define MAX_WORKERS     16
+
+/* Called to process part `part' of a job. */
+typedef void (worker_fn)(void *arg, int part);
+
+/* Starts up to `count' worker threads (at most MAX_WORKERS) in addition to
+   the main thread. Returns the number of workers actually started. */
+int workers_start(int count);
+
+/* Returns the number of threads that run jobs, including the caller. */
+int workers_threads();
+
+/* Calls `fn' for each part in [0:parts) and returns when all have been
+   processed. Must only be called from the main thread. */
+void workers_run(worker_fn *fn, void *arg, int parts);
+
+/* Stops all worker threads. */
+void workers_stop();
+
+#endif /* ndef WORKERS_H_INCLUDED */
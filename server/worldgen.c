@@ -0,0 +1,204 @@
+#include "worldgen.h"
+#include "workers.h"
+#include "common/blocks.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define ROWS_PER_PART   8       /* rows of blocks generated per part */
+#define OCTAVES         6       /* octaves of terrain noise */
+#define FEATURE_SIZE    128.0f  /* size of the largest hills, in blocks */
+#define SOIL_DEPTH      4       /* blocks of dirt or sand over stone */
+
+/* Seeds of the independent random streams, mixed with the level seed */
+#define SEED_TERRAIN    0x6a09e667u
+#define SEED_ORE_CELL   0xbb67ae85u
+#define SEED_ORE        0x3c6ef372u
+
+typedef struct Generator
+{
+    Level       *level;
+    unsigned    seed;
+    int         sea_level;
+    bool        *failed;    /* per part: ran out of memory? */
+} Generator;
+
+static unsigned hash(unsigned seed, int x, int y, int z)
+{
+    unsigned h = seed ^ (unsigned)x*0x8da6b343u ^ (unsigned)y*0xd8163841u ^
+                        (unsigned)z*0xcb1ab31fu;
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+}
+
+/* Returns a random value in [0:1) for lattice point x/z */
+static float lattice(unsigned seed, int x, int z)
+{
+    return (hash(seed, x, 0, z) >> 8)*(1.0f/16777216.0f);
+}
+
+static float lerp(float a, float b, float t)
+{
+    return a + (b - a)*t;
+}
+
+/* Returns smoothly interpolated value noise in [0:1) at x/z */
+static float value_noise(unsigned seed, float x, float z)
+{
+    int   x0 = (int)floorf(x), z0 = (int)floorf(z);
+    float fx = x - x0, fz = z - z0;
+
+    fx = fx*fx*(3 - 2*fx);
+    fz = fz*fz*(3 - 2*fz);
+    return lerp( lerp( lattice(seed, x0,     z0),
+                       lattice(seed, x0 + 1, z0), fx ),
+                 lerp( lattice(seed, x0,     z0 + 1),
+                       lattice(seed, x0 + 1, z0 + 1), fx ), fz );
+}
+
+/* Stores the terrain height of the blocks in row z in `heights', using
+   `noise' as scratch space for a row. */
+static void row_heights( const Generator *gen, int z,
+                         int *heights, float *noise )
+{
+    const Level *level = gen->level;
+    float amplitude = 0.5f, freq = 1.0f/FEATURE_SIZE, scale = 0.0f;
+    int x, o;
+
+    /* Sum octaves over the whole row, so the loops over x stay simple */
+    for (x = 0; x < level->size.x; ++x) noise[x] = 0.0f;
+    for (o = 0; o < OCTAVES; ++o)
+    {
+        unsigned seed = gen->seed ^ (SEED_TERRAIN + o*0x9e3779b9u);
+
+        for (x = 0; x < level->size.x; ++x)
+            noise[x] += amplitude*value_noise(seed, x*freq, z*freq);
+        scale     += amplitude;
+        amplitude *= 0.5f;
+        freq      *= 2.0f;
+    }
+    for (x = 0; x < level->size.x; ++x)
+    {
+        /* Mostly land, with hills up to half the level's height */
+        float n = 2.0f*noise[x]/scale - 1.0f;
+        int h = gen->sea_level + 4 + (int)floorf(n*level->size.y*0.5f);
+
+        heights[x] = h < 1 ? 1 : h > level->size.y - 2 ? level->size.y - 2 : h;
+    }
+}
+
+/* Returns the ore at x/y/z, or stone. Ores come in clumps of up to 2x2x2
+   blocks; rarer ores are found deeper. */
+static Type stone_or_ore(const Generator *gen, int x, int y, int z, int depth)
+{
+    unsigned cell = hash(gen->seed ^ SEED_ORE_CELL, x >> 1, y >> 1, z >> 1);
+    unsigned r;
+
+    if ((cell & 0xff) >= 6) return BLOCK_STONE_GREY;
+    if ((hash(gen->seed ^ SEED_ORE, x, y, z) & 3) == 0)
+        return BLOCK_STONE_GREY;
+    r = cell >> 8 & 0xff;
+    if (r < 32 && y < gen->level->size.y/4) return BLOCK_ORE1;   /* gold */
+    if (r < 112 && depth > 8) return BLOCK_ORE2;                /* iron */
+    return BLOCK_ORE3;                                          /* coal */
+}
+
+/* Generates rows [part*ROWS_PER_PART:(part + 1)*ROWS_PER_PART) */
+static void generate_part(void *arg, int part)
+{
+    Generator *gen = arg;
+    Level *level = gen->level;
+    int z1 = part*ROWS_PER_PART, z2 = z1 + ROWS_PER_PART;
+    int *heights = malloc(ROWS_PER_PART*level->size.x*sizeof(*heights));
+    float *noise = malloc(level->size.x*sizeof(*noise));
+    int x, y, z;
+
+    if (heights == NULL || noise == NULL)
+    {
+        gen->failed[part] = true;
+        goto done;
+    }
+    if (z2 > level->size.z) z2 = level->size.z;
+    for (z = z1; z < z2; ++z)
+        row_heights(gen, z, heights + (z - z1)*level->size.x, noise);
+
+    /* Fill layer by layer, writing each row of blocks in memory order */
+    for (y = 0; y < level->size.y; ++y)
+    {
+        for (z = z1; z < z2; ++z)
+        {
+            const int *h = heights + (z - z1)*level->size.x;
+            Type *row = &level->blocks[(size_t)level->size.x*
+                                       (z + (size_t)level->size.z*y)];
+
+            for (x = 0; x < level->size.x; ++x)
+            {
+                bool shore = h[x] <= gen->sea_level + 1;
+                Type t;
+
+                if (y == 0)
+                    t = BLOCK_ADMINIUM;
+                else
+                if (y < h[x] - SOIL_DEPTH)
+                    t = stone_or_ore(gen, x, y, z, h[x] - y);
+                else
+                if (y < h[x])
+                    t = shore ? BLOCK_STONE_YELLOW : BLOCK_DIRT;
+                else
+                if (y == h[x])
+                    t = shore ? BLOCK_STONE_YELLOW : BLOCK_GRASS;
+                else
+                if (y <= gen->sea_level)
+                    t = BLOCK_WATER1;
+                else
+                    t = BLOCK_EMPTY;
+                row[x] = t;
+            }
+        }
+    }
+
+done:
+    free(heights);
+    free(noise);
+}
+
+Level *worldgen_create(int size_x, int size_y, int size_z, unsigned seed)
+{
+    Generator gen;
+    int parts = (size_z + ROWS_PER_PART - 1)/ROWS_PER_PART, i;
+    int *heights = malloc(size_x*sizeof(*heights));
+    float *noise = malloc(size_x*sizeof(*noise));
+
+    /* Parts run concurrently, so each reports failure separately */
+    gen.level     = level_create(size_x, size_y, size_z);
+    gen.seed      = seed;
+    gen.sea_level = size_y/2;
+    gen.failed    = calloc(parts, sizeof(*gen.failed));
+    if ( heights == NULL || noise == NULL || gen.level == NULL ||
+         gen.failed == NULL ) goto failed;
+    workers_run(generate_part, &gen, parts);
+    for (i = 0; i < parts; ++i) if (gen.failed[i]) goto failed;
+    level_index(gen.level);
+
+    /* Spawn just above the ground in the middle of the level */
+    row_heights(&gen, gen.level->spawn.z, heights, noise);
+    gen.level->spawn.y = heights[gen.level->spawn.x] + 2;
+    if (gen.level->spawn.y <= gen.sea_level)
+        gen.level->spawn.y = gen.sea_level + 1;
+    gen.level->dirty = true;
+    free(heights);
+    free(noise);
+    free(gen.failed);
+    return gen.level;
+
+failed:
+    free(heights);
+    free(noise);
+    free(gen.failed);
+    level_free(gen.level);
+    return NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef WORLDGEN_H_INCLUDED
+#define WORLDGEN_H_INCLUDED
+
+#include "common/level.h"
+
+/* Generates new levels: rolling terrain of stone under dirt and grass,
+   seas filled with water up to half the level's height with sand on their
+   shores and beds, and ores scattered through the stone, on a floor of
+   adminium.
+
+The level is generated in strips of rows along the x axis, in parallel on
+the worker threads, writing blocks directly into the level, which is
+indexed once at the end. Every block depends on the seed and its position
+only, so a seed always produces the same level, whatever the number of
+threads. */
+
+/* Creates a level of the given size from `seed'. Returns NULL if memory ran
+   out. */
+Level *worldgen_create(int size_x, int size_y, int size_z, unsigned seed);
+
+#endif /* ndef WORLDGEN_H_INCLUDED */
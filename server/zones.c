@@ -0,0 +1,318 @@
+#include "zones.h"
+#include "common/level.h"
+#include "common/logging.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNKS_X    ((LEVEL_SIZE_X + CHUNK_SIZE - 1)/CHUNK_SIZE)
+#define CHUNKS_Z    ((LEVEL_SIZE_Z + CHUNK_SIZE - 1)/CHUNK_SIZE)
+
+typedef struct Zone
+{
+    char            name[ZONE_NAME_LEN + 1];
+    char            owner[STRING_LEN + 1];  /* empty if admins only */
+    int             x1, y1, z1, x2, y2, z2; /* inclusive; x1 <= x2 etc. */
+} Zone;
+
+/* Indices of the zones overlapping a chunk column */
+typedef struct Bucket
+{
+    int             *zones;
+    int             size, capacity;
+} Bucket;
+
+static Zone     *g_zones;
+static int      g_num_zones, g_zones_capacity;
+static Bucket   g_buckets[CHUNKS_Z][CHUNKS_X];
+static bool     g_dirty = false;
+
+static int clamp(int i, int lo, int hi)
+{
+    return i < lo ? lo : i > hi ? hi : i;
+}
+
+/* Calls `fn' for the bucket of each chunk column overlapped by zone `z'.
+   Returns false as soon as `fn' does. */
+static bool for_each_bucket( const Zone *z, int i,
+                             bool (*fn)(Bucket *bucket, int i) )
+{
+    int cx1 = clamp(z->x1/CHUNK_SIZE, 0, CHUNKS_X - 1);
+    int cz1 = clamp(z->z1/CHUNK_SIZE, 0, CHUNKS_Z - 1);
+    int cx2 = clamp(z->x2/CHUNK_SIZE, 0, CHUNKS_X - 1);
+    int cz2 = clamp(z->z2/CHUNK_SIZE, 0, CHUNKS_Z - 1);
+    int cx, cz;
+
+    for (cz = cz1; cz <= cz2; ++cz)
+    {
+        for (cx = cx1; cx <= cx2; ++cx)
+        {
+            if (!fn(&g_buckets[cz][cx], i)) return false;
+        }
+    }
+    return true;
+}
+
+static bool bucket_add(Bucket *bucket, int i)
+{
+    if (bucket->size == bucket->capacity)
+    {
+        int new_capacity = bucket->capacity ? 2*bucket->capacity : 4;
+        int *zones = realloc(bucket->zones, new_capacity*sizeof(*zones));
+
+        if (zones == NULL) return false;
+        bucket->zones    = zones;
+        bucket->capacity = new_capacity;
+    }
+    bucket->zones[bucket->size++] = i;
+    return true;
+}
+
+static bool bucket_remove(Bucket *bucket, int i)
+{
+    int n;
+
+    for (n = 0; n < bucket->size; ++n)
+    {
+        if (bucket->zones[n] == i)
+        {
+            bucket->zones[n] = bucket->zones[--bucket->size];
+            break;
+        }
+    }
+    return true;
+}
+
+/* Renumbers the last zone to `i' */
+static bool bucket_renumber(Bucket *bucket, int i)
+{
+    int n;
+
+    for (n = 0; n < bucket->size; ++n)
+    {
+        if (bucket->zones[n] == g_num_zones) bucket->zones[n] = i;
+    }
+    return true;
+}
+
+static int find_zone(const char *name)
+{
+    int i;
+
+    for (i = 0; i < g_num_zones; ++i)
+    {
+        if (strcmp(g_zones[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static void swap(int *a, int *b)
+{
+    int t = *a;
+    *a = *b;
+    *b = t;
+}
+
+bool zone_add( const char *name, int x1, int y1, int z1,
+               int x2, int y2, int z2, const char *owner )
+{
+    Zone *z;
+
+    if (find_zone(name) >= 0) return false;
+    if (g_num_zones == g_zones_capacity)
+    {
+        int new_capacity = g_zones_capacity ? 2*g_zones_capacity : 16;
+        Zone *zones = realloc(g_zones, new_capacity*sizeof(*zones));
+
+        if (zones == NULL) return false;
+        g_zones = zones;
+        g_zones_capacity = new_capacity;
+    }
+
+    z = &g_zones[g_num_zones];
+    snprintf(z->name, sizeof(z->name), "%s", name);
+    snprintf(z->owner, sizeof(z->owner), "%s", owner ? owner : "");
+    if (x1 > x2) swap(&x1, &x2);
+    if (y1 > y2) swap(&y1, &y2);
+    if (z1 > z2) swap(&z1, &z2);
+    z->x1 = x1, z->y1 = y1, z->z1 = z1;
+    z->x2 = x2, z->y2 = y2, z->z2 = z2;
+    if (!for_each_bucket(z, g_num_zones, bucket_add))
+    {
+        for_each_bucket(z, g_num_zones, bucket_remove);
+        return false;
+    }
+    ++g_num_zones;
+    g_dirty = true;
+    return true;
+}
+
+bool zone_remove(const char *name)
+{
+    int i = find_zone(name);
+
+    if (i < 0) return false;
+    for_each_bucket(&g_zones[i], i, bucket_remove);
+    if (i != --g_num_zones)
+    {
+        /* Move the last zone into the gap */
+        g_zones[i] = g_zones[g_num_zones];
+        for_each_bucket(&g_zones[i], i, bucket_renumber);
+    }
+    g_dirty = true;
+    return true;
+}
+
+static bool contains(const Zone *zone, int x, int y, int z)
+{
+    return x >= zone->x1 && x <= zone->x2 && y >= zone->y1 &&
+           y <= zone->y2 && z >= zone->z1 && z <= zone->z2;
+}
+
+/* Returns the bucket for the chunk column containing x/z, or NULL */
+static const Bucket *bucket_at(int x, int z)
+{
+    if (x < 0 || z < 0) return NULL;
+    x /= CHUNK_SIZE;
+    z /= CHUNK_SIZE;
+    return (x < CHUNKS_X && z < CHUNKS_Z) ? &g_buckets[z][x] : NULL;
+}
+
+bool zone_allows(int x, int y, int z, const char *player)
+{
+    const Bucket *bucket = bucket_at(x, z);
+    int n;
+
+    if (bucket == NULL) return true;
+    for (n = 0; n < bucket->size; ++n)
+    {
+        const Zone *zone = &g_zones[bucket->zones[n]];
+
+        if ( contains(zone, x, y, z) &&
+             (zone->owner[0] == '\0' || strcmp(zone->owner, player) != 0) )
+            return false;
+    }
+    return true;
+}
+
+const char *zone_at(int x, int y, int z)
+{
+    const Bucket *bucket = bucket_at(x, z);
+    int n;
+
+    if (bucket == NULL) return NULL;
+    for (n = 0; n < bucket->size; ++n)
+    {
+        const Zone *zone = &g_zones[bucket->zones[n]];
+
+        if (contains(zone, x, y, z)) return zone->name;
+    }
+    return NULL;
+}
+
+int zones_count()
+{
+    return g_num_zones;
+}
+
+bool zones_is_dirty()
+{
+    return g_dirty;
+}
+
+static void clear_zones()
+{
+    int x, z;
+
+    for (z = 0; z < CHUNKS_Z; ++z)
+    {
+        for (x = 0; x < CHUNKS_X; ++x) g_buckets[z][x].size = 0;
+    }
+    g_num_zones = 0;
+}
+
+bool zones_load(const char *path)
+{
+    Zone *old_zones = NULL;
+    int old_num_zones = g_num_zones, line_no = 0, i;
+    bool old_dirty = g_dirty;
+    char line[256], name[ZONE_NAME_LEN + 1], owner[STRING_LEN + 1];
+    char keyword[16];
+    FILE *fp;
+
+    fp = fopen(path, "rt");
+    if (fp == NULL) return false;
+
+    /* Keep the current zones, to restore them in case of errors */
+    if (g_num_zones > 0)
+    {
+        old_zones = malloc(g_num_zones*sizeof(*old_zones));
+        if (old_zones == NULL) goto failed;
+        memcpy(old_zones, g_zones, g_num_zones*sizeof(*old_zones));
+    }
+    clear_zones();
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        int x1, y1, z1, x2, y2, z2, n;
+
+        ++line_no;
+        n = sscanf( line, "%15s %32s %d %d %d %d %d %d %64s", keyword, name,
+                    &x1, &y1, &z1, &x2, &y2, &z2, owner );
+        if (n <= 0 || keyword[0] == '#') continue;
+        if ( strcmp(keyword, "zone") != 0 || n < 8 ||
+             !zone_add(name, x1, y1, z1, x2, y2, z2, n == 9 ? owner : NULL) )
+            goto invalid;
+    }
+    if (ferror(fp))
+    {
+        error("could not read %s: %s", path, strerror(errno));
+        goto restore;
+    }
+    fclose(fp);
+    free(old_zones);
+    g_dirty = false;
+    return true;
+
+invalid:
+    error("%s:%d: invalid zone", path, line_no);
+restore:
+    clear_zones();
+    for (i = 0; i < old_num_zones; ++i)
+    {
+        const Zone *z = &old_zones[i];
+
+        zone_add( z->name, z->x1, z->y1, z->z1, z->x2, z->y2, z->z2,
+                  z->owner[0] ? z->owner : NULL );
+    }
+    free(old_zones);
+    g_dirty = old_dirty;
+failed:
+    fclose(fp);
+    return false;
+}
+
+bool zones_save(const char *path)
+{
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "wt");
+    if (fp == NULL) goto failed;
+    for (i = 0; i < g_num_zones; ++i)
+    {
+        const Zone *z = &g_zones[i];
+
+        fprintf( fp, "zone %s %d %d %d %d %d %d%s%s\n", z->name,
+                 z->x1, z->y1, z->z1, z->x2, z->y2, z->z2,
+                 z->owner[0] ? " " : "", z->owner );
+    }
+    if (fclose(fp) != 0) goto failed;
+    g_dirty = false;
+    return true;
+
+failed:
+    error("failed to write zones to %s", path);
+    return false;
+}
@@ -0,0 +1,54 @@
+#ifndef ZONES_H_INCLUDED
+#define ZONES_H_INCLUDED
+
+#include <stdbool.h>
+
+/* Protected zones: boxes of blocks that only admins, and the zone's owner
+   if it has one, may change.
+
+Each zone is listed in a bucket for every chunk column it overlaps, so
+checking a block only tests the zones in its own column, however many
+zones there are elsewhere.
+
+Zones are saved in the text file ZONES_FILE, one per line:
+
+    zone <name> <x1> <y1> <z1> <x2> <y2> <z2> [owner]
+
+where the coordinates are opposite corners of the box, inclusive. Empty
+lines and lines starting with `#' are ignored. */
+
+#define ZONES_FILE      "zones.txt"
+#define ZONE_NAME_LEN   32
+
+/* Loads zones from `path', replacing all current zones. Returns false
+   (keeping the current zones) if the file could not be read or contains
+   errors. */
+bool zones_load(const char *path);
+
+/* Saves all zones to `path'. */
+bool zones_save(const char *path);
+
+/* Returns whether zones have changed since they were loaded or saved. */
+bool zones_is_dirty();
+
+/* Adds a zone named `name' covering the box with corners x1/y1/z1 and
+   x2/y2/z2, which may be changed by the player named `owner' (if not NULL)
+   besides admins. Returns false if a zone with that name exists already or
+   memory ran out. */
+bool zone_add( const char *name, int x1, int y1, int z1,
+               int x2, int y2, int z2, const char *owner );
+
+/* Removes the zone named `name'. Returns false if there is none. */
+bool zone_remove(const char *name);
+
+/* Returns whether the player named `player' may change the block at x/y/z,
+   i.e. whether every zone containing it is owned by that player. */
+bool zone_allows(int x, int y, int z, const char *player);
+
+/* Returns the name of a zone containing the block at x/y/z, or NULL. */
+const char *zone_at(int x, int y, int z);
+
+/* Returns the number of zones. */
+int zones_count();
+
+#endif /* ndef ZONES_H_INCLUDED */